@@ -3,7 +3,11 @@
 #include <memory>
 #include <fstream>
 #include <vector>
+#include <map>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include <boost/filesystem.hpp>
 
@@ -11,23 +15,64 @@
 
 #include <ros/ros.h>
 #include <ros/package.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 
 #include <gazebo/physics/physics.hh>
 #include <gazebo/common/common.hh>
 #include <gazebo/gazebo.hh>
 
+#include <gazebo/transport/transport.hh>
+
 #include "modelcreator.h"
+#include "tilepager.h"
+#include "regionset.h"
+#include "gzsatellite/ConvertCoordinates.h"
 
 namespace gazebo {
 
   class TilePlugin: public WorldPlugin {
     public:
       TilePlugin();
+      ~TilePlugin();
 
       void Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf);
 
     private:
       physics::WorldPtr parent_;
+
+      // async mode: the world model is created and inserted in the background,
+      // until stop_ is set
+      std::thread worker_;
+      std::shared_ptr<std::atomic<bool>> stop_;
+
+      // paging mode: ground pages follow a model around the world
+      std::unique_ptr<gzsatellite::TilePager> pager_;
+      std::string follow_name_;
+      physics::ModelPtr follow_;
+      event::ConnectionPtr update_connection_;
+      bool ready_ = false;
+
+      // coordinate conversions for other nodes, once the world is known
+      ros::ServiceServer convert_service_;
+      std::unique_ptr<gzsatellite::GeoConverter> converter_;
+      std::mutex converter_mutex_;
+
+      // where world creation spends its time
+      ros::Publisher diagnostics_pub_;
+      std::string trace_file_;
+      std::map<std::string, double> failed_reported_;   ///< tiles failed as of each status's last report
+
+      void OnUpdate();
+      void PublishDiagnostics(const gzsatellite::Profiler& profiler, const std::string& name,
+                              bool page);
+      bool OnConvert(gzsatellite::ConvertCoordinates::Request& req,
+                     gzsatellite::ConvertCoordinates::Response& res);
+      void InsertWorld(const gzsatellite::GeoParams& params,
+                       const std::string& name, unsigned int quality,
+                       unsigned int placeholder_levels = 0);
+      void InsertRegions(const gzsatellite::GeoParams& params,
+                         const std::vector<gzsatellite::Region>& regions,
+                         const std::string& name, unsigned int quality);
   };
 }
 
@@ -0,0 +1,69 @@
+/**
+ * BoundedQueue: a blocking multi-producer/multi-consumer FIFO with a fixed
+ * capacity, used to connect the stages of the tile pipeline. Producers
+ * block while the queue is full so that a fast stage cannot run arbitrarily
+ * far ahead of a slow one.
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace gzsatellite {
+
+  template <typename T>
+  class BoundedQueue
+  {
+  public:
+    explicit BoundedQueue(size_t capacity)
+      : capacity_(std::max<size_t>(1, capacity)), closed_(false) {}
+
+    /// Append an item, waiting for room. Returns false if the queue was
+    /// closed (and the item dropped).
+    bool push(T item)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_full_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+      if (closed_) return false;
+
+      items_.push_back(std::move(item));
+      not_empty_.notify_one();
+      return true;
+    }
+
+    /// Take the oldest item, waiting for one. Returns false once the queue
+    /// is closed and drained.
+    bool pop(T& item)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+      if (items_.empty()) return false;
+
+      item = std::move(items_.front());
+      items_.pop_front();
+      not_full_.notify_one();
+      return true;
+    }
+
+    /// No more items will be pushed; consumers drain what is left
+    void close()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+      not_empty_.notify_all();
+      not_full_.notify_all();
+    }
+
+  private:
+    const size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+  };
+
+}
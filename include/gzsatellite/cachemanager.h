@@ -0,0 +1,135 @@
+/**
+ * CacheManager class for managing:
+ *    - The total size of the tile cache and of the stitched textures
+ *    - Least-recently-used eviction to stay within a byte budget
+ *    - Hit/miss/eviction counters
+ *
+ * Every use of a tile or texture is appended to a journal (cache.ledger in
+ * the root directory). Startup replays the journal rather than scanning
+ * the cache; only the very first run (without a journal) scans it once.
+ *
+ * With deduplicated tiles, each tile is charged the full size of its
+ * contents, so the budget is conservative.
+ */
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <ctime>
+#include <cstdint>
+
+#include <boost/filesystem.hpp>
+
+#include "tilecache.h"
+
+namespace gzsatellite {
+
+  class CacheManager
+  {
+  public:
+    struct Stats
+    {
+      uint64_t tile_hits = 0;
+      uint64_t tile_misses = 0;
+      uint64_t texture_hits = 0;
+      uint64_t texture_misses = 0;
+      uint64_t evictions = 0;
+      uint64_t evicted_bytes = 0;
+      uint64_t bytes = 0;     ///< current size of everything tracked
+      uint64_t budget = 0;
+    };
+
+    /// root is the directory holding mapscache/ and materials/
+    CacheManager(const boost::filesystem::path& root, uint64_t budget);
+    ~CacheManager();
+
+    CacheManager(const CacheManager&) = delete;
+    CacheManager& operator=(const CacheManager&) = delete;
+
+    /// Use an already open cache for a service's tiles (instead of opening
+    /// the service's cache directory again). Attach caches before the first
+    /// touch, as that is when the journal is loaded.
+    void attach(const std::string& service, const std::shared_ptr<TileCache>& cache);
+
+    /// Record a read of tile [x,y,z]; hit says whether it was already
+    /// cached. The tile is pinned until as many unpinTile() calls.
+    void touchTile(const std::string& service, int x, int y, int z, bool hit);
+    void unpinTile(const std::string& service, int x, int y, int z);
+
+    /// Record a use of tile [x,y,z] that didn't read it (e.g., through a
+    /// texture made from it), if it is known to be cached
+    void refreshTile(const std::string& service, int x, int y, int z);
+
+    /// Record a use of a stitched texture (and its material script and
+    /// holes record, see holesPath()). The texture is pinned until as many
+    /// unpinTexture() calls.
+    void touchTexture(const boost::filesystem::path& texture,
+                      const boost::filesystem::path& script, bool hit);
+    void unpinTexture(const boost::filesystem::path& texture);
+
+    /// Evict least recently used entries until the cache fits the budget.
+    /// Pinned entries (in use) are never evicted.
+    void evict();
+
+    Stats stats() const;
+
+    /// The record of the tiles missing from a texture, which goes with it
+    static boost::filesystem::path holesPath(const boost::filesystem::path& texture)
+    { return texture.parent_path()/(texture.stem().string() + ".holes"); }
+
+  private:
+    struct Entry
+    {
+      std::string key;
+      uint64_t bytes;
+      std::time_t time;
+      unsigned int pins;  ///< uses by this process still going on
+    };
+
+    boost::filesystem::path root_;
+    boost::filesystem::path ledger_path_;
+    uint64_t budget_;
+    bool loaded_;
+
+    mutable std::mutex mutex_;
+
+    /// least recently used first
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+
+    std::ofstream journal_;
+    size_t journal_lines_;
+
+    std::map<std::string, std::shared_ptr<TileCache>> caches_;
+    Stats stats_;
+
+    /// Replay the journal (or seed it by scanning the cache once) on first use
+    void load();
+    void seed();
+
+    /// Move (or add) an entry to the most recently used end, pinning it
+    /// once more if pin
+    void touch(const std::string& key, uint64_t bytes, std::time_t time, bool pin);
+    void unpin(const std::string& key);
+    void erase(const std::string& key);
+
+    /// Remove an entry's files from disk
+    bool remove(const std::string& key);
+
+    /// Rewrite the journal with one line per live entry
+    void rewriteJournal();
+
+    /// Cache holding a service's tiles (opened on demand)
+    std::shared_ptr<TileCache> cacheFor(const std::string& service);
+
+    boost::filesystem::path texturesDir() const { return root_/"materials"/"textures"; }
+    boost::filesystem::path scriptsDir() const { return root_/"materials"/"scripts"; }
+  };
+
+}
@@ -0,0 +1,78 @@
+/**
+ * Writing of BC1 (DXT1) compressed DDS textures, entirely on the CPU.
+ *
+ * BC1 stores every 4x4 block of pixels in 8 bytes: two RGB565 end points
+ * and a 2-bit index per pixel into the 4 colours between them. At half a
+ * byte per pixel, a BC1 texture takes a sixth to an eighth of the VRAM of
+ * the same texture uploaded from a JPEG, and the GPU samples it directly.
+ *
+ * End points are chosen by fitting the bounding box of each block's colours
+ * (J.M.P. van Waveren, "Real-Time DXT Compression", 2006). The encoder
+ * is scalar C++, one block at a time; rows of blocks are encoded on all
+ * cores.
+ */
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+
+#include <boost/filesystem.hpp>
+
+#include <opencv2/opencv.hpp>
+
+namespace gzsatellite {
+
+  /// Compress an 8-bit BGR image to BC1 blocks (8 bytes each, row-major).
+  /// Images that aren't a multiple of 4 pixels are padded by repeating the
+  /// last row/column. Rows of blocks are encoded on threads threads (0: all
+  /// cores).
+  void encodeBC1(const cv::Mat& bgr, std::vector<uint8_t>& blocks, unsigned int threads = 0);
+
+  /// Write an 8-bit BGR image and its full mip chain as a BC1 DDS file
+  bool writeDDS(const boost::filesystem::path& path, const cv::Mat& bgr,
+                unsigned int threads = 0);
+
+  /// Writes a BC1 DDS file with mipmaps from consecutive batches of rows.
+  /// The full-size level goes straight to the file; each smaller level is
+  /// made from pairs of rows of the one above as they come, and kept in a
+  /// temporary file next to it until finish() appends it.
+  class DDSWriter
+  {
+  public:
+    DDSWriter(const boost::filesystem::path& path, int width, int height,
+              unsigned int threads = 0);
+    ~DDSWriter();
+
+    DDSWriter(const DDSWriter&) = delete;
+    DDSWriter& operator=(const DDSWriter&) = delete;
+
+    /// Append the next rows (8-bit BGR, width columns)
+    bool write(const cv::Mat& rows);
+
+    /// Finish the file once all rows are written
+    bool finish();
+
+  private:
+    struct Level
+    {
+      int width, height;
+      int rows = 0;             ///< rows received so far
+      cv::Mat unencoded;        ///< rows short of a whole row of blocks
+      cv::Mat unpaired;         ///< a row waiting for its pair, to halve
+      boost::filesystem::path tmp_path;
+      std::unique_ptr<std::ofstream> tmp;
+    };
+
+    std::ofstream out_;
+    std::vector<Level> levels_;
+    unsigned int threads_;
+    bool ok_;
+
+    /// Add rows to a level (and, halved, to the levels below it)
+    void add(size_t level, const cv::Mat& rows);
+  };
+
+}
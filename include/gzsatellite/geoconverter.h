@@ -0,0 +1,64 @@
+/**
+ * Batched conversions between the coordinate frames of a world model:
+ *
+ *    LATLON  longitude, latitude in degrees (x, y)
+ *    TILE    tile column, row at the world's zoom level, fractional
+ *    PIXEL   the same in pixels of the tile images
+ *    LOCAL   meters east, north of the world origin: Gazebo's x, y
+ *
+ * The world is drawn in Web Mercator, with each tile stretched to a fixed
+ * size in meters (e.g., the ground resolution at one latitude); LOCAL is
+ * that frame (as the vehicles in the simulation see it), not a tangent
+ * plane. It is exact at the scale latitude and stretched by the usual
+ * Mercator distortion north and south of it.
+ *
+ * Points are passed as separate x and y arrays and converted in tight
+ * loops, and large batches are split across all cores. Conversions to or
+ * from LATLON call log/tan (or atan/sinh) for every point, which keeps
+ * them scalar. Invalid points (outside the Mercator latitudes or longitude
+ * range) become NaN instead of throwing.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace gzsatellite {
+
+  class GeoConverter
+  {
+  public:
+    enum class Frame { LATLON, TILE, PIXEL, LOCAL };
+
+    /// The world origin (LOCAL (0,0)) in tile coordinates at a zoom level,
+    /// and the size of a tile in LOCAL meters
+    GeoConverter(double origin_x, double origin_y, unsigned int zoom, double tile_size)
+      : GeoConverter(origin_x, origin_y, zoom, tile_size, tile_size) {}
+
+    /// Same, for tiles that are stretched to a different width (east) and
+    /// height (north) in LOCAL meters
+    GeoConverter(double origin_x, double origin_y, unsigned int zoom,
+                 double tile_width, double tile_height);
+
+    /// Convert n points; out_x/out_y may be the same arrays as x/y
+    void convert(Frame from, Frame to, const double* x, const double* y, size_t n,
+                 double* out_x, double* out_y) const;
+
+    /// Convert a single point
+    void convert(Frame from, Frame to, double x, double y,
+                 double& out_x, double& out_y) const
+    { convert(from, to, &x, &y, 1, &out_x, &out_y); }
+
+    unsigned int zoom() const { return zoom_; }
+
+  private:
+    double origin_x_, origin_y_;
+    unsigned int zoom_;
+    double tile_width_, tile_height_;
+
+    /// Convert a block of points on the calling thread
+    void convertBlock(Frame from, Frame to, const double* x, const double* y, size_t n,
+                      double* out_x, double* out_y) const;
+  };
+
+}
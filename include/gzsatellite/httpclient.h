@@ -0,0 +1,139 @@
+/**
+ * HttpClient class for managing:
+ *    - Long-lived, reused HTTP connections to tile servers
+ *    - HTTP/2 multiplexing of concurrent requests (when offered)
+ *    - Per-server request rate limits (a server may span several hosts)
+ *    - Connection statistics
+ *
+ * All transfers run on a single curl multi handle that is driven by a
+ * background thread. The multi handle owns the connection cache, so
+ * connections (and TLS sessions) to a host outlive individual requests.
+ */
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <set>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+
+#include <curl/curl.h>
+
+namespace gzsatellite {
+
+  struct HttpResponse
+  {
+    long status_code = 0;   ///< HTTP status (0 if the transfer failed)
+    std::string body;       ///< response body
+    std::string url;        ///< requested URL
+    std::string error;      ///< curl error message, if any
+
+    /// response headers of the final response, keyed by lowercase name
+    std::map<std::string, std::string> headers;
+  };
+
+  class HttpClient
+  {
+  public:
+    /// Buckets of the latency histogram, by upper bound in ms (the last
+    /// one is open-ended)
+    static constexpr size_t LATENCY_BUCKETS = 8;
+    static double latencyBound(size_t bucket);
+
+    struct Stats
+    {
+      uint64_t requests = 0;    ///< completed transfers
+      uint64_t handshakes = 0;  ///< transfers that opened a new connection
+      uint64_t reused = 0;      ///< transfers that reused a connection
+      uint64_t http2 = 0;       ///< transfers carried over HTTP/2
+      uint64_t bytes = 0;       ///< response body bytes received
+      uint64_t delayed = 0;     ///< requests held back by the rate limit
+      double latency = 0;       ///< total time of all transfers (s)
+      uint64_t latency_histogram[LATENCY_BUCKETS] = {};  ///< transfers per bucket
+    };
+
+    /// At most max_host_connections are opened to any one host. Requests
+    /// beyond that wait for (or multiplex onto) an existing connection.
+    explicit HttpClient(unsigned int max_host_connections = 8);
+    ~HttpClient();
+
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
+
+    /// Blocking GET with optional extra request headers ("Name: value").
+    /// Safe to call from many threads at once. Once stop is set, the
+    /// request is given up (within a second), and fails. Requests with the
+    /// same limit share its rate limit (see setRateLimit).
+    HttpResponse get(const std::string& url,
+                     const std::vector<std::string>& headers = {},
+                     const std::atomic<bool>* stop = nullptr,
+                     const std::string& limit = std::string());
+
+    /// Limit the requests started under limit (e.g. a tile server's URL
+    /// template, whichever of its hosts they go to) to rate per second on
+    /// average, in bursts of up to burst requests (token bucket). get()
+    /// waits for its turn. A rate of 0 (the default) means no limit.
+    void setRateLimit(const std::string& limit, double rate, double burst = 1);
+
+    /// Snapshot of the connection statistics so far
+    Stats stats() const;
+
+  private:
+    struct Request
+    {
+      std::string url;
+      std::vector<std::string> headers;
+      curl_slist* header_list;
+      HttpResponse response;
+      std::promise<HttpResponse> promise;
+      char errbuf[CURL_ERROR_SIZE];
+      const std::atomic<bool>* stop;
+    };
+
+    CURLM* multi_;
+    std::thread thread_;
+    bool stop_;
+
+    /// transfers currently on the multi handle (only touched by run())
+    std::set<CURL*> active_;
+
+    mutable std::mutex mutex_;
+    std::deque<Request*> queue_;
+    Stats stats_;
+
+    /// Tokens available under a limit, which may go negative: callers take
+    /// a token right away and wait until it would have been there
+    struct Bucket
+    {
+      double rate;
+      double burst;
+      double tokens;
+      std::chrono::steady_clock::time_point last;
+    };
+    std::map<std::string, Bucket> buckets_;
+
+    /// How long a request under limit has to wait for its rate limit
+    std::chrono::duration<double> reserve(const std::string& limit);
+
+    /// I/O loop that drives all transfers
+    void run();
+
+    /// Create an easy handle for req and add it to the multi handle
+    void start(Request* req);
+
+    /// Collect the result of a finished transfer and wake its caller
+    void finish(CURL* easy, CURLcode result);
+
+    static size_t write(char* ptr, size_t size, size_t nmemb, void* userdata);
+    static size_t header(char* ptr, size_t size, size_t nmemb, void* userdata);
+  };
+
+}
@@ -0,0 +1,73 @@
+/**
+ * Multithreaded and streaming JPEG writing.
+ *
+ * The image is cut into horizontal strips of whole MCU rows, which are
+ * encoded concurrently with a restart marker after every MCU row. Restart
+ * markers reset the entropy coder, so the strips' scans can be joined into
+ * one baseline JPEG by renumbering the markers and patching the image
+ * height, without re-encoding anything.
+ *
+ * The same joining lets JPEGWriter take an image a few rows at a time and
+ * append each batch to the file as it comes, so that the whole image never
+ * has to be in memory.
+ */
+
+#pragma once
+
+#include <fstream>
+#include <vector>
+#include <cstdint>
+
+#include <boost/filesystem.hpp>
+
+#include <opencv2/opencv.hpp>
+
+namespace gzsatellite {
+
+  /// Write an 8-bit BGR image as a JPEG using threads threads (0: all
+  /// cores). Falls back to a plain single-threaded cv::imwrite for small
+  /// images, or if the strips can't be joined: OpenCV's encoder does not
+  /// emit restart markers, or the strips' tables or sampling differ.
+  bool writeJPEG(const boost::filesystem::path& path, const cv::Mat& bgr, int quality,
+                 unsigned int threads = 0);
+
+  /// Writes a JPEG of a known size from consecutive batches of rows. Rows
+  /// are buffered up to a whole MCU row; each batch is encoded on threads
+  /// threads (0: all cores).
+  class JPEGWriter
+  {
+  public:
+    JPEGWriter(const boost::filesystem::path& path, int width, int height, int quality,
+               unsigned int threads = 0);
+
+    /// Whether an image of this size can be written a few rows at a time:
+    /// it must fit in a JPEG (65535 x 65535), and OpenCV's encoder must
+    /// emit restart markers
+    static bool streamable(int width, int height);
+
+    /// Append the next rows (8-bit BGR, width columns). Fails if OpenCV's
+    /// encoder doesn't emit restart markers, or if the rows were encoded
+    /// with other tables or sampling than the rows before them; the file
+    /// is incomplete then.
+    bool write(const cv::Mat& rows);
+
+    /// Finish the file once all rows are written
+    bool finish();
+
+  private:
+    std::ofstream out_;
+    int width_, height_;
+    std::vector<int> params_;
+    int threads_;
+
+    std::vector<uint8_t> tables_;   ///< headers of the first strip, which every strip must share
+    cv::Mat pending_;   ///< rows short of a whole MCU row
+    int rows_;          ///< rows encoded so far
+    unsigned int rst_;  ///< next restart marker number
+    bool ok_;
+
+    /// Encode whole MCU rows (or the last rows of the image)
+    bool encode(const cv::Mat& rows);
+  };
+
+}
@@ -6,6 +6,15 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <limits>
 
 #include <boost/filesystem.hpp>
 
@@ -16,12 +25,32 @@
 #include <gazebo/gazebo.hh>
 
 #include "tileloader.h"
+#include "boundedqueue.h"
+#include "ddswriter.h"
+#include "jpegwriter.h"
+#include "terrain.h"
+#include "geoconverter.h"
+#include "profiler.h"
+#include "sharedtiles.h"
 
 namespace gzsatellite {
 
   struct GeoParams
   {
     std::string tileserver;
+    unsigned int concurrency = 1;
+    double refresh_age = -1;
+    double rate_limit = 0;        ///< requests/s to the tile server (0: unlimited)
+    unsigned int max_retries = 3; ///< per tile, after transient failures
+    std::string cache_backend = "directory";
+    double cache_budget_mb = 0;   ///< 0: unlimited
+    int chunk_size = 0;           ///< texture size limit in pixels (0: one texture)
+    std::string texture_format = "jpg";   ///< "jpg", "png", "webp" or "dds" (BC1 with mipmaps)
+    bool stream_stitch = false;   ///< stitch one row of tiles at a time (jpg and dds only)
+    std::string elevation_server; ///< Terrarium elevation tiles (empty: flat ground)
+    unsigned int elevation_zoom = 15;
+    double terrain_error = 0.5;   ///< meters the terrain mesh may deviate by
+    double datum = std::numeric_limits<double>::quiet_NaN(); ///< height at z = 0 (NaN: at the world origin)
     double lat, lon;
     double zoom;
 
@@ -36,20 +65,103 @@ namespace gzsatellite {
     // for storing working files, instantiate a model creator obj
     ModelCreator(const GeoParams& params, const std::string& root);
 
+    // Create a model from the tiles of an existing loader (see
+    // TileLoader::forTileRange), optionally sharing a cache manager and
+    // an elevation loader (at the elevation zoom, see TileLoader::forArea).
+    // The loaders' settings take precedence over the tile-related params.
+    ModelCreator(const GeoParams& params, const std::string& root,
+                 std::unique_ptr<TileLoader> loader,
+                 const std::shared_ptr<CacheManager>& cache_manager = nullptr,
+                 std::unique_ptr<TileLoader> elevation_loader = nullptr);
+
     sdf::SDFPtr createModel(const std::string& name, unsigned int quality);
 
-    void getOriginLatLon(double& lat, double& lon);
-    
+    /// Will createModel() stitch the world image (build the terrain)?
+    /// Only if some of it isn't there yet; a refresh may also stitch it
+    /// again, if one of its tiles changed, which isn't known before.
+    bool needsWorldImage() const;
+    bool needsTerrain() const;
+
+    void getOriginLatLon(double& lat, double& lon) const;
+
+    /// Conversions between lat/lon, tiles and the world's frame
+    GeoConverter geoConverter() const;
+
+    /// A low-resolution stand-in for this world, from the tiles levels zoom
+    /// levels up that cover it (far fewer of them). Its plane covers
+    /// exactly those tiles, where they lie in this world's frame.
+    std::unique_ptr<ModelCreator> placeholder(unsigned int levels,
+                                              const std::string& root) const;
+
+    /// Textures of the model. With a cache manager, they stay pinned (in
+    /// use) until CacheManager::unpinTexture().
+    std::vector<boost::filesystem::path> textures() const;
+
+    /// Time spent in each stage of the last stitch, in seconds. Loading
+    /// and decoding overlap, so total is less than their sum.
+    struct StitchStats
+    {
+      unsigned int tiles = 0;   ///< tiles placed in the image
+      unsigned int copied = 0;  ///< of which were copies of another tile
+      unsigned int reused = 0;  ///< not loaded: copied from an overlapping world image
+      unsigned int shared = 0;  ///< not decoded: copied from another creator's decode
+      unsigned int missing = 0; ///< no image available
+      unsigned int failed = 0;  ///< image could not be decoded
+      unsigned int resized = 0; ///< scaled to fit: not imageSize() square
+      unsigned int upscaled = 0;///< missing or failed, filled from a lower zoom
+      double reuse = 0;         ///< reading the overlapping world image
+      double load = 0;          ///< downloading and reading from the cache
+      double decode = 0;        ///< decoding and placing (busy time, all threads)
+      double encode = 0;        ///< writing the world image
+      double total = 0;         ///< reuse + load + decode, overlapped
+    };
+
+    /// Stages of the last stitch, if createModel() had to stitch
+    const StitchStats& stitchStats() const { return stitch_stats_; }
+
+    /// Times and counters of every stage of createModel(). Several
+    /// creators may share one profiler (e.g., the pages of a pager).
+    void setProfiler(const std::shared_ptr<Profiler>& profiler) { profiler_ = profiler; }
+    const std::shared_ptr<Profiler>& profiler() const { return profiler_; }
+
+    /// Decode the tiles (and elevation tiles) other creators also use at
+    /// the same time only once between them. World images being written
+    /// by those creators are not reused (see reuseMosaic).
+    void setSharedTiles(const std::shared_ptr<SharedTiles>& shared,
+                        const std::shared_ptr<SharedTiles>& shared_elevation = nullptr)
+    { shared_tiles_ = shared; shared_elevation_ = shared_elevation; }
+
+    /// Give up once stop is set: downloads stop, and createModel() throws
+    /// rather than keep a world image with the tiles it didn't load
+    void setStopFlag(const std::shared_ptr<std::atomic<bool>>& stop);
+
+    /// Decode and encode on at most n threads (0, the default: all cores),
+    /// e.g. to split the cores between creators that run at the same time
+    void setThreads(unsigned int n) { threads_ = n; }
+
+    /// A loader for the elevation tiles under the tiles of imagery, at
+    /// zoom min(zoom, imagery's zoom), sharing elevation's cache
+    static std::unique_ptr<TileLoader> elevationTiles(const TileLoader& imagery,
+                                                      const TileLoader& elevation,
+                                                      unsigned int zoom);
+
+    /// The height at lat/lon from elevation's tile there, at its zoom.
+    /// Returns false if the tile can't be loaded.
+    static bool elevationAt(const TileLoader& elevation, double lat, double lon,
+                            float& height);
+
   private:
     // tile loader data
     std::unique_ptr<TileLoader> loader_;
     GeoParams geo_params_;
     std::vector<TileLoader::MapTile> tiles_;
+    std::shared_ptr<CacheManager> cache_manager_;
 
     // relevant directory paths
     boost::filesystem::path materials_dir_;
     boost::filesystem::path textures_dir_;
     boost::filesystem::path scripts_dir_;
+    boost::filesystem::path meshes_dir_;
 
     // world image information
     boost::filesystem::path world_img_path_;
@@ -57,12 +169,57 @@ namespace gzsatellite {
     std::string model_name_;
     unsigned int jpg_quality_;
 
-    void downloadTiles();
+    /// A piece of the world image with its own texture, material and
+    /// visual, keeping each texture within the GPU's size limit
+    struct Chunk
+    {
+      cv::Rect rect;  ///< pixels of the world image
+      boost::filesystem::path img_path;
+      boost::filesystem::path scr_path;
+      boost::filesystem::path mesh_path;  ///< terrain under it (empty: flat)
+    };
+    std::vector<Chunk> chunks_;
+
+    // terrain, when there is an elevation server
+    std::unique_ptr<TileLoader> elevation_loader_;
+    boost::filesystem::path collision_mesh_path_;
+    boost::filesystem::path incomplete_path_; ///< exists while the meshes are missing tiles
+    cv::Mat elevation_;             ///< heights (m) of the elevation tiles around the world
+    double elevation_scale_;        ///< elevation pixels per world image pixel
+    cv::Point2d elevation_offset_;  ///< elevation pixel at world image pixel (0,0)
+    float datum_;                   ///< height at the world origin, i.e. at z = 0
+    bool elevation_complete_;       ///< no elevation tile was missing
+
+    StitchStats stitch_stats_;
+    std::vector<cv::Point> holes_;  ///< tiles of the last stitch without an image of their own
+    std::shared_ptr<Profiler> profiler_;
+    std::shared_ptr<SharedTiles> shared_tiles_;
+    std::shared_ptr<SharedTiles> shared_elevation_;
+    unsigned int threads_ = 0;
+
+    void downloadTiles(const TileLoader::TileCallback& on_tile = TileLoader::TileCallback(),
+                       const TileLoader::TileFilter& wanted = TileLoader::TileFilter());
     void createWorldImage();
-    void createWorldScript();
+    std::vector<size_t> streamWorldImage();
+    void init(const std::string& root);
+    unsigned int numThreads() const;
+    void originTileCoords(double& x, double& y) const;
+    void metersPerPixel(double& mpp_x, double& mpp_y) const;
+    std::string mosaicName() const;
+    boost::filesystem::path holesPath() const;
+    boost::filesystem::path holesPath(const std::string& mosaic, int chunk_size) const;
+    unsigned int reuseMosaic(cv::Mat& result, std::vector<char>& reused);
+    bool fillPlaceholder(cv::Mat& img, const TileLoader::MapTile& tile) const;
+    std::string textureExtension() const;
+    bool writeTexture(const boost::filesystem::path& path, const cv::Mat& img) const;
+    void createChunks();
+    bool loadElevation();
+    float heightAt(double px, double py) const;
+    void createTerrainMesh(const cv::Rect& rect, const boost::filesystem::path& path);
+    void createWorldScript(const Chunk& chunk);
     cv::Mat stitchTiles();
     sdf::ElementPtr createCollision(double xpos, double ypos);
-    sdf::ElementPtr createVisual(double xpos, double ypos);
+    sdf::ElementPtr createVisual(double xpos, double ypos, const Chunk& chunk);
   };
 
 }
\ No newline at end of file
@@ -0,0 +1,141 @@
+/**
+ * PackedTileCache: a TileCache that keeps every tile of a service in two
+ * files instead of one file per tile.
+ *
+ *    tiles.pack    append-only blobs (encoded images and their validators)
+ *    tiles.idx     open-addressing hash table keyed by (x, y, z), mapped
+ *                  into memory and updated in place
+ *
+ * Reads are zero-copy: the returned TileBytes point into a read-only
+ * mapping of the pack file. Tiles with identical contents share one blob.
+ * Replacing a tile appends a new blob (unless an identical one exists) and
+ * repoints its index slot; the old blob is left behind as garbage.
+ *
+ * Removing tiles leaves their blobs behind as garbage too, until
+ * compact() rewrites the pack.
+ *
+ * A pack may only be opened by one process at a time, and only once in
+ * it: open it with TileCache::create(), which shares one instance.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <cstdint>
+#include <unordered_map>
+
+#include "tilecache.h"
+
+namespace gzsatellite {
+
+  class PackedTileCache : public TileCache
+  {
+  public:
+    explicit PackedTileCache(const boost::filesystem::path& dir);
+    ~PackedTileCache();
+
+    PackedTileCache(const PackedTileCache&) = delete;
+    PackedTileCache& operator=(const PackedTileCache&) = delete;
+
+    bool contains(int x, int y, int z) const override;
+    bool read(int x, int y, int z, TileBytes& bytes) const override;
+    bool write(int x, int y, int z, const std::string& data,
+               const TileMeta& meta) override;
+    bool readMeta(int x, int y, int z, TileMeta& meta) const override;
+    void writeMeta(int x, int y, int z, const TileMeta& meta) override;
+    bool remove(int x, int y, int z) override;
+    uint64_t sizeOf(int x, int y, int z) const override;
+    void list(const std::function<void(int, int, int)>& fn) const override;
+
+    /// Rewrite the pack without unreferenced blobs once they make up more
+    /// than half of it
+    void compact() override;
+
+    /// Number of tiles in the index
+    size_t size() const;
+
+  private:
+    struct Header
+    {
+      char magic[8];
+      uint32_t capacity;  ///< number of slots (a power of two)
+      uint32_t reserved;
+      uint64_t count;     ///< number of used slots
+      uint64_t pad[5];
+    };
+
+    struct Slot
+    {
+      int32_t x, y, z;
+      uint32_t used;
+      uint64_t data_off;
+      uint32_t data_size;
+      uint32_t meta_size;
+      uint64_t meta_off;
+      uint64_t digest;    ///< content digest of the data blob (0: unknown)
+    };
+
+    struct Blob
+    {
+      uint64_t off;
+      uint32_t size;
+    };
+
+    /// A read-only or read-write mmap of (part of) a file
+    struct Mapping
+    {
+      char* data = nullptr;
+      size_t size = 0;
+      ~Mapping();
+    };
+
+    boost::filesystem::path pack_path_;
+    boost::filesystem::path index_path_;
+
+    int pack_fd_;
+    int index_fd_;
+
+    mutable std::mutex mutex_;
+    std::shared_ptr<Mapping> index_;
+    mutable std::shared_ptr<Mapping> pack_;
+
+    /// unique data blobs in the pack, by content digest
+    std::unordered_map<uint64_t, Blob> blobs_;
+
+    Header* header() const { return reinterpret_cast<Header*>(index_->data); }
+    Slot* slots() const { return reinterpret_cast<Slot*>(index_->data + sizeof(Header)); }
+
+    /// Slot holding tile [x,y,z], or the empty slot it would go in
+    Slot* probe(int x, int y, int z) const;
+
+    /// Used slot holding tile [x,y,z], or nullptr
+    const Slot* find(int x, int y, int z) const;
+
+    /// Mapping of the pack file that covers at least the first end bytes
+    std::shared_ptr<Mapping> packMapping(uint64_t end) const;
+
+    /// Append a blob to the pack file, returning its offset
+    uint64_t append(const char* data, size_t size);
+
+    /// Scan the index for the unique blobs in the pack
+    void scanBlobs();
+
+    /// Open (and lock) the pack file
+    void openPack();
+
+    /// Finish or roll back a compaction that was interrupted by a crash
+    void recover();
+
+    /// Create an empty index with the given capacity at path
+    static void createIndex(const boost::filesystem::path& path, uint32_t capacity);
+
+    /// Map the index file
+    void mapIndex();
+
+    /// Rehash the index into one with twice the capacity
+    void grow();
+
+    static std::shared_ptr<Mapping> map(int fd, size_t size, bool writable);
+  };
+
+}
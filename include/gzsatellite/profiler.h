@@ -0,0 +1,133 @@
+/**
+ * Profiler class for managing:
+ *    - Time spent in each stage of creating a world (e.g., download,
+ *      decode, encode), summed over all threads
+ *    - Counters (tiles, bytes, peak memory, ...)
+ *    - Export of the timeline as a Chrome trace (chrome://tracing or
+ *      https://ui.perfetto.dev)
+ *
+ * Stages are timed with a Scope on the thread doing the work, so stages
+ * running on several threads at once show up as such in the trace. Only
+ * the first MAX_EVENTS spans are kept for the trace; the totals count all
+ * of them.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#include <boost/filesystem.hpp>
+
+namespace gzsatellite {
+
+  class Profiler
+  {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /// Spans kept for the trace
+    static constexpr size_t MAX_EVENTS = 100000;
+
+    struct Stage
+    {
+      uint64_t calls = 0;
+      double seconds = 0;   ///< summed over threads
+    };
+
+    /// Times a stage from construction to destruction. Does nothing
+    /// without a profiler.
+    class Scope
+    {
+    public:
+      Scope(Profiler* profiler, const char* stage)
+        : profiler_(profiler), stage_(stage), start_(Clock::now()) {}
+      ~Scope() { if (profiler_) profiler_->record(stage_, start_, Clock::now()); }
+
+      Scope(const Scope&) = delete;
+      Scope& operator=(const Scope&) = delete;
+
+    private:
+      Profiler* profiler_;
+      const char* stage_;
+      Clock::time_point start_;
+    };
+
+    /// Spans recorded on one thread, handed to the profiler all at once on
+    /// flush() (or destruction), for stages too short and too many to take
+    /// the profiler's lock each time (e.g., decoding a tile)
+    class Batch
+    {
+    public:
+      explicit Batch(Profiler* profiler) : profiler_(profiler) {}
+      ~Batch() { flush(); }
+
+      Batch(const Batch&) = delete;
+      Batch& operator=(const Batch&) = delete;
+
+      void record(const char* stage, Clock::time_point start, Clock::time_point end)
+      { if (profiler_) spans_.push_back(Span{stage, start, end}); }
+
+      void flush();
+
+    private:
+      struct Span
+      {
+        const char* stage;
+        Clock::time_point start, end;
+      };
+
+      Profiler* profiler_;
+      std::vector<Span> spans_;
+    };
+
+    Profiler();
+
+    /// Record a span of a stage on the calling thread
+    void record(const std::string& stage, Clock::time_point start, Clock::time_point end);
+
+    /// Add to a counter
+    void add(const std::string& counter, double value);
+
+    /// Set a counter
+    void set(const std::string& counter, double value);
+
+    /// Raise a counter to value, if it is lower (e.g., for peak memory)
+    void max(const std::string& counter, double value);
+
+    std::map<std::string, Stage> stages() const;
+    std::map<std::string, double> counters() const;
+
+    /// Seconds since the profiler was created
+    double elapsed() const;
+
+    /// Write the spans (and the counters, at the end) as a Chrome trace
+    bool writeChromeTrace(const boost::filesystem::path& path) const;
+
+  private:
+    struct Event
+    {
+      std::string stage;
+      unsigned int thread;
+      double start;     ///< us since epoch_
+      double duration;  ///< us
+    };
+
+    const Clock::time_point epoch_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Stage> stages_;
+    std::map<std::string, double> counters_;
+    std::vector<Event> events_;
+    std::map<std::thread::id, unsigned int> threads_;
+
+    /// record(), with the lock held
+    void append(const std::string& stage, Clock::time_point start, Clock::time_point end);
+  };
+
+}
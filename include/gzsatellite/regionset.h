@@ -0,0 +1,85 @@
+/**
+ * RegionSet class for managing:
+ *    - Several separate regions (sites) in one world, each its own model
+ *    - One tile cache, HTTP connection pool and cache budget for all of them
+ *    - Building the regions' models concurrently
+ *
+ * World (0,0) is at the lat/lon of the GeoParams, and each region's model
+ * is placed where its centre is in that frame. The tiles (and elevation
+ * tiles) of all regions are fetched before any region is stitched, so
+ * tiles that regions have in common are downloaded once; while stitching,
+ * they are decoded once too (see SharedTiles).
+ *
+ * Regions are built on a pool of at most one thread per core, and the
+ * cores are split between the regions being built at the same time.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#include "modelcreator.h"
+
+namespace gzsatellite {
+
+  struct Region
+  {
+    std::string name;             ///< of the region's model
+    double lat, lon;              ///< centre
+    double width, height;         ///< meters
+    double zoom;
+  };
+
+  class RegionSet
+  {
+  public:
+    RegionSet(const GeoParams& geo, const std::vector<Region>& regions,
+              const std::string& root, unsigned int quality);
+
+    RegionSet(const RegionSet&) = delete;
+    RegionSet& operator=(const RegionSet&) = delete;
+
+    /// Build the models of all regions, concurrently. Models are in the
+    /// order of the regions; a region that fails is left out (null).
+    std::vector<sdf::SDFPtr> createModels();
+
+    /// Give up building the regions once stop is set (see ModelCreator)
+    void setStopFlag(const std::shared_ptr<std::atomic<bool>>& stop);
+
+    /// Times and counters of building all regions
+    const std::shared_ptr<Profiler>& profiler() const { return profiler_; }
+
+    /// Conversions between lat/lon, tiles and the world's frame
+    GeoConverter geoConverter() const
+    { return GeoConverter(origin_x_, origin_y_, loader_->zoom(), tile_size_); }
+
+  private:
+    GeoParams geo_;
+    std::vector<Region> regions_;
+    std::string root_;
+    unsigned int quality_;
+
+    // shared by the loaders of every region
+    std::unique_ptr<TileLoader> loader_;
+    std::unique_ptr<TileLoader> elevation_loader_;  ///< if there is an elevation server
+    std::shared_ptr<CacheManager> cache_manager_;
+    std::shared_ptr<Profiler> profiler_;
+
+    // world origin, in tile coordinates at loader_'s zoom
+    double origin_x_, origin_y_;
+    double tile_size_;
+
+    /// Download the tiles of every region, those in several regions once
+    void prefetch(const std::vector<std::unique_ptr<TileLoader>>& loaders);
+
+    /// The tiles that more than one of the loaders load (what they are,
+    /// for the log)
+    static std::shared_ptr<SharedTiles> sharedTiles(
+                              const std::vector<const TileLoader*>& loaders,
+                              const std::string& what);
+  };
+
+}
@@ -0,0 +1,132 @@
+/**
+ * SharedTiles: decoded tiles handed between ModelCreators that stitch some
+ * of the same tiles at the same time (e.g., overlapping regions), so that
+ * each of those tiles is decoded only once.
+ *
+ * The first creator to reach a shared tile claims it, decodes it and puts
+ * the pixels here; the others wait for that decode (which is already under
+ * way when they get there) and copy the result. A tile is dropped once
+ * every creator that wants it has had it.
+ *
+ * A claim that is given up without putting anything (e.g., because its
+ * creator threw) puts a failed decode, so that nobody waits forever.
+ */
+
+#pragma once
+
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <future>
+#include <chrono>
+
+#include <opencv2/opencv.hpp>
+
+namespace gzsatellite {
+
+  class SharedTiles
+  {
+  public:
+    /// The right to decode a tile for everyone who wants it. Putting
+    /// nothing before it goes counts as a failed decode.
+    class Claim
+    {
+    public:
+      Claim() : shared_(nullptr), x_(0), y_(0), z_(0) {}
+      ~Claim() { release(cv::Mat()); }
+
+      Claim(const Claim&) = delete;
+      Claim& operator=(const Claim&) = delete;
+
+      /// Hand over the pixels of the tile (empty if it failed to decode).
+      /// Copied, so the caller may reuse img. Does nothing for tiles that
+      /// aren't shared.
+      void put(const cv::Mat& img) { release(img); }
+
+    private:
+      friend class SharedTiles;
+
+      SharedTiles* shared_;
+      int x_, y_, z_;
+
+      void release(const cv::Mat& img)
+      {
+        if (!shared_) return;
+        SharedTiles* shared = shared_;
+        shared_ = nullptr;
+        shared->put(x_, y_, z_, img);
+      }
+    };
+
+    /// Another creator will want tile [x,y,z]. Tiles wanted only once are
+    /// not kept. Call before any creator starts.
+    void want(int x, int y, int z) { tiles_[Key(x, y, z)].wanted++; }
+
+    /// Claim tile [x,y,z]. Returns true if the caller is to decode it and
+    /// then put() it through claim (always the case for tiles that aren't
+    /// shared). Otherwise, waits for the claiming creator's decode and
+    /// returns its pixels in img (empty if it failed). claim must not
+    /// hold another tile.
+    bool claim(int x, int y, int z, cv::Mat& img, Claim& claim)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto it = tiles_.find(Key(x, y, z));
+      if (it == tiles_.end() || it->second.wanted < 2) return true;
+
+      Tile& tile = it->second;
+      tile.had++;
+      if (!tile.claimed) {
+        tile.claimed = true;
+        tile.pixels = tile.promise.get_future().share();
+        claim.shared_ = this;
+        claim.x_ = x; claim.y_ = y; claim.z_ = z;
+        return true;
+      }
+
+      std::shared_future<cv::Mat> pixels = tile.pixels;
+      if (done(tile)) tiles_.erase(it);
+      lock.unlock();
+
+      img = pixels.get();
+      return false;
+    }
+
+  private:
+    typedef std::tuple<int, int, int> Key;
+
+    struct Tile
+    {
+      unsigned int wanted = 0;    ///< by this many creators
+      unsigned int had = 0;       ///< claims so far
+      bool claimed = false;
+      std::promise<cv::Mat> promise;
+      std::shared_future<cv::Mat> pixels;
+    };
+
+    std::mutex mutex_;
+    std::map<Key, Tile> tiles_;
+
+    /// Called by a claim, once
+    void put(int x, int y, int z, const cv::Mat& img)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = tiles_.find(Key(x, y, z));
+      if (it == tiles_.end() || !it->second.claimed) return;
+
+      // A failed copy is a failed decode, as far as the waiters know
+      cv::Mat pixels;
+      try { pixels = img.clone(); } catch (...) {}
+      it->second.promise.set_value(pixels);
+      if (done(it->second)) tiles_.erase(it);
+    }
+
+    /// Has every creator had the tile? Waiters hold their own copy of
+    /// the future, so it can go then.
+    static bool done(const Tile& tile)
+    {
+      return tile.had >= tile.wanted &&
+             tile.pixels.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+  };
+
+}
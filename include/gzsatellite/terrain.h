@@ -0,0 +1,61 @@
+/**
+ * Terrain meshes from elevation tiles.
+ *
+ * Elevation tiles use the Terrarium encoding (as served by Mapzen/AWS
+ * terrain tiles): each PNG pixel holds a height of
+ * R*256 + G + B/256 - 32768 meters.
+ *
+ * A square grid of heights is triangulated with an error-bounded quadtree:
+ * a node is split into four while the two triangles across its corners
+ * are further than the allowed error from any height inside it. Flat
+ * areas end up with a few large triangles, rough ones with many small
+ * ones. Where a leaf borders smaller leaves, it is triangulated as a fan
+ * through their corners, so the mesh has no cracks.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#include "tilecache.h"
+
+namespace gzsatellite {
+
+  /// A triangle mesh with texture coordinates
+  struct TerrainMesh
+  {
+    std::vector<cv::Point3f> vertices;
+    std::vector<cv::Point2f> uvs;         ///< one per vertex, (0,0) at the bottom left
+    std::vector<cv::Vec3i> triangles;     ///< counter-clockwise seen from above
+  };
+
+  /// Decode a Terrarium elevation tile into heights in meters (CV_32F).
+  /// Returns an empty matrix if the image can't be decoded.
+  cv::Mat decodeTerrarium(const TileBytes& bytes);
+
+  /// Give every height that isn't known (known is CV_8U, 0 where not) the
+  /// height of the nearest known one, so that missing tiles continue the
+  /// ground around them. Returns false if no height is known.
+  bool fillHeightHoles(cv::Mat& heights, const cv::Mat& known);
+
+  /// Bilinear interpolation of heights (CV_32F) at (x, y) in pixels, where
+  /// pixel (c, r) covers [c, c+1) x [r, r+1). Beyond the edge pixels'
+  /// centres, the edge heights continue.
+  float interpolateHeight(const cv::Mat& heights, double x, double y);
+
+  /// Triangulate a (2^k+1) x (2^k+1) grid of heights (CV_32F), keeping
+  /// within max_error meters of every height. Vertices are grid positions
+  /// (column, row); rows run south, so triangles are counter-clockwise
+  /// seen from above once rows are mapped to -y.
+  void simplifyHeightGrid(const cv::Mat& heights, float max_error,
+                          std::vector<cv::Point>& vertices,
+                          std::vector<cv::Vec3i>& triangles);
+
+  /// Write a mesh as a COLLADA (.dae) file, in meters with z up
+  bool writeCollada(const boost::filesystem::path& path, const TerrainMesh& mesh);
+
+}
@@ -0,0 +1,158 @@
+/**
+ * TileCache classes for managing:
+ *    - Storage of downloaded tile images (and their HTTP validators)
+ *    - Lookup of cached tiles by (x, y, z) tile coordinate
+ *
+ * Two storage backends are available:
+ *    - DirectoryTileCache: one x{x}_y{y}_z{z}.jpg file per tile
+ *    - PackedTileCache: tile blobs appended to a single pack file with a
+ *      memory-mapped index (see packedtilecache.h)
+ *
+ * Both are content-addressed: byte-identical tiles (ocean, desert, "no
+ * imagery" placeholders, ...) are stored once and shared by every tile
+ * coordinate that maps to them.
+ */
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <fstream>
+#include <sstream>
+#include <ctime>
+#include <stdexcept>
+#include <cstdint>
+#include <functional>
+
+#include <boost/filesystem.hpp>
+
+namespace gzsatellite {
+
+  /// HTTP validators of a cached tile
+  struct TileMeta
+  {
+    std::string etag;
+    std::string last_modified;
+    std::time_t fetched = 0;
+  };
+
+  /// Encoded image bytes of a cached tile. Depending on the backend, data
+  /// may point directly into memory-mapped storage; owner keeps it valid.
+  struct TileBytes
+  {
+    const char* data = nullptr;
+    size_t size = 0;
+    std::shared_ptr<const void> owner;
+
+    /// content digest; tiles with equal digests have identical bytes
+    uint64_t digest = 0;
+  };
+
+  class TileCache
+  {
+  public:
+    enum class Backend { DIRECTORY, PACK };
+
+    /// Open (or create) a cache of the given type in directory dir. While
+    /// a cache is in use, opening it again returns the same instance, so
+    /// any number of loaders in a process can share one pack.
+    static std::shared_ptr<TileCache> create(Backend backend,
+                                             const boost::filesystem::path& dir);
+
+    /// Parse a backend name ("directory" or "pack")
+    static Backend backendFromString(const std::string& name);
+
+    virtual ~TileCache() {}
+
+    /// Is tile [x,y,z] in the cache?
+    virtual bool contains(int x, int y, int z) const = 0;
+
+    /// Get the encoded image of tile [x,y,z]
+    virtual bool read(int x, int y, int z, TileBytes& bytes) const = 0;
+
+    /// Store (or replace) tile [x,y,z]. Safe to call from many threads.
+    /// Returns true if identical bytes were already stored (and reused).
+    virtual bool write(int x, int y, int z, const std::string& data,
+                       const TileMeta& meta) = 0;
+
+    /// Get/set the validators of tile [x,y,z]
+    virtual bool readMeta(int x, int y, int z, TileMeta& meta) const = 0;
+    virtual void writeMeta(int x, int y, int z, const TileMeta& meta) = 0;
+
+    /// Remove tile [x,y,z] from the cache
+    virtual bool remove(int x, int y, int z) = 0;
+
+    /// Size in bytes of the encoded image of tile [x,y,z] (0 if not cached)
+    virtual uint64_t sizeOf(int x, int y, int z) const = 0;
+
+    /// Call fn(x, y, z) for every cached tile
+    virtual void list(const std::function<void(int, int, int)>& fn) const = 0;
+
+    /// Reclaim space left behind by removed or replaced tiles, if the
+    /// backend needs to (and it is worth it)
+    virtual void compact() {}
+
+    /// Path of the file holding tile [x,y,z], or empty if the backend does
+    /// not keep one file per tile
+    virtual boost::filesystem::path pathForTile(int x, int y, int z) const
+    {
+      return boost::filesystem::path();
+    }
+
+    /// 64-bit FNV-1a digest of a tile's encoded bytes
+    static uint64_t contentDigest(const char* data, size_t size);
+
+  protected:
+    /// Validators are stored as "key value" lines by every backend
+    static std::string encodeMeta(const TileMeta& meta);
+    static void decodeMeta(const std::string& text, TileMeta& meta);
+  };
+
+  class DirectoryTileCache : public TileCache
+  {
+  public:
+    explicit DirectoryTileCache(const boost::filesystem::path& dir);
+
+    bool contains(int x, int y, int z) const override;
+    bool read(int x, int y, int z, TileBytes& bytes) const override;
+    bool write(int x, int y, int z, const std::string& data,
+               const TileMeta& meta) override;
+    bool readMeta(int x, int y, int z, TileMeta& meta) const override;
+    void writeMeta(int x, int y, int z, const TileMeta& meta) override;
+    bool remove(int x, int y, int z) override;
+    uint64_t sizeOf(int x, int y, int z) const override;
+    void list(const std::function<void(int, int, int)>& fn) const override;
+    boost::filesystem::path pathForTile(int x, int y, int z) const override;
+
+    /// Parse the tile coordinates from a cached tile's filename
+    static bool parseName(const std::string& name, int& x, int& y, int& z);
+
+  private:
+    boost::filesystem::path dir_;
+
+    /// Tiles known to be on file, per zoom level, keyed by (x << 32 | y).
+    /// The directory is listed once, when the index is first needed, so
+    /// that presence checks don't each stat a file (slow on network
+    /// mounts), and the index is kept up to date by write() and remove().
+    /// A tile missing from the index may still have been added since
+    /// (e.g., by another process), so contains() checks the file.
+    mutable std::once_flag index_once_;
+    mutable std::mutex index_mutex_;
+    mutable std::map<int, std::unordered_set<uint64_t>> index_;
+
+    /// List the directory into the index if not done yet. Call it before
+    /// taking index_mutex_, which the listing doesn't hold.
+    void loadIndex() const;
+
+    /// Unique tile contents live in blobs/<digest>.jpg; each tile file is a
+    /// hard link to (or, where links aren't supported, a copy of) its blob.
+    boost::filesystem::path blobs_dir_;
+
+    boost::filesystem::path blobPath(uint64_t digest) const;
+  };
+
+}
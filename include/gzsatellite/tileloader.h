@@ -27,15 +27,27 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <set>
 #include <memory>
 #include <fstream>
 #include <functional>
 #include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
 
 #include <boost/filesystem.hpp>
-#include <boost/regex.hpp>
 
-#include <cpr/cpr.h>
+#include "httpclient.h"
+#include "tilecache.h"
+#include "cachemanager.h"
+#include "boundedqueue.h"
+#include "urltemplate.h"
 
 namespace gzsatellite {
 
@@ -55,7 +67,8 @@ namespace gzsatellite {
       /// Z tile zoom value.
       int z() const { return z_; }
 
-      /// Image associated with this tile.
+      /// Image associated with this tile (empty if the cache backend does
+      /// not store tiles as individual files, see TileLoader::readTile).
       const boost::filesystem::path& imagePath() const { return path_; }
 
     private:
@@ -65,12 +78,108 @@ namespace gzsatellite {
       boost::filesystem::path path_;
     };
 
+    /// What happened to the tiles during the last loadTiles() call
+    struct LoadStats {
+      unsigned int cached = 0;        ///< used from the cache as-is
+      unsigned int downloaded = 0;    ///< (re)downloaded with a new body
+      unsigned int not_modified = 0;  ///< cached tiles confirmed by a 304
+      unsigned int failed = 0;        ///< could not be fetched, even after retrying
+      unsigned int retries = 0;       ///< requests repeated after a failure
+      unsigned int duplicates = 0;    ///< downloads identical to a stored tile
+      unsigned int skipped = 0;       ///< not wanted by the caller
+    };
+
     explicit TileLoader(const std::string& cacheRoot, const std::string& service,
                         double latitude, double longitude,
                         unsigned int zoom, double width, double height);
-
-    /// blocking call to load all tiles
-    const std::vector<MapTile>& loadTiles(bool download = true);
+    ~TileLoader();
+
+    /// Receives the encoded image of a tile as soon as it is available.
+    /// May be called from several threads at once.
+    using TileCallback = std::function<void(const MapTile&, const TileBytes&)>;
+
+    /// Selects the tiles to load; the others are neither fetched nor
+    /// delivered, and are left out of tiles()
+    using TileFilter = std::function<bool(const MapTile&)>;
+
+    /// A loader for another area (as in the constructor) that shares this
+    /// loader's cache, HTTP client and settings
+    std::unique_ptr<TileLoader> forArea(double latitude, double longitude, unsigned int zoom,
+                                        double width, double height) const;
+
+    /// A loader for exactly the tiles [min_x,max_x] x [min_y,max_y] that
+    /// shares this loader's cache, HTTP client and settings
+    std::unique_ptr<TileLoader> forTileRange(int min_x, int max_x,
+                                             int min_y, int max_y) const
+    { return forTileRange(min_x, max_x, min_y, max_y, zoom_); }
+
+    /// Same, for tiles of another zoom level
+    std::unique_ptr<TileLoader> forTileRange(int min_x, int max_x,
+                                             int min_y, int max_y,
+                                             unsigned int zoom) const;
+
+    /// blocking call to load all tiles (or those wanted). on_tile is called
+    /// for every tile with an image, cached ones included, while the rest
+    /// still download.
+    const std::vector<MapTile>& loadTiles(bool download = true,
+                                          const TileCallback& on_tile = TileCallback(),
+                                          const TileFilter& wanted = TileFilter());
+
+    /// Maximum number of tiles downloaded concurrently (1 = sequential)
+    void setConcurrency(unsigned int n) { concurrency_ = std::max(1u, n); }
+    unsigned int concurrency() const { return concurrency_; }
+
+    /// HTTP client used for downloads. One is created on first use if
+    /// none is set; it may be shared between loaders.
+    void setHttpClient(const std::shared_ptr<HttpClient>& http) { http_ = http; }
+    std::shared_ptr<HttpClient> httpClient() const { return http_; }
+
+    /// Limit requests to the tile server to rate per second (0: no limit)
+    void setRateLimit(double rate) { rate_limit_ = rate; }
+    double rateLimit() const { return rate_limit_; }
+
+    /// Retry failed requests (transfer errors, 429 and 5xx responses) up to
+    /// n times, with exponential backoff and jitter, or as long as the
+    /// server asks with Retry-After
+    void setRetries(unsigned int n) { max_retries_ = n; }
+    unsigned int retries() const { return max_retries_; }
+
+    /// Give up loading once stop is set: requests in flight fail, and the
+    /// remaining tiles are not requested. Loaders made from this one (see
+    /// forArea) share the flag.
+    void setStopFlag(const std::shared_ptr<std::atomic<bool>>& stop) { stop_ = stop; }
+    bool stopped() const { return stop_ && *stop_; }
+
+    /// Revalidate cached tiles fetched more than age seconds ago with a
+    /// conditional request. Negative ages (the default) never refresh.
+    void setRefreshAge(double age) { refresh_age_ = age; }
+    double refreshAge() const { return refresh_age_; }
+
+    /// Select how tiles are stored in the cache directory
+    void setCacheBackend(TileCache::Backend backend);
+    const std::shared_ptr<TileCache>& tileCache() const { return cache_; }
+
+    /// Record tile uses with a cache manager so that the cache can be kept
+    /// within its size budget
+    void setCacheManager(const std::shared_ptr<CacheManager>& manager) { cache_manager_ = manager; }
+
+    /// Let the cache manager evict the tiles loadTiles() has pinned (as in
+    /// use) so far. Done by the destructor at the latest.
+    void releaseTiles();
+
+    /// Record a use of the area's cached tiles without reading them (e.g.,
+    /// when the texture made from them is used instead)
+    void touchTiles() const;
+
+    /// Encoded image bytes of a loaded tile
+    bool readTile(const MapTile& tile, TileBytes& bytes) const;
+
+    /// Counts from the last call to loadTiles()
+    const LoadStats& loadStats() const { return load_stats_; }
+
+    /// Tiles the last call to loadTiles() failed to fetch (and has no
+    /// cached image of)
+    const std::vector<MapTile>& failedTiles() const { return failed_tiles_; }
 
     /// Meters/pixel of the tiles.
     double resolution() const;
@@ -87,6 +196,9 @@ namespace gzsatellite {
     /// Fraction of a tile to offset the origin (Y).
     double originOffsetY() const { return origin_offset_y_; }
 
+    /// Zoom level of the tiles.
+    unsigned int zoom() const { return zoom_; }
+
     /// Test if (lat,lon) falls inside centre tile.
     bool insideCentreTile(double lat, double lon) const;
 
@@ -102,6 +214,9 @@ namespace gzsatellite {
     /// Convert latitude and zoom level to ground resolution.
     static double zoomToResolution(double lat, unsigned int zoom);
 
+    /// URI for tile [x,y] (see UrlTemplate for the variables)
+    std::string uriForTile(int x, int y) const { return url_template_.expand(x, y, zoom_); }
+
     /// Path to tiles on the server.
     const std::string& objectURI() const { return object_uri_; }
 
@@ -120,11 +235,16 @@ namespace gzsatellite {
     /// Size of a square image in pixels
     static constexpr int imageSize() { return 256; }
 
-    const int numTilesToDownload() const;
+    /// Number of (wanted) tiles without an image in the cache. The next
+    /// loadTiles() takes them to be missing without checking again.
+    const int numTilesToDownload(const TileFilter& wanted = TileFilter()) const;
 
     /// Number of tiles that will be used
     const int numTiles(int* x = nullptr, int* y = nullptr) const;
 
+    /// Determine the tile index range for x, y
+    void tileRange(int& min_x, int& max_x, int& min_y, int& max_y) const;
+
     // A unique hash of this loader's parameters
     const std::string hash() const;
 
@@ -141,26 +261,47 @@ namespace gzsatellite {
     int y_tiles_below_, y_tiles_above_;
 
     boost::filesystem::path cache_path_;
+    std::shared_ptr<TileCache> cache_;
+    std::shared_ptr<CacheManager> cache_manager_;
+    std::vector<MapTile> pinned_;   ///< until releaseTiles()
 
     std::string object_uri_;
+    UrlTemplate url_template_;
     std::string service_hash_;
 
     std::vector<MapTile> tiles_;
-    
-    /// URI for tile [x,y]
-    std::string uriForTile(int x, int y) const;
-
-    /// Get name for cached tile [x,y,z]
-    std::string cachedNameForTile(int x, int y, int z) const;
-
-    /// Get file path for cached tile [x,y,z].
-    boost::filesystem::path cachedPathForTile(int x, int y, int z) const;
 
+    unsigned int concurrency_;
+    std::shared_ptr<HttpClient> http_;
+
+    double refresh_age_;
+    double rate_limit_;
+    unsigned int max_retries_;
+    std::shared_ptr<std::atomic<bool>> stop_;
+    LoadStats load_stats_;
+    std::vector<MapTile> failed_tiles_;
+    mutable std::set<std::pair<int, int>> misses_;  ///< found by numTilesToDownload()
+
+    enum class Fetch { FAILED, DOWNLOADED, NOT_MODIFIED };
+
+    /// Blocking (conditional, if revalidating) download of a single tile.
+    /// A downloaded body is returned with its validators for the caller to
+    /// cache; a 304 only updates the cached validators. Failed requests are
+    /// retried (see setRetries), counting each retry in retries.
+    Fetch downloadTile(const MapTile& tile, bool revalidate,
+                       std::string& body, TileMeta& meta,
+                       unsigned int& retries) const;
+
+    /// Center the loader's tiles on (latitude, longitude), covering
+    /// width x height meters
+    void setArea(double latitude, double longitude, unsigned int zoom,
+                 double width, double height);
+
+    /// Does the cached tile need to be revalidated?
+    bool needsRefresh(const MapTile& tile) const;
+    
     /// Maximum number of tiles for the zoom level
     int maxTiles() const;
-
-    /// Determine the tile index range for x, y
-    void tileRange(int& min_x, int& max_x, int& min_y, int& max_y) const;
   };
 
 }
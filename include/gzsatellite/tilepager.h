@@ -0,0 +1,125 @@
+/**
+ * TilePager class for managing:
+ *    - Which pages of ground imagery are needed around a moving vehicle,
+ *      including the ones it is about to reach
+ *    - Building page models on a background thread
+ *    - Unloading pages that fall out of range
+ *
+ * The ground is divided into pages of page_tiles x page_tiles map tiles,
+ * aligned to the tile grid so that neighbouring pages join seamlessly.
+ * Each page is a separate static model. World (0,0) is at the lat/lon of
+ * the GeoParams; shift_ew/shift_ns do not apply.
+ */
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "modelcreator.h"
+
+namespace gzsatellite {
+
+  struct PagingParams
+  {
+    int page_tiles = 8;           ///< tiles along each side of a page
+    double radius = 200;          ///< load pages closer than this (m)
+    double prefetch_time = 5;     ///< ...to where the vehicle will be in (s)
+    double unload_factor = 1.5;   ///< unload pages beyond radius*unload_factor
+  };
+
+  class TilePager
+  {
+  public:
+    TilePager(const GeoParams& geo, const PagingParams& params,
+              const std::string& root, const std::string& name,
+              unsigned int quality);
+    ~TilePager();
+
+    TilePager(const TilePager&) = delete;
+    TilePager& operator=(const TilePager&) = delete;
+
+    /// Vehicle position (m) and velocity (m/s) in the world frame. Cheap
+    /// enough to call on every world update.
+    void update(double x, double y, double vx, double vy);
+
+    /// Page models built since the last call, and the names of page models
+    /// to remove from the world
+    void poll(std::vector<sdf::SDFPtr>& load, std::vector<std::string>& unload);
+
+    /// Number of pages currently in the world
+    size_t numLoaded() const;
+
+    /// Times and counters of building all pages so far
+    const std::shared_ptr<Profiler>& profiler() const { return profiler_; }
+
+    /// Conversions between lat/lon, tiles and the world's frame
+    GeoConverter geoConverter() const
+    { return GeoConverter(origin_x_, origin_y_, loader_->zoom(), tile_size_); }
+
+  private:
+    typedef std::pair<int, int> Page;
+    enum class State { QUEUED, BUILDING, READY, LOADED, FAILED };
+
+    GeoParams geo_;
+    PagingParams params_;
+    std::string root_;
+    std::string name_;
+    unsigned int quality_;
+
+    // shared by the loaders of all pages
+    std::unique_ptr<TileLoader> loader_;
+    std::shared_ptr<CacheManager> cache_manager_;
+    std::shared_ptr<Profiler> profiler_;
+
+    // fractional tile coordinates of world (0,0) and tile size (m)
+    double origin_x_, origin_y_;
+    double tile_size_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_;
+    std::shared_ptr<std::atomic<bool>> cancel_;   ///< gives up the page being built
+    std::thread thread_;
+
+    std::map<Page, State> pages_;
+    std::vector<std::pair<Page, sdf::SDFPtr>> ready_;
+    std::vector<std::string> unload_;
+    std::map<Page, std::vector<boost::filesystem::path>> textures_;  ///< of built pages
+
+    // where the vehicle is and will be, as of the last update
+    double x_, y_, ahead_x_, ahead_y_;
+    bool moved_;
+
+    /// Build queued pages, nearest to the vehicle first
+    void run();
+
+    /// Create the model of a page, and list its textures
+    sdf::SDFPtr buildPage(const Page& page,
+                          std::vector<boost::filesystem::path>& textures) const;
+
+    /// Let the cache manager evict the textures of a page that is gone
+    void release(const Page& page);
+
+    /// Tile range covered by a page
+    void pageTiles(const Page& page, int& min_x, int& max_x, int& min_y, int& max_y) const;
+
+    /// World bounds (m) of a page
+    void pageBounds(const Page& page, double& x0, double& x1, double& y0, double& y1) const;
+
+    /// Distance from (x,y) to the nearest point of a page
+    double distance(const Page& page, double x, double y) const;
+
+    /// Pages within radius of (x,y)
+    void pagesAround(double x, double y, double radius, std::vector<Page>& pages) const;
+
+    std::string pageName(const Page& page) const;
+  };
+
+}
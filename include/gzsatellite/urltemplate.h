@@ -0,0 +1,51 @@
+/**
+ * Tile URL templates, parsed once into a list of literal and variable
+ * parts so that expanding one per tile is a few appends.
+ *
+ * Variables (case-insensitive):
+ *    {x}, {y}, {z}   tile column, row (from the north) and zoom
+ *    {-y}            row from the south, for TMS servers
+ *    {q}             Bing Maps quadkey
+ *    {s}             subdomain: a, b or c
+ *    {s:0,1,2,3}     subdomain from the given list
+ *
+ * The subdomain is picked by tile, (x + y) modulo the number of
+ * subdomains, so that neighbouring tiles are spread across the hosts
+ * while each tile always comes from (and is cached by) the same one.
+ * Anything else in braces is kept as is.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace gzsatellite {
+
+  class UrlTemplate
+  {
+  public:
+    explicit UrlTemplate(const std::string& pattern = std::string());
+
+    /// URL of tile [x,y] at zoom z
+    std::string expand(int x, int y, int z) const;
+
+    /// The template as given
+    const std::string& pattern() const { return pattern_; }
+
+  private:
+    enum class Field { TEXT, X, Y, FLIPPED_Y, Z, QUADKEY, SUBDOMAIN };
+
+    struct Part
+    {
+      Field field;
+      std::string text;   ///< for TEXT
+    };
+
+    std::string pattern_;
+    std::vector<Part> parts_;
+    std::vector<std::string> subdomains_;
+    size_t reserve_;      ///< length of the literal parts
+  };
+
+}
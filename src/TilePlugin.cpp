@@ -6,7 +6,72 @@ namespace gazebo {
 
 static const std::string root = "./gzsatellite/";
 
-TilePlugin::TilePlugin() {}
+// A placeholder is this far below the world model, so that the two don't
+// fight over which is drawn while both are in the world
+static const double PLACEHOLDER_DEPTH = 0.05;
+
+// ----------------------------------------------------------------------------
+
+/// A number from the parameter server, which may have been written with or
+/// without a decimal point
+static double toDouble(XmlRpc::XmlRpcValue& value, const std::string& what)
+{
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeInt) return static_cast<int>(value);
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeDouble) return static_cast<double>(value);
+  throw std::invalid_argument(what + " is not a number");
+}
+
+// ----------------------------------------------------------------------------
+
+/// Regions from the regions param: a list of {name, latitude, longitude,
+/// width, height, zoom}, of which only latitude and longitude are required.
+/// The rest default to the world's params.
+static std::vector<gzsatellite::Region> readRegions(XmlRpc::XmlRpcValue& list,
+                                                    const gzsatellite::GeoParams& params,
+                                                    const std::string& name)
+{
+  if (list.getType() != XmlRpc::XmlRpcValue::TypeArray)
+    throw std::invalid_argument("regions is not a list");
+
+  std::vector<gzsatellite::Region> regions;
+  for (int i=0; i<list.size(); i++) {
+    XmlRpc::XmlRpcValue& r = list[i];
+    const std::string what = "region " + std::to_string(i);
+    if (r.getType() != XmlRpc::XmlRpcValue::TypeStruct ||
+        !r.hasMember("latitude") || !r.hasMember("longitude"))
+      throw std::invalid_argument(what + " needs a latitude and longitude");
+
+    gzsatellite::Region region;
+    region.name = name + "_" + std::to_string(i);
+    if (r.hasMember("name")) {
+      if (r["name"].getType() != XmlRpc::XmlRpcValue::TypeString)
+        throw std::invalid_argument(what + " has a name that is not a string");
+      region.name = static_cast<std::string>(r["name"]);
+    }
+
+    region.lat = toDouble(r["latitude"], what + " latitude");
+    region.lon = toDouble(r["longitude"], what + " longitude");
+    region.width = r.hasMember("width") ? toDouble(r["width"], what + " width") : params.width;
+    region.height = r.hasMember("height") ? toDouble(r["height"], what + " height") : params.height;
+    region.zoom = r.hasMember("zoom") ? toDouble(r["zoom"], what + " zoom") : params.zoom;
+    regions.push_back(region);
+  }
+
+  return regions;
+}
+
+// ----------------------------------------------------------------------------
+
+TilePlugin::TilePlugin() : stop_(std::make_shared<std::atomic<bool>>(false)) {}
+
+// ----------------------------------------------------------------------------
+
+TilePlugin::~TilePlugin()
+{
+  // gives up on a world model still being created
+  *stop_ = true;
+  if (worker_.joinable()) worker_.join();
+}
 
 // ----------------------------------------------------------------------------
 
@@ -14,15 +79,28 @@ void TilePlugin::Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf)
 {
   this->parent_ = _parent;
 
-  std::string service, name;
+  std::string service, name, cache_backend, texture_format, elevation_server;
+  int concurrency, chunk_size;
   double lat, lon, zoom;
   double quality;
   double width, height;
   double shift_x, shift_y;
+  double refresh_age, cache_budget_mb, rate_limit;
+  int max_retries, elevation_zoom;
+  double terrain_error;
+  bool paging, async, stream_stitch;
+  int placeholder_levels;
+  gzsatellite::PagingParams paging_params;
 
   ros::NodeHandle nh("/gzsatellite");
   // Geographic paramters
-  nh.param<std::string>("tileserver", service, "http://mt1.google.com/vt/lyrs=s&x={x}&y={y}&z={z}");
+  nh.param<std::string>("tileserver", service, "http://mt{s:0,1,2,3}.google.com/vt/lyrs=s&x={x}&y={y}&z={z}");
+  nh.param<int>("concurrency", concurrency, 8);
+  nh.param<double>("refresh_age", refresh_age, -1);
+  nh.param<double>("rate_limit", rate_limit, 0);
+  nh.param<int>("max_retries", max_retries, 3);
+  nh.param<std::string>("cache_backend", cache_backend, "directory");
+  nh.param<double>("cache_budget_mb", cache_budget_mb, 0);
   nh.param<double>("latitude", lat, 40.267463);
   nh.param<double>("longitude", lon, -111.635655);
   nh.param<double>("zoom", zoom, 22);
@@ -34,6 +112,23 @@ void TilePlugin::Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf)
   // Model parameters
   nh.param<std::string>("name", name, "Rock Canyon Park");
   nh.param<double>("jpg_quality", quality, 60);
+  nh.param<int>("chunk_size", chunk_size, 0);
+  nh.param<std::string>("texture_format", texture_format, "jpg");
+  nh.param<bool>("stream_stitch", stream_stitch, false);
+  nh.param<bool>("async", async, false);
+  nh.param<int>("placeholder_levels", placeholder_levels, 0);
+  // Terrain parameters
+  nh.param<std::string>("elevation_server", elevation_server, "");
+  nh.param<int>("elevation_zoom", elevation_zoom, 15);
+  nh.param<double>("terrain_error", terrain_error, 0.5);
+  // Paging parameters
+  nh.param<bool>("paging", paging, false);
+  nh.param<std::string>("follow_model", follow_name_, "");
+  nh.param<int>("page_tiles", paging_params.page_tiles, 8);
+  nh.param<double>("page_radius", paging_params.radius, 200);
+  nh.param<double>("prefetch_time", paging_params.prefetch_time, 5);
+  // Instrumentation
+  nh.param<std::string>("trace_file", trace_file_, "");
 
   //
   // Create the model creator with parameters
@@ -41,6 +136,12 @@ void TilePlugin::Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf)
 
   gzsatellite::GeoParams params;
   params.tileserver   = service;
+  params.concurrency  = std::max(1, concurrency);
+  params.refresh_age  = refresh_age;
+  params.rate_limit   = rate_limit;
+  params.max_retries  = std::max(0, max_retries);
+  params.cache_backend = cache_backend;
+  params.cache_budget_mb = cache_budget_mb;
   params.lat          = lat;
   params.lon          = lon;
   params.zoom         = zoom;
@@ -48,8 +149,126 @@ void TilePlugin::Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf)
   params.height       = height;
   params.shift_x      = shift_x;
   params.shift_y      = shift_y;
+  params.chunk_size   = std::max(0, chunk_size);
+  params.texture_format = texture_format;
+  params.stream_stitch = stream_stitch;
+  params.elevation_server = elevation_server;
+  params.elevation_zoom = std::max(0, elevation_zoom);
+  params.terrain_error = std::max(0.0, terrain_error);
+
+  // Lets others wait for the world model (or the first pages) to be in
+  nh.setParam("ready", false);
 
+  convert_service_ = nh.advertiseService("convert_coordinates", &TilePlugin::OnConvert, this);
+  diagnostics_pub_ = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1, true);
+
+  // Several separate sites instead of one world, placed around the origin
+  std::vector<gzsatellite::Region> regions;
+  XmlRpc::XmlRpcValue regions_param;
+  if (nh.getParam("regions", regions_param)) {
+    try {
+      regions = readRegions(regions_param, params, name);
+    } catch (const std::exception& e) {
+      gzerr << "Ignoring the regions param: " << e.what() << std::endl;
+    }
+  }
+
+  if (!regions.empty()) {
+    if (paging)
+      gzwarn << "Paging is not supported with regions; each region is loaded whole" << std::endl;
+
+    if (!async) {
+      InsertRegions(params, regions, name, quality);
+      nh.setParam("ready", true);
+      return;
+    }
+
+    worker_ = std::thread([=]() {
+      try {
+        InsertRegions(params, regions, name, quality);
+        if (!*stop_) ros::NodeHandle("/gzsatellite").setParam("ready", true);
+      } catch (const std::exception& e) {
+        if (!*stop_) gzerr << "Failed to create the regions: " << e.what() << std::endl;
+      }
+    });
+
+    gzmsg << "Creating " << regions.size() << " regions in the background" << std::endl;
+    return;
+  }
+
+  // Load ground pages around a model as it moves instead of one big world
+  if (paging) {
+    pager_.reset(new gzsatellite::TilePager(params, paging_params, root, name, quality));
+    converter_.reset(new gzsatellite::GeoConverter(pager_->geoConverter()));
+    update_connection_ = event::Events::ConnectWorldUpdateBegin(
+                            std::bind(&TilePlugin::OnUpdate, this));
+
+    gzmsg << "Paging world model '" << name << "' around '" << follow_name_ << "'" << std::endl;
+    return;
+  }
+
+  if (!async) {
+    InsertWorld(params, name, quality);
+    nh.setParam("ready", true);
+    return;
+  }
+
+  //
+  // Create the world model in the background, so that the rest of the world
+  // doesn't wait for its tiles. A low-resolution version of it, a few zoom
+  // levels up (i.e., with far fewer tiles), can stand in for it meanwhile.
+  //
+
+  worker_ = std::thread([=]() {
+    ros::NodeHandle nh("/gzsatellite");
+    const std::string placeholder = name + "_placeholder";
+
+    try {
+      if (placeholder_levels > 0)
+        InsertWorld(params, placeholder, quality, placeholder_levels);
+
+      InsertWorld(params, name, quality);
+
+      // The placeholder goes once the world model is in, so that there is
+      // always ground
+      if (placeholder_levels > 0) {
+        while (!*stop_ && !parent_->ModelByName(name))
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        transport::requestNoReply(parent_->Name(), "entity_delete", placeholder);
+      }
+
+      nh.setParam("ready", true);
+    } catch (const std::exception& e) {
+      if (!*stop_)
+        gzerr << "Failed to create world model '" << name << "': " << e.what() << std::endl;
+    }
+  });
+
+  gzmsg << "Creating world model '" << name << "' in the background" << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::InsertWorld(const gzsatellite::GeoParams& params,
+                             const std::string& name, unsigned int quality,
+                             unsigned int placeholder_levels)
+{
   gzsatellite::ModelCreator m(params, root);
+  m.setStopFlag(stop_);
+
+  // A placeholder only stands in for the world model until it is ready; it
+  // is neither reported on nor used for conversions
+  if (placeholder_levels > 0) {
+    auto low = m.placeholder(placeholder_levels, root);
+    low->setStopFlag(stop_);
+
+    auto modelSDF = low->createModel(name, quality);
+    modelSDF->Root()->GetElement("model")->GetElement("pose")->Set(
+                          ignition::math::Pose3d(0, 0, -PLACEHOLDER_DEPTH, 0, 0, 0));
+    this->parent_->InsertModelSDF(*modelSDF);
+    gzmsg << "Placeholder '" << name << "' created." << std::endl;
+    return;
+  }
 
   //
   // Create a world model and add it to the Gazebo World
@@ -58,16 +277,171 @@ void TilePlugin::Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf)
   auto modelSDF = m.createModel(name, quality);
   this->parent_->InsertModelSDF(*modelSDF);
 
-  gzmsg << "World model '" << name << "' (" << std::setprecision(10) << lat << "," << lon << ") created." << std::endl;
+  PublishDiagnostics(*m.profiler(), name, false);
+
+  gzmsg << "World model '" << name << "' (" << std::setprecision(10) << params.lat << ","
+        << params.lon << ") created." << std::endl;
 
   double originLat, originLon;
   m.getOriginLatLon(originLat, originLon);
   gzdbg << std::setprecision(10) << originLat << "," << originLon << std::endl;
 
+  std::lock_guard<std::mutex> lock(converter_mutex_);
+  converter_.reset(new gzsatellite::GeoConverter(m.geoConverter()));
+
   // std::cout << modelSDF->ToString() << std::endl;
 }
 
 // ----------------------------------------------------------------------------
 
+void TilePlugin::InsertRegions(const gzsatellite::GeoParams& params,
+                               const std::vector<gzsatellite::Region>& regions,
+                               const std::string& name, unsigned int quality)
+{
+  gzsatellite::RegionSet set(params, regions, root, quality);
+  set.setStopFlag(stop_);
+
+  // The world frame is known before any region is
+  {
+    std::lock_guard<std::mutex> lock(converter_mutex_);
+    converter_.reset(new gzsatellite::GeoConverter(set.geoConverter()));
+  }
+
+  const auto models = set.createModels();
+  for (size_t i=0; i<models.size(); i++) {
+    if (!models[i]) continue;
+    this->parent_->InsertModelSDF(*models[i]);
+
+    gzmsg << "Region '" << regions[i].name << "' (" << std::setprecision(10) << regions[i].lat
+          << "," << regions[i].lon << ") created." << std::endl;
+  }
+
+  PublishDiagnostics(*set.profiler(), name, false);
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::OnUpdate()
+{
+  if (!follow_) {
+    follow_ = parent_->ModelByName(follow_name_);
+    if (!follow_) return;
+  }
+
+  const auto pos = follow_->WorldPose().Pos();
+  const auto vel = follow_->WorldLinearVel();
+  pager_->update(pos.X(), pos.Y(), vel.X(), vel.Y());
+
+  std::vector<sdf::SDFPtr> load;
+  std::vector<std::string> unload;
+  pager_->poll(load, unload);
+
+  for (const auto& modelSDF : load)
+    parent_->InsertModelSDF(*modelSDF);
+
+  if (!load.empty())
+    PublishDiagnostics(*pager_->profiler(), follow_name_, true);
+
+  if (!load.empty() && !ready_) {
+    ros::NodeHandle("/gzsatellite").setParam("ready", true);
+    ready_ = true;
+  }
+
+  // Models can't be removed from within a world update, so ask the world
+  // to delete them once the update is over
+  for (const auto& name : unload)
+    transport::requestNoReply(parent_->Name(), "entity_delete", name);
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::PublishDiagnostics(const gzsatellite::Profiler& profiler,
+                                    const std::string& name, bool page)
+{
+  const auto stages = profiler.stages();
+  const auto counters = profiler.counters();
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.name = "gzsatellite: " + (page ? "pages around " + name : name);
+  status.hardware_id = "gzsatellite";
+
+  auto value = [&status](const std::string& key, double v) {
+    diagnostic_msgs::KeyValue kv;
+    kv.key = key;
+    std::ostringstream os;
+    os << v;
+    kv.value = os.str();
+    status.values.push_back(kv);
+  };
+
+  // Stages run on several threads at once, so their times add up to more
+  // than the wall-clock time
+  for (const auto& s : stages) {
+    value(s.first + " (s)", s.second.seconds);
+    value(s.first + " calls", s.second.calls);
+  }
+  for (const auto& c : counters)
+    value(c.first, c.second);
+
+  // The counters add up over a whole paging session, so only the tiles
+  // that failed since the last report (e.g., in the latest pages) warn
+  const auto it = counters.find("tiles failed");
+  const double failed = (it != counters.end()) ? it->second : 0;
+  double& reported = failed_reported_[status.name];
+  const double new_failed = failed - reported;
+  reported = failed;
+  value("tiles failed since last report", new_failed);
+
+  const auto total = stages.find("createModel");
+  status.level = (new_failed > 0) ? diagnostic_msgs::DiagnosticStatus::WARN
+                                  : diagnostic_msgs::DiagnosticStatus::OK;
+
+  std::ostringstream message;
+  message << std::setprecision(3) << ((total != stages.end()) ? total->second.seconds : 0.0)
+          << " s to create " << (page ? "pages" : "the world model");
+  if (status.level != diagnostic_msgs::DiagnosticStatus::OK)
+    message << ", " << new_failed << " tiles failed";
+  status.message = message.str();
+
+  diagnostic_msgs::DiagnosticArray array;
+  array.header.stamp = ros::Time::now();
+  array.status.push_back(status);
+  diagnostics_pub_.publish(array);
+
+  if (!trace_file_.empty() && !profiler.writeChromeTrace(trace_file_))
+    gzwarn << "Failed to write the trace to " << trace_file_ << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+bool TilePlugin::OnConvert(gzsatellite::ConvertCoordinates::Request& req,
+                           gzsatellite::ConvertCoordinates::Response& res)
+{
+  typedef gzsatellite::GeoConverter::Frame Frame;
+  static const Frame frames[] = {Frame::LATLON, Frame::TILE, Frame::PIXEL, Frame::LOCAL};
+
+  if (req.from >= 4 || req.to >= 4) {
+    res.message = "Unknown frame";
+  } else if (req.x.size() != req.y.size()) {
+    res.message = "x and y have different sizes";
+  } else {
+    std::lock_guard<std::mutex> lock(converter_mutex_);
+    if (!converter_) {
+      res.message = "The world model has not been created yet";
+    } else {
+      res.x.resize(req.x.size());
+      res.y.resize(req.y.size());
+      converter_->convert(frames[req.from], frames[req.to], req.x.data(), req.y.data(),
+                          req.x.size(), res.x.data(), res.y.data());
+      res.success = true;
+    }
+  }
+
+  // The service call itself succeeded; success tells whether the conversion did
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
 GZ_REGISTER_WORLD_PLUGIN(TilePlugin)
 }
\ No newline at end of file
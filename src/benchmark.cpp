@@ -0,0 +1,527 @@
+/**
+ * benchmark: time the stages of the tile pipeline over a range of region
+ * sizes and zoom levels, to catch performance regressions.
+ *
+ * Usage:
+ *    benchmark [options]
+ *
+ * Options:
+ *    --root <dir>          scratch directory (a temporary one, removed after)
+ *    --server <template>   tile server ({x}, {y}, {z}); by default a local
+ *                          stand-in of generated tiles, served over HTTP
+ *                          on 127.0.0.1 without any latency
+ *    --file-server         serve the stand-in's tiles through file:// URLs
+ *                          instead (no sockets or HTTP in the measurements)
+ *    --lat <deg>           region centre (40.267463)
+ *    --lon <deg>           region centre (-111.635655)
+ *    --zooms <z,...>       zoom levels (17,19,21)
+ *    --sizes <m,...>       region widths/heights in meters (100,400)
+ *    --iterations <n>      repetitions of each benchmark (5)
+ *    --concurrency <n>     concurrent downloads (8)
+ *
+ * Each benchmark prints one JSON object per line to stdout, e.g.
+ *
+ *    {"benchmark": "loadTiles/cached", "zoom": 19, "size": 100, "unit": "tiles",
+ *     "items": 36, "iterations": 5, "mean_s": 0.0021, "min_s": 0.0019, ...}
+ *
+ * with the time per iteration and the items (points, tiles, pixels)
+ * processed per second, so that runs can be compared with a script.
+ * Progress goes to stderr.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+#include <fstream>
+#include <thread>
+#include <atomic>
+
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "gzsatellite/modelcreator.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+typedef std::chrono::steady_clock Clock;
+
+// conversions timed per iteration of the coordinate benchmarks
+static const int NUM_POINTS = 1000000;
+
+// keeps results of the timed loops from being optimized away
+static volatile double sink = 0;
+
+/// Timings of one benchmark at one zoom level and region size
+struct Result
+{
+  std::string name;
+  unsigned int zoom;
+  double size;
+  std::string unit;   ///< what items counts
+  uint64_t items;     ///< processed per iteration
+  std::vector<double> times;
+  std::vector<std::pair<std::string, double>> extra;  ///< more (mean) seconds
+};
+
+// ----------------------------------------------------------------------------
+
+static void usage(const char* argv0)
+{
+  std::cerr << "Usage: " << argv0 << " [--root <dir>] [--server <template>] [--file-server]"
+               " [--lat <deg>] [--lon <deg>] [--zooms <z,...>] [--sizes <m,...>]"
+               " [--iterations <n>] [--concurrency <n>]" << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+static std::vector<double> parseList(const std::string& list)
+{
+  std::vector<double> values;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    values.push_back(std::stod(item));
+  return values;
+}
+
+// ----------------------------------------------------------------------------
+
+/// Time body over several iterations, each after an untimed setup
+template <typename Setup, typename Body>
+static std::vector<double> measure(int iterations, Setup setup, Body body)
+{
+  std::vector<double> times;
+  for (int i=0; i<iterations; i++) {
+    setup();
+    const auto start = Clock::now();
+    body();
+    times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+  }
+  return times;
+}
+
+template <typename Body>
+static std::vector<double> measure(int iterations, Body body)
+{
+  return measure(iterations, []() {}, body);
+}
+
+// ----------------------------------------------------------------------------
+
+static void report(const Result& r)
+{
+  const double sum = std::accumulate(r.times.begin(), r.times.end(), 0.0);
+  const double mean = sum/r.times.size();
+  const double min = *std::min_element(r.times.begin(), r.times.end());
+  const double max = *std::max_element(r.times.begin(), r.times.end());
+
+  std::cout << std::setprecision(6)
+            << "{\"benchmark\": \"" << r.name << "\", \"zoom\": " << r.zoom
+            << ", \"size\": " << r.size << ", \"unit\": \"" << r.unit
+            << "\", \"items\": " << r.items << ", \"iterations\": " << r.times.size()
+            << ", \"mean_s\": " << mean << ", \"min_s\": " << min << ", \"max_s\": " << max
+            << ", \"items_per_s\": " << r.items/std::max(mean, 1e-9);
+  for (const auto& e : r.extra)
+    std::cout << ", \"" << e.first << "\": " << e.second;
+  std::cout << "}" << std::endl;
+
+  std::cerr << "  " << std::left << std::setw(28) << r.name << std::right
+            << std::setprecision(3) << mean*1e3 << " ms" << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+/// Write a distinct, photo-like JPEG for every tile of the range that
+/// the stand-in server doesn't have yet
+static void generateTiles(const fs::path& dir, int min_x, int max_x,
+                          int min_y, int max_y, unsigned int zoom)
+{
+  const int size = TileLoader::imageSize();
+  cv::Mat img(size, size, CV_8UC3);
+  std::vector<unsigned char> buf;
+
+  for (int x = min_x; x <= max_x; x++) {
+    for (int y = min_y; y <= max_y; y++) {
+      const fs::path path = dir/std::to_string(zoom)/std::to_string(x)/(std::to_string(y)+".jpg");
+      if (fs::exists(path)) continue;
+
+      // Smooth gradients with some noise compress about like imagery
+      std::mt19937 rng(x*7919 + y*104729 + zoom);
+      std::uniform_int_distribution<int> noise(-12, 12);
+      const int base = rng() % 128;
+      for (int r=0; r<size; r++) {
+        uint8_t* p = img.ptr<uint8_t>(r);
+        for (int c=0; c<size; c++, p+=3) {
+          const int v = base + (r + c)/4;
+          p[0] = cv::saturate_cast<uint8_t>(v + noise(rng));
+          p[1] = cv::saturate_cast<uint8_t>(v + 20 + noise(rng));
+          p[2] = cv::saturate_cast<uint8_t>(v + 10 + noise(rng));
+        }
+      }
+
+      fs::create_directories(path.parent_path());
+      cv::imencode(".jpg", img, buf, {cv::IMWRITE_JPEG_QUALITY, 85});
+      std::ofstream(path.string(), std::ios::binary)
+        .write(reinterpret_cast<const char*>(buf.data()), buf.size());
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+/// HTTP server on 127.0.0.1 for the stand-in's tiles (the files under dir),
+/// answering every GET at once. Connections are kept alive, as a real tile
+/// server's are.
+class StandInServer
+{
+public:
+  explicit StandInServer(const fs::path& dir) : dir_(dir), stop_(false)
+  {
+    fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (fd_ < 0 || ::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(fd_, 64) != 0 ||
+        ::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+      throw std::runtime_error("Can't start the stand-in tile server");
+    port_ = ntohs(addr.sin_port);
+
+    thread_ = std::thread(&StandInServer::run, this);
+  }
+
+  ~StandInServer()
+  {
+    stop_ = true;
+    thread_.join();
+    for (auto& t : connections_) t.join();
+    ::close(fd_);
+  }
+
+  std::string url() const
+  { return "http://127.0.0.1:" + std::to_string(port_) + "/{z}/{x}/{y}.jpg"; }
+
+private:
+  fs::path dir_;
+  int fd_;
+  int port_;
+  std::atomic<bool> stop_;
+  std::thread thread_;
+  std::vector<std::thread> connections_;
+
+  void run()
+  {
+    while (!stop_) {
+      pollfd p = {fd_, POLLIN, 0};
+      if (::poll(&p, 1, 50) <= 0) continue;
+
+      const int conn = ::accept(fd_, nullptr, nullptr);
+      if (conn >= 0) connections_.emplace_back(&StandInServer::serve, this, conn);
+    }
+  }
+
+  void serve(int conn)
+  {
+    std::string buffered;
+    char buf[4096];
+    while (!stop_) {
+      // Wait for the next request head (a GET has no body)
+      const size_t end = buffered.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        pollfd p = {conn, POLLIN, 0};
+        if (::poll(&p, 1, 50) <= 0) continue;
+
+        const ssize_t n = ::recv(conn, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        buffered.append(buf, n);
+        continue;
+      }
+
+      const size_t begin = buffered.find(' ') + 1;
+      const std::string path = buffered.substr(begin, buffered.find(' ', begin) - begin);
+      buffered.erase(0, end + 4);
+
+      std::string body;
+      std::ifstream in((dir_/path).string(), std::ios::binary);
+      const bool found = in && path.find("..") == std::string::npos;
+      if (found) body.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+      const std::string response = std::string(found ? "HTTP/1.1 200 OK\r\n"
+                                                     : "HTTP/1.1 404 Not Found\r\n") +
+                                   "Content-Type: image/jpeg\r\n"
+                                   "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" +
+                                   body;
+      for (size_t sent = 0; sent < response.size();) {
+        const ssize_t n = ::send(conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) { ::close(conn); return; }
+        sent += n;
+      }
+    }
+    ::close(conn);
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+static void run(const fs::path& root, const std::string& server, double lat, double lon,
+                unsigned int zoom, double size, int iterations, unsigned int concurrency)
+{
+  std::cerr << "zoom " << zoom << ", " << size << " x " << size << " m" << std::endl;
+
+  const fs::path cache = root/"mapscache";
+  auto newLoader = [&]() {
+    std::unique_ptr<TileLoader> loader(new TileLoader(cache.string(), server,
+                                                      lat, lon, zoom, size, size));
+    loader->setConcurrency(concurrency);
+    return loader;
+  };
+
+  std::unique_ptr<TileLoader> loader = newLoader();
+  int min_x, max_x, min_y, max_y;
+  loader->tileRange(min_x, max_x, min_y, max_y);
+  const int num_tiles = loader->numTiles();
+
+  auto result = [&](const std::string& name, const std::string& unit, uint64_t items) {
+    Result r;
+    r.name = name;
+    r.zoom = zoom;
+    r.size = size;
+    r.unit = unit;
+    r.items = items;
+    return r;
+  };
+
+  //
+  // Coordinate conversions, over points spread across the region
+  //
+
+  {
+    double x0, y0;
+    TileLoader::latLonToTileCoords(lat, lon, zoom, x0, y0);
+    const double span = (max_x - min_x + 1);
+    const double step = span/NUM_POINTS;
+
+    Result r = result("latLonToTileCoords", "points", NUM_POINTS);
+    r.times = measure(iterations, [&]() {
+      double acc = 0;
+      for (int i=0; i<NUM_POINTS; i++) {
+        double x, y;
+        TileLoader::latLonToTileCoords(lat + i*1e-9, lon + i*1e-9, zoom, x, y);
+        acc += x + y;
+      }
+      sink = acc;
+    });
+    report(r);
+
+    r = result("tileCoordsToLatLon", "points", NUM_POINTS);
+    r.times = measure(iterations, [&]() {
+      double acc = 0;
+      for (int i=0; i<NUM_POINTS; i++) {
+        double la, lo;
+        TileLoader::tileCoordsToLatLon(x0 + i*step, y0 + i*step, zoom, la, lo);
+        acc += la + lo;
+      }
+      sink = acc;
+    });
+    report(r);
+  }
+
+  //
+  // URI templating, repeated over the region's tiles
+  //
+
+  {
+    const int rounds = std::max(1, 100000/num_tiles);
+    Result r = result("uriForTile", "tiles", static_cast<uint64_t>(rounds)*num_tiles);
+    r.times = measure(iterations, [&]() {
+      size_t acc = 0;
+      for (int i=0; i<rounds; i++)
+        for (int x = min_x; x <= max_x; x++)
+          for (int y = min_y; y <= max_y; y++)
+            acc += loader->uriForTile(x, y).size();
+      sink = acc;
+    });
+    report(r);
+  }
+
+  //
+  // Loading: from the (stand-in) server into an empty cache, then cached
+  //
+
+  Result r = result("numTilesToDownload/empty", "tiles", num_tiles);
+  r.times = measure(iterations,
+    [&]() { fs::remove_all(cache); loader = newLoader(); },
+    [&]() { sink = loader->numTilesToDownload(); });
+  report(r);
+
+  r = result("loadTiles/download", "tiles", num_tiles);
+  r.times = measure(iterations,
+    [&]() { fs::remove_all(cache); loader = newLoader(); },
+    [&]() { loader->loadTiles(); });
+  if (loader->loadStats().failed > 0)
+    std::cerr << "  " << loader->loadStats().failed << " tiles failed to download" << std::endl;
+  report(r);
+
+  r = result("numTilesToDownload/cached", "tiles", num_tiles);
+  r.times = measure(iterations, [&]() { sink = loader->numTilesToDownload(); });
+  report(r);
+
+  r = result("loadTiles/cached", "tiles", num_tiles);
+  r.times = measure(iterations, [&]() {
+    std::atomic<size_t> bytes(0);
+    loader->loadTiles(true, [&](const TileLoader::MapTile&, const TileBytes& b) { bytes += b.size; });
+    sink = bytes;
+  });
+  report(r);
+
+  //
+  // Stitching the cached tiles into the world image, end to end
+  //
+
+  GeoParams params;
+  params.tileserver = server;
+  params.concurrency = concurrency;
+  params.lat = lat;
+  params.lon = lon;
+  params.zoom = zoom;
+  params.width = size;
+  params.height = size;
+  params.shift_x = 0;
+  params.shift_y = 0;
+
+  double load = 0, decode = 0, encode = 0;
+  r = result("createModel/stitch", "tiles", num_tiles);
+  r.times = measure(iterations,
+    [&]() { fs::remove_all(root/"materials"); },
+    [&]() {
+      ModelCreator creator(params, root.string());
+      creator.createModel("benchmark", 60);
+      load += creator.stitchStats().load;
+      decode += creator.stitchStats().decode;
+      encode += creator.stitchStats().encode;
+    });
+  r.extra = {{"load_s", load/iterations}, {"decode_s", decode/iterations},
+             {"encode_s", encode/iterations}};
+  report(r);
+
+  //
+  // Encoding a world image of this size in each texture format
+  //
+
+  const int tile_size = TileLoader::imageSize();
+  cv::Mat img = cv::Mat::zeros((max_y - min_y + 1)*tile_size, (max_x - min_x + 1)*tile_size, CV_8UC3);
+  for (const auto& tile : loader->tiles()) {
+    TileBytes bytes;
+    if (!loader->readTile(tile, bytes)) continue;
+
+    cv::Mat buf(1, static_cast<int>(bytes.size), CV_8UC1, const_cast<char*>(bytes.data));
+    cv::Mat decoded = cv::imdecode(buf, cv::IMREAD_COLOR);
+    if (decoded.cols != tile_size || decoded.rows != tile_size) continue;
+
+    decoded.copyTo(img(cv::Rect((tile.x() - min_x)*tile_size, (tile.y() - min_y)*tile_size,
+                                tile_size, tile_size)));
+  }
+
+  const fs::path out = root/"encoded";
+  const uint64_t pixels = img.total();
+
+  r = result("encode/jpg", "pixels", pixels);
+  r.times = measure(iterations, [&]() { writeJPEG(out, img, 60); });
+  report(r);
+
+  r = result("encode/png", "pixels", pixels);
+  r.times = measure(iterations, [&]() { cv::imwrite(out.string() + ".png", img); });
+  report(r);
+
+  r = result("encode/dds", "pixels", pixels);
+  r.times = measure(iterations, [&]() { writeDDS(out, img); });
+  report(r);
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  fs::path root;
+  std::string server;
+  bool file_server = false;
+  double lat = 40.267463, lon = -111.635655;
+  std::vector<double> zooms = {17, 19, 21};
+  std::vector<double> sizes = {100, 400};
+  int iterations = 5;
+  unsigned int concurrency = 8;
+
+  for (int i=1; i<argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i+1 < argc;
+    if (arg == "--root" && has_value) root = argv[++i];
+    else if (arg == "--server" && has_value) server = argv[++i];
+    else if (arg == "--file-server") file_server = true;
+    else if (arg == "--lat" && has_value) lat = std::stod(argv[++i]);
+    else if (arg == "--lon" && has_value) lon = std::stod(argv[++i]);
+    else if (arg == "--zooms" && has_value) zooms = parseList(argv[++i]);
+    else if (arg == "--sizes" && has_value) sizes = parseList(argv[++i]);
+    else if (arg == "--iterations" && has_value) iterations = std::max(1, std::stoi(argv[++i]));
+    else if (arg == "--concurrency" && has_value) concurrency = std::stoi(argv[++i]);
+    else { usage(argv[0]); return 1; }
+  }
+
+  // The model creator reports on every stitch otherwise
+  gazebo::common::Console::SetQuiet(true);
+
+  const bool temporary = root.empty();
+  if (temporary)
+    root = fs::temp_directory_path()/fs::unique_path("gzsatellite-benchmark-%%%%%%%%");
+
+  try {
+    fs::create_directories(root);
+    root = fs::canonical(root);
+
+    // The stand-in server is a directory of generated tiles, served over
+    // HTTP on the loopback interface (so that downloads take the same
+    // path as from a real server, minus the network), or read by curl
+    // through file:// URLs
+    const bool standin = server.empty();
+    std::unique_ptr<StandInServer> http;
+    if (standin && file_server) {
+      server = "file://" + (root/"server").string() + "/{z}/{x}/{y}.jpg";
+    } else if (standin) {
+      http.reset(new StandInServer(root/"server"));
+      server = http->url();
+    }
+
+    for (double z : zooms) {
+      for (double size : sizes) {
+        if (standin) {
+          TileLoader loader((root/"mapscache").string(), server, lat, lon, z, size, size);
+          int min_x, max_x, min_y, max_y;
+          loader.tileRange(min_x, max_x, min_y, max_y);
+          generateTiles(root/"server", min_x, max_x, min_y, max_y, z);
+        }
+
+        run(root, server, lat, lon, z, size, iterations, concurrency);
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    if (temporary) fs::remove_all(root);
+    return 1;
+  }
+
+  if (temporary) fs::remove_all(root);
+  return 0;
+}
@@ -0,0 +1,390 @@
+#include "gzsatellite/cachemanager.h"
+
+#include <iostream>
+#include <sstream>
+#include <set>
+
+namespace gzsatellite {
+
+namespace fs = boost::filesystem;
+
+static std::string tileKey(const std::string& service, int x, int y, int z)
+{
+  std::ostringstream os;
+  os << "tile " << service << " " << x << " " << y << " " << z;
+  return os.str();
+}
+
+// ----------------------------------------------------------------------------
+
+static uint64_t fileSize(const fs::path& path)
+{
+  boost::system::error_code ec;
+  const uintmax_t size = fs::file_size(path, ec);
+  return (ec) ? 0 : size;
+}
+
+// ----------------------------------------------------------------------------
+
+CacheManager::CacheManager(const fs::path& root, uint64_t budget)
+  : root_(fs::absolute(root)), ledger_path_(root_/"cache.ledger"),
+    budget_(budget), loaded_(false), journal_lines_(0)
+{
+  stats_.budget = budget_;
+}
+
+// ----------------------------------------------------------------------------
+
+CacheManager::~CacheManager()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!loaded_) return;
+
+  // Keep the journal from growing without bound
+  if (journal_lines_ > 2*entries_.size() + 1024) rewriteJournal();
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::attach(const std::string& service,
+                          const std::shared_ptr<TileCache>& cache)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  caches_[service] = cache;
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::touchTile(const std::string& service, int x, int y, int z, bool hit)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  load();
+
+  if (hit) stats_.tile_hits++;
+  else stats_.tile_misses++;
+
+  // Tiles keep the size they were first recorded with
+  const std::string key = tileKey(service, x, y, z);
+  auto it = entries_.find(key);
+  uint64_t bytes = 0;
+  if (it != entries_.end() && hit) {
+    bytes = it->second->bytes;
+  } else {
+    auto cache = cacheFor(service);
+    if (cache) bytes = cache->sizeOf(x, y, z);
+  }
+
+  touch(key, bytes, std::time(nullptr), true);
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::unpinTile(const std::string& service, int x, int y, int z)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  unpin(tileKey(service, x, y, z));
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::refreshTile(const std::string& service, int x, int y, int z)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  load();
+
+  const std::string key = tileKey(service, x, y, z);
+  auto it = entries_.find(key);
+  if (it != entries_.end())
+    touch(key, it->second->bytes, std::time(nullptr), false);
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::touchTexture(const fs::path& texture, const fs::path& script, bool hit)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  load();
+
+  if (hit) stats_.texture_hits++;
+  else stats_.texture_misses++;
+
+  const uint64_t bytes = fileSize(texture) + fileSize(script) + fileSize(holesPath(texture));
+  touch("texture " + texture.filename().string(), bytes, std::time(nullptr), true);
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::unpinTexture(const fs::path& texture)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  unpin("texture " + texture.filename().string());
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::evict()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  load();
+
+  std::set<std::string> services;
+
+  // The front of the list is the least recently used entry
+  auto it = lru_.begin();
+  while (stats_.bytes > budget_ && it != lru_.end()) {
+    if (it->pins > 0) { ++it; continue; }
+
+    const Entry e = *it++;
+    if (!remove(e.key)) continue;
+
+    std::istringstream is(e.key);
+    std::string kind, service;
+    is >> kind >> service;
+    if (kind == "tile") services.insert(service);
+
+    erase(e.key);
+    stats_.evictions++;
+    stats_.evicted_bytes += e.bytes;
+  }
+
+  // Let packed caches reclaim the space of evicted tiles
+  for (const auto& service : services) {
+    auto cache = cacheFor(service);
+    if (cache) cache->compact();
+  }
+
+  journal_.flush();
+}
+
+// ----------------------------------------------------------------------------
+
+CacheManager::Stats CacheManager::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void CacheManager::load()
+{
+  if (loaded_) return;
+  loaded_ = true;
+
+  if (!fs::exists(ledger_path_)) {
+    seed();
+    return;
+  }
+
+  std::ifstream in(ledger_path_.string());
+
+  // "+ <bytes> <time> <key>" moves key to the most recently used end,
+  // "- <key>" forgets it
+  std::string line;
+  while (std::getline(in, line)) {
+    journal_lines_++;
+    std::istringstream is(line);
+
+    char op;
+    is >> op;
+    if (op == '+') {
+      uint64_t bytes;
+      long long time;
+      is >> bytes >> time;
+      is.ignore(1);
+
+      std::string key;
+      std::getline(is, key);
+      if (!key.empty()) touch(key, bytes, time, false);
+
+    } else if (op == '-') {
+      is.ignore(1);
+
+      std::string key;
+      std::getline(is, key);
+      erase(key);
+    }
+  }
+
+  journal_.open(ledger_path_.string(), std::ios::out | std::ios::app);
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::seed()
+{
+  // Without a journal, the cache is scanned once. Tiles found this way are
+  // older than anything used from now on.
+  const fs::path maps = root_/"mapscache";
+  if (fs::is_directory(maps)) {
+    for (fs::directory_iterator it(maps), end; it != end; ++it) {
+      if (!fs::is_directory(it->path())) continue;
+
+      const std::string service = it->path().filename().string();
+      auto cache = cacheFor(service);
+      if (!cache) continue;
+
+      cache->list([&](int x, int y, int z) {
+        touch(tileKey(service, x, y, z), cache->sizeOf(x, y, z), 0, false);
+      });
+    }
+  }
+
+  // Stitched textures without a material script (or vice versa) are
+  // leftovers that nothing can use; everything else is tracked. Holes
+  // records are part of their texture's entry.
+  std::set<std::string> textures;
+  if (fs::is_directory(texturesDir())) {
+    for (fs::directory_iterator it(texturesDir()), end; it != end; ++it) {
+      if (it->path().extension() == ".holes") continue;
+
+      const fs::path script = scriptsDir()/(it->path().stem().string() + ".material");
+      if (!fs::exists(script)) {
+        fs::remove(it->path());
+        continue;
+      }
+      textures.insert(it->path().stem().string());
+      touch("texture " + it->path().filename().string(),
+            fileSize(it->path()) + fileSize(script) + fileSize(holesPath(it->path())), 0, false);
+    }
+
+    for (fs::directory_iterator it(texturesDir()), end; it != end; ++it)
+      if (it->path().extension() == ".holes" && !textures.count(it->path().stem().string()))
+        fs::remove(it->path());
+  }
+
+  if (fs::is_directory(scriptsDir())) {
+    for (fs::directory_iterator it(scriptsDir()), end; it != end; ++it)
+      if (!textures.count(it->path().stem().string())) fs::remove(it->path());
+  }
+
+  rewriteJournal();
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::touch(const std::string& key, uint64_t bytes, std::time_t time, bool pin)
+{
+  unsigned int pins = pin ? 1 : 0;
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    stats_.bytes -= it->second->bytes;
+    pins += it->second->pins;
+    lru_.erase(it->second);
+  }
+
+  lru_.push_back(Entry{key, bytes, time, pins});
+  entries_[key] = std::prev(lru_.end());
+  stats_.bytes += bytes;
+
+  if (journal_.is_open()) {
+    journal_ << "+ " << bytes << " " << static_cast<long long>(time) << " " << key << "\n";
+    journal_lines_++;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::unpin(const std::string& key)
+{
+  auto it = entries_.find(key);
+  if (it != entries_.end() && it->second->pins > 0) it->second->pins--;
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::erase(const std::string& key)
+{
+  auto it = entries_.find(key);
+  if (it == entries_.end()) return;
+
+  stats_.bytes -= it->second->bytes;
+  lru_.erase(it->second);
+  entries_.erase(it);
+
+  if (journal_.is_open()) {
+    journal_ << "- " << key << "\n";
+    journal_lines_++;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+bool CacheManager::remove(const std::string& key)
+{
+  std::istringstream is(key);
+  std::string kind;
+  is >> kind;
+
+  if (kind == "tile") {
+    std::string service;
+    int x, y, z;
+    is >> service >> x >> y >> z;
+
+    auto cache = cacheFor(service);
+    if (!cache) return false;
+    cache->remove(x, y, z);
+    return true;
+  }
+
+  if (kind == "texture") {
+    std::string name;
+    is >> name;
+
+    const fs::path texture = texturesDir()/name;
+    boost::system::error_code ec;
+    fs::remove(texture, ec);
+    fs::remove(holesPath(texture), ec);
+    fs::remove(scriptsDir()/(texture.stem().string() + ".material"), ec);
+    return true;
+  }
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void CacheManager::rewriteJournal()
+{
+  const fs::path tmp = ledger_path_.string() + ".tmp";
+  {
+    std::ofstream out(tmp.string());
+    for (const auto& e : lru_)
+      out << "+ " << e.bytes << " " << static_cast<long long>(e.time) << " " << e.key << "\n";
+  }
+
+  journal_.close();
+  fs::rename(tmp, ledger_path_);
+  journal_.open(ledger_path_.string(), std::ios::out | std::ios::app);
+  journal_lines_ = lru_.size();
+}
+
+// ----------------------------------------------------------------------------
+
+std::shared_ptr<TileCache> CacheManager::cacheFor(const std::string& service)
+{
+  auto it = caches_.find(service);
+  if (it != caches_.end()) return it->second;
+
+  // Open the service's cache with whatever backend it was written with
+  const fs::path dir = root_/"mapscache"/service;
+  std::shared_ptr<TileCache> cache;
+  try {
+    if (fs::is_directory(dir)) {
+      const bool packed = fs::exists(dir/"tiles.pack");
+      cache = TileCache::create(packed ? TileCache::Backend::PACK
+                                       : TileCache::Backend::DIRECTORY, dir);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Skipping tile cache " << dir << ": " << e.what() << std::endl;
+  }
+
+  caches_[service] = cache;
+  return cache;
+}
+
+// ----------------------------------------------------------------------------
+
+}
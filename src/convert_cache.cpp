@@ -0,0 +1,107 @@
+/**
+ * convert_cache: move tiles from the directory cache layout
+ * (x{x}_y{y}_z{z}.jpg files) into a tile pack (tiles.pack + tiles.idx).
+ *
+ * Usage:
+ *    convert_cache [--remove] <dir>
+ *
+ * dir is either one service's cache directory or the mapscache root, in
+ * which case every service directory below it is converted. With --remove,
+ * converted tile files, their .meta sidecars and the blobs no tile links
+ * to any more are deleted.
+ */
+
+#include <iostream>
+#include <vector>
+
+#include "gzsatellite/tilecache.h"
+#include "gzsatellite/packedtilecache.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+// ----------------------------------------------------------------------------
+
+static size_t convert(const fs::path& dir, bool remove)
+{
+  // Collect the tiles first so the pack isn't written while iterating
+  std::vector<fs::path> files;
+  for (fs::directory_iterator it(dir), end; it != end; ++it) {
+    int x, y, z;
+    if (DirectoryTileCache::parseName(it->path().filename().string(), x, y, z))
+      files.push_back(it->path());
+  }
+
+  if (files.empty()) return 0;
+
+  DirectoryTileCache src(dir);
+  PackedTileCache dst(dir);
+
+  size_t n = 0;
+  for (const auto& f : files) {
+    int x, y, z;
+    DirectoryTileCache::parseName(f.filename().string(), x, y, z);
+
+    TileBytes bytes;
+    TileMeta meta;
+    if (!src.read(x, y, z, bytes)) {
+      std::cerr << "Skipping unreadable tile " << f << std::endl;
+      continue;
+    }
+    src.readMeta(x, y, z, meta);
+
+    dst.write(x, y, z, std::string(bytes.data, bytes.size), meta);
+    n++;
+
+    // Also drops the tile's blob once no other tile links to it, which is
+    // what actually frees the space
+    if (remove) src.remove(x, y, z);
+
+    if (n % 1000 == 0)
+      std::cout << "\r" << dir.filename().string() << ": " << n << "/" << files.size() << std::flush;
+  }
+
+  boost::system::error_code ec;
+  if (remove && fs::is_empty(dir/"blobs", ec)) fs::remove(dir/"blobs", ec);
+
+  std::cout << "\r" << dir.filename().string() << ": " << n << "/" << files.size()
+            << " tiles packed" << std::endl;
+  return n;
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  bool remove = false;
+  fs::path root;
+
+  for (int i=1; i<argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--remove") remove = true;
+    else root = arg;
+  }
+
+  if (root.empty() || !fs::is_directory(root)) {
+    std::cerr << "Usage: " << argv[0] << " [--remove] <cache dir>" << std::endl;
+    return 1;
+  }
+
+  try {
+    // a single service directory...
+    size_t n = convert(root, remove);
+
+    // ...or the mapscache root holding one directory per service
+    if (n == 0) {
+      for (fs::directory_iterator it(root), end; it != end; ++it)
+        if (fs::is_directory(it->path())) n += convert(it->path(), remove);
+    }
+
+    std::cout << "Converted " << n << " tiles" << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
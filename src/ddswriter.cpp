@@ -0,0 +1,265 @@
+#include "gzsatellite/ddswriter.h"
+
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+namespace gzsatellite {
+
+// 5:6:5 packing of an 8-bit colour, and its expansion back to 8 bits
+static inline uint16_t pack565(int r, int g, int b)
+{
+  return static_cast<uint16_t>(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+static inline void unpack565(uint16_t c, int rgb[3])
+{
+  const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+// ----------------------------------------------------------------------------
+
+/// Encode 16 RGB pixels (3 bytes each) into one 8 byte BC1 block
+static void encodeBlock(const uint8_t px[16*3], uint8_t out[8])
+{
+  // Bounding box of the block's colours, inset by 1/16 of its size to
+  // keep outliers from stretching the palette
+  int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+  for (int i=0; i<16; i++) {
+    for (int c=0; c<3; c++) {
+      lo[c] = std::min<int>(lo[c], px[i*3+c]);
+      hi[c] = std::max<int>(hi[c], px[i*3+c]);
+    }
+  }
+  for (int c=0; c<3; c++) {
+    const int inset = (hi[c] - lo[c]) >> 4;
+    lo[c] += inset;
+    hi[c] -= inset;
+  }
+
+  uint16_t c0 = pack565(hi[0], hi[1], hi[2]);
+  uint16_t c1 = pack565(lo[0], lo[1], lo[2]);
+
+  // c0 > c1 selects the 4-colour mode
+  if (c0 < c1) std::swap(c0, c1);
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    int palette[4][3];
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int c=0; c<3; c++) {
+      palette[2][c] = (2*palette[0][c] + palette[1][c])/3;
+      palette[3][c] = (palette[0][c] + 2*palette[1][c])/3;
+    }
+
+    for (int i=0; i<16; i++) {
+      int best = 0, best_dist = 1 << 30;
+      for (int k=0; k<4; k++) {
+        const int dr = px[i*3+0] - palette[k][0];
+        const int dg = px[i*3+1] - palette[k][1];
+        const int db = px[i*3+2] - palette[k][2];
+        const int dist = dr*dr + dg*dg + db*db;
+        if (dist < best_dist) { best_dist = dist; best = k; }
+      }
+      indices |= static_cast<uint32_t>(best) << (2*i);
+    }
+  }
+
+  // little-endian end points, then the indices
+  out[0] = c0 & 0xff; out[1] = c0 >> 8;
+  out[2] = c1 & 0xff; out[3] = c1 >> 8;
+  for (int i=0; i<4; i++) out[4+i] = (indices >> (8*i)) & 0xff;
+}
+
+// ----------------------------------------------------------------------------
+
+void encodeBC1(const cv::Mat& bgr, std::vector<uint8_t>& blocks, unsigned int threads)
+{
+  const int width = bgr.cols, height = bgr.rows;
+  const int bw = (width + 3)/4, bh = (height + 3)/4;
+  blocks.resize(static_cast<size_t>(bw)*bh*8);
+
+  // Each thread takes the next row of blocks until there are none left
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    uint8_t px[16*3];
+    for (int by = next++; by < bh; by = next++) {
+      for (int bx=0; bx<bw; bx++) {
+        for (int j=0; j<4; j++) {
+          const uint8_t* row = bgr.ptr<uint8_t>(std::min(by*4 + j, height - 1));
+          for (int i=0; i<4; i++) {
+            const uint8_t* p = row + 3*std::min(bx*4 + i, width - 1);
+            px[(j*4+i)*3+0] = p[2];
+            px[(j*4+i)*3+1] = p[1];
+            px[(j*4+i)*3+2] = p[0];
+          }
+        }
+        encodeBlock(px, &blocks[(static_cast<size_t>(by)*bw + bx)*8]);
+      }
+    }
+  };
+
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  const unsigned int n = std::min<unsigned int>(std::max(1u, threads), bh);
+
+  std::vector<std::thread> workers;
+  for (unsigned int i=1; i<n; i++) workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers) t.join();
+}
+
+// ----------------------------------------------------------------------------
+
+bool writeDDS(const boost::filesystem::path& path, const cv::Mat& bgr, unsigned int threads)
+{
+  if (bgr.empty() || bgr.type() != CV_8UC3) return false;
+
+  DDSWriter writer(path, bgr.cols, bgr.rows, threads);
+  return writer.write(bgr) && writer.finish();
+}
+
+// ----------------------------------------------------------------------------
+
+DDSWriter::DDSWriter(const boost::filesystem::path& path, int width, int height,
+                     unsigned int threads)
+  : out_(path.string(), std::ios::binary), threads_(threads), ok_(out_.good() && width > 0 && height > 0)
+{
+  if (!ok_) return;
+
+  // Mip levels down to 1x1, each half the size of the previous one
+  for (int w = width, h = height, i = 0; ; w = std::max(1, w/2), h = std::max(1, h/2), i++) {
+    Level level;
+    level.width = w;
+    level.height = h;
+    if (i > 0) {
+      level.tmp_path = path.string() + ".mip" + std::to_string(i);
+      level.tmp.reset(new std::ofstream(level.tmp_path.string(), std::ios::binary));
+    }
+    levels_.push_back(std::move(level));
+    if (w == 1 && h == 1) break;
+  }
+
+  // DDS_HEADER (see the DirectX documentation), as 31 dwords
+  uint32_t header[31] = {0};
+  header[0] = 124;                                // dwSize
+  header[1] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;
+                                                  // CAPS, HEIGHT, WIDTH, PIXELFORMAT,
+                                                  // MIPMAPCOUNT, LINEARSIZE
+  header[2] = height;                             // dwHeight
+  header[3] = width;                              // dwWidth
+  header[4] = ((width + 3)/4)*((height + 3)/4)*8; // dwPitchOrLinearSize
+  header[6] = levels_.size();                     // dwMipMapCount
+  header[18] = 32;                                // ddspf.dwSize
+  header[19] = 0x4;                               // ddspf.dwFlags: FOURCC
+  header[20] = 0x31545844;                        // ddspf.dwFourCC: "DXT1"
+  header[26] = 0x1000 | 0x8 | 0x400000;           // dwCaps: TEXTURE, COMPLEX, MIPMAP
+
+  out_.write("DDS ", 4);
+  out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+}
+
+// ----------------------------------------------------------------------------
+
+DDSWriter::~DDSWriter()
+{
+  for (auto& level : levels_) {
+    level.tmp.reset();
+    if (!level.tmp_path.empty()) {
+      boost::system::error_code ec;
+      boost::filesystem::remove(level.tmp_path, ec);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+bool DDSWriter::write(const cv::Mat& rows)
+{
+  if (!ok_ || rows.type() != CV_8UC3 || rows.cols != levels_[0].width) return ok_ = false;
+
+  add(0, rows);
+  return ok_;
+}
+
+// ----------------------------------------------------------------------------
+
+bool DDSWriter::finish()
+{
+  if (!ok_) return false;
+
+  // The levels follow each other, largest first
+  for (auto& level : levels_) {
+    if (level.rows != level.height) return false;
+    if (!level.tmp) continue;
+
+    level.tmp->close();
+    std::ifstream in(level.tmp_path.string(), std::ios::binary);
+    out_ << in.rdbuf();
+  }
+
+  out_.close();
+  return out_.good();
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void DDSWriter::add(size_t i, const cv::Mat& input)
+{
+  Level& level = levels_[i];
+
+  // Rows beyond the level's height (the odd last row halving drops) are
+  // not part of it
+  const cv::Mat rows = input.rowRange(0, std::min(input.rows, level.height - level.rows));
+  if (rows.rows == 0) return;
+  level.rows += rows.rows;
+
+  // Encode whole rows of blocks; encodeBC1 pads the last one
+  cv::Mat all;
+  if (level.unencoded.empty()) all = rows;
+  else cv::vconcat(level.unencoded, rows, all);
+
+  const int n = (level.rows == level.height) ? all.rows : (all.rows/4)*4;
+  if (n > 0) {
+    std::vector<uint8_t> blocks;
+    encodeBC1(all.rowRange(0, n), blocks, threads_);
+    std::ostream& out = level.tmp ? *level.tmp : out_;
+    out.write(reinterpret_cast<const char*>(blocks.data()), blocks.size());
+    ok_ = ok_ && out.good();
+  }
+  level.unencoded = (n < all.rows) ? all.rowRange(n, all.rows).clone() : cv::Mat();
+
+  if (i + 1 == levels_.size()) return;
+
+  // Halve pairs of rows for the next level (a single row only gets
+  // narrower)
+  const Level& next = levels_[i+1];
+  if (level.height == 1) {
+    cv::Mat half;
+    cv::resize(rows, half, cv::Size(next.width, 1), 0, 0, cv::INTER_AREA);
+    add(i + 1, half);
+    return;
+  }
+
+  cv::Mat pairs;
+  if (level.unpaired.empty()) pairs = rows;
+  else cv::vconcat(level.unpaired, rows, pairs);
+
+  const int m = (pairs.rows/2)*2;
+  if (m > 0) {
+    cv::Mat half;
+    cv::resize(pairs.rowRange(0, m), half, cv::Size(next.width, m/2), 0, 0, cv::INTER_AREA);
+    add(i + 1, half);
+  }
+  level.unpaired = (m < pairs.rows) ? pairs.rowRange(m, pairs.rows).clone() : cv::Mat();
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,133 @@
+#include "gzsatellite/geoconverter.h"
+
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "gzsatellite/tileloader.h"
+
+namespace gzsatellite {
+
+// Points converted on the calling thread, below which threads cost more
+// than they save
+static const size_t MIN_POINTS_PER_THREAD = 1 << 15;
+
+// Web mercator doesn't reach the poles
+static const double MAX_LATITUDE = 85.0511;
+
+// ----------------------------------------------------------------------------
+
+GeoConverter::GeoConverter(double origin_x, double origin_y, unsigned int zoom,
+                           double tile_width, double tile_height)
+  : origin_x_(origin_x), origin_y_(origin_y), zoom_(zoom),
+    tile_width_(tile_width), tile_height_(tile_height)
+{
+  if (zoom > 31)
+    throw std::invalid_argument("Zoom level " + std::to_string(zoom) + " too high");
+}
+
+// ----------------------------------------------------------------------------
+
+void GeoConverter::convert(Frame from, Frame to, const double* x, const double* y, size_t n,
+                           double* out_x, double* out_y) const
+{
+  const size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                          n/MIN_POINTS_PER_THREAD);
+  if (threads <= 1) {
+    convertBlock(from, to, x, y, n, out_x, out_y);
+    return;
+  }
+
+  // Contiguous blocks, so that each thread streams through its own memory
+  const size_t block = (n + threads - 1)/threads;
+  std::vector<std::thread> pool;
+  for (size_t i = block; i < n; i += block) {
+    const size_t m = std::min(block, n - i);
+    pool.emplace_back([=]() { convertBlock(from, to, x + i, y + i, m, out_x + i, out_y + i); });
+  }
+  convertBlock(from, to, x, y, std::min(block, n), out_x, out_y);
+  for (auto& t : pool) t.join();
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void GeoConverter::convertBlock(Frame from, Frame to, const double* x, const double* y,
+                                size_t n, double* out_x, double* out_y) const
+{
+  const double tiles = static_cast<double>(1u << zoom_);
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const double px = TileLoader::imageSize();
+
+  //
+  // To tile coordinates. Every loop reads its inputs before writing, so
+  // converting in place works.
+  //
+
+  switch (from) {
+    case Frame::LATLON:
+      // see TileLoader::latLonToTileCoords
+      for (size_t i=0; i<n; i++) {
+        const double lon = x[i], lat = y[i];
+        const bool valid = std::abs(lat) <= MAX_LATITUDE && std::abs(lon) <= 180;
+        const double tx = tiles*(lon + 180)/360;
+        const double ty = tiles*(0.5 - std::log(std::tan(M_PI/4 + lat*M_PI/360))/(2*M_PI));
+        out_x[i] = valid ? tx : nan;
+        out_y[i] = valid ? ty : nan;
+      }
+      break;
+    case Frame::TILE:
+      if (out_x != x) std::copy(x, x + n, out_x);
+      if (out_y != y) std::copy(y, y + n, out_y);
+      break;
+    case Frame::PIXEL:
+      for (size_t i=0; i<n; i++) {
+        out_x[i] = x[i]/px;
+        out_y[i] = y[i]/px;
+      }
+      break;
+    case Frame::LOCAL:
+      for (size_t i=0; i<n; i++) {
+        out_x[i] = origin_x_ + x[i]/tile_width_;
+        out_y[i] = origin_y_ - y[i]/tile_height_;
+      }
+      break;
+  }
+
+  //
+  // ...and on to the requested frame
+  //
+
+  switch (to) {
+    case Frame::LATLON:
+      // see TileLoader::tileCoordsToLatLon
+      for (size_t i=0; i<n; i++) {
+        const double lon = out_x[i]/tiles*360 - 180;
+        const double lat = std::atan(std::sinh(M_PI*(1 - 2*out_y[i]/tiles)))*180/M_PI;
+        out_x[i] = lon;
+        out_y[i] = lat;
+      }
+      break;
+    case Frame::TILE:
+      break;
+    case Frame::PIXEL:
+      for (size_t i=0; i<n; i++) {
+        out_x[i] *= px;
+        out_y[i] *= px;
+      }
+      break;
+    case Frame::LOCAL:
+      for (size_t i=0; i<n; i++) {
+        out_x[i] = (out_x[i] - origin_x_)*tile_width_;
+        out_y[i] = (origin_y_ - out_y[i])*tile_height_;
+      }
+      break;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+}
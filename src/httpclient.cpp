@@ -0,0 +1,323 @@
+#include "gzsatellite/httpclient.h"
+
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+namespace gzsatellite {
+
+// Seconds to wait for a connection to be made
+static const long CONNECT_TIMEOUT = 10;
+
+// A transfer slower than this many bytes/s for this many seconds has
+// stalled; it fails (and is retried as any transient failure)
+static const long LOW_SPEED_LIMIT = 1024;
+static const long LOW_SPEED_TIME = 15;
+
+constexpr size_t HttpClient::LATENCY_BUCKETS;
+
+HttpClient::HttpClient(unsigned int max_host_connections)
+  : stop_(false)
+{
+  // libcurl global state must be initialized once, before any threads use it
+  static std::once_flag curl_init;
+  std::call_once(curl_init, [](){ curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+  multi_ = curl_multi_init();
+
+  // Let concurrent requests to the same host share one HTTP/2 connection
+  curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                                          static_cast<long>(max_host_connections));
+
+  thread_ = std::thread(&HttpClient::run, this);
+}
+
+// ----------------------------------------------------------------------------
+
+HttpClient::~HttpClient()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  curl_multi_wakeup(multi_);
+  thread_.join();
+
+  curl_multi_cleanup(multi_);
+}
+
+// ----------------------------------------------------------------------------
+
+HttpResponse HttpClient::get(const std::string& url,
+                             const std::vector<std::string>& headers,
+                             const std::atomic<bool>* stop,
+                             const std::string& limit)
+{
+  Request req;
+  req.url = url;
+  req.headers = headers;
+  req.header_list = nullptr;
+  req.stop = stop;
+  std::future<HttpResponse> result = req.promise.get_future();
+
+  // Wait for the host's rate limit before the request is started, a bit at
+  // a time so as not to hold up a stop
+  const auto start = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(reserve(limit));
+  while (!(stop && *stop) && std::chrono::steady_clock::now() < start)
+    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                                  start - std::chrono::steady_clock::now(),
+                                  std::chrono::milliseconds(100)));
+
+  if (stop && *stop) {
+    req.response.url = url;
+    req.response.error = "Stopped";
+    return req.response;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(&req);
+  }
+  curl_multi_wakeup(multi_);
+
+  // the I/O thread fulfills the promise once the transfer is done
+  return result.get();
+}
+
+// ----------------------------------------------------------------------------
+
+void HttpClient::setRateLimit(const std::string& limit, double rate, double burst)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = buckets_.find(limit);
+  if (it == buckets_.end())
+    it = buckets_.insert(std::make_pair(limit, Bucket{0, 0, std::max(1.0, burst),
+                                                      std::chrono::steady_clock::now()})).first;
+
+  it->second.rate = std::max(0.0, rate);
+  it->second.burst = std::max(1.0, burst);
+}
+
+// ----------------------------------------------------------------------------
+
+double HttpClient::latencyBound(size_t bucket)
+{
+  static const double bounds[LATENCY_BUCKETS] = {10, 25, 50, 100, 250, 500, 1000,
+                                                 std::numeric_limits<double>::infinity()};
+  return bounds[std::min(bucket, LATENCY_BUCKETS - 1)];
+}
+
+// ----------------------------------------------------------------------------
+
+HttpClient::Stats HttpClient::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void HttpClient::run()
+{
+  int running = 0;
+
+  while (true) {
+    // pick up newly submitted requests
+    std::deque<Request*> submitted;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) break;
+      submitted.swap(queue_);
+    }
+    for (auto req : submitted) start(req);
+
+    curl_multi_perform(multi_, &running);
+
+    // hand finished transfers back to their callers
+    CURLMsg* msg;
+    int left;
+    while ((msg = curl_multi_info_read(multi_, &left)))
+      if (msg->msg == CURLMSG_DONE) finish(msg->easy_handle, msg->data.result);
+
+    // ...and give up on those whose callers stopped waiting
+    std::vector<CURL*> stopped;
+    for (CURL* easy : active_) {
+      Request* req = nullptr;
+      curl_easy_getinfo(easy, CURLINFO_PRIVATE, &req);
+      if (req->stop && *req->stop) stopped.push_back(easy);
+    }
+    for (CURL* easy : stopped) finish(easy, CURLE_ABORTED_BY_CALLBACK);
+
+    // sleep until there is socket activity or a new request (see get())
+    curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+  }
+
+  // Fail anything still in flight so that no caller blocks forever
+  while (!active_.empty())
+    finish(*active_.begin(), CURLE_ABORTED_BY_CALLBACK);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto req : queue_) {
+    req->response.url = req->url;
+    req->response.error = "HttpClient shut down";
+    req->promise.set_value(req->response);
+  }
+  queue_.clear();
+}
+
+// ----------------------------------------------------------------------------
+
+std::chrono::duration<double> HttpClient::reserve(const std::string& limit)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = buckets_.find(limit);
+  if (it == buckets_.end() || it->second.rate <= 0) return std::chrono::duration<double>(0);
+
+  // Refill at rate tokens per second, up to a full bucket
+  const auto now = std::chrono::steady_clock::now();
+  Bucket& b = it->second;
+  b.tokens = std::min(b.burst, b.tokens + b.rate*std::chrono::duration<double>(now - b.last).count());
+  b.last = now;
+
+  b.tokens -= 1;
+  if (b.tokens >= 0) return std::chrono::duration<double>(0);
+
+  stats_.delayed++;
+  return std::chrono::duration<double>(-b.tokens/b.rate);
+}
+
+// ----------------------------------------------------------------------------
+
+void HttpClient::start(Request* req)
+{
+  CURL* easy = curl_easy_init();
+
+  req->errbuf[0] = '\0';
+  req->response.url = req->url;
+
+  curl_easy_setopt(easy, CURLOPT_URL, req->url.c_str());
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, req);
+  curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, req->errbuf);
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &HttpClient::write);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, &req->response.body);
+  curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, &HttpClient::header);
+  curl_easy_setopt(easy, CURLOPT_HEADERDATA, &req->response.headers);
+  curl_easy_setopt(easy, CURLOPT_USERAGENT, "gzsatellite");
+  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, LOW_SPEED_LIMIT);
+  curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, LOW_SPEED_TIME);
+
+  // Connections are reused between tiles from the multi handle's
+  // connection cache; TCP keepalive probes find the ones that died while
+  // idle. Negotiate HTTP/2 over TLS. PIPEWAIT prefers waiting for a
+  // connection that can multiplex over opening a new one. Plain http://
+  // never multiplexes, and waiting there would send one request at a time
+  // whenever the server closes connections.
+  curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  if (req->url.compare(0, 8, "https://") == 0)
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+
+  for (const auto& h : req->headers)
+    req->header_list = curl_slist_append(req->header_list, h.c_str());
+  if (req->header_list) curl_easy_setopt(easy, CURLOPT_HTTPHEADER, req->header_list);
+
+  curl_multi_add_handle(multi_, easy);
+  active_.insert(easy);
+}
+
+// ----------------------------------------------------------------------------
+
+void HttpClient::finish(CURL* easy, CURLcode result)
+{
+  Request* req = nullptr;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, &req);
+
+  long connects = 0, version = 0;
+  double seconds = 0;
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &req->response.status_code);
+  curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &seconds);
+  curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+  curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &version);
+
+  if (result != CURLE_OK) {
+    req->response.status_code = 0;
+    req->response.error = (req->errbuf[0] != '\0') ? req->errbuf
+                                                   : curl_easy_strerror(result);
+  }
+
+  // file:// URLs (e.g., local stand-ins for a tile server) have no status.
+  // Report them like HTTP, so that a missing file isn't retried.
+  if (result == CURLE_OK && req->response.status_code == 0)
+    req->response.status_code = 200;
+  else if (result == CURLE_FILE_COULDNT_READ_FILE)
+    req->response.status_code = 404;
+
+  curl_multi_remove_handle(multi_, easy);
+  curl_easy_cleanup(easy);
+  curl_slist_free_all(req->header_list);
+  active_.erase(easy);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.requests++;
+    if (connects > 0) stats_.handshakes++;
+    else stats_.reused++;
+    if (version == CURL_HTTP_VERSION_2_0) stats_.http2++;
+    stats_.bytes += req->response.body.size();
+
+    size_t bucket = 0;
+    while (seconds*1000 >= latencyBound(bucket) && bucket + 1 < LATENCY_BUCKETS) bucket++;
+    stats_.latency += seconds;
+    stats_.latency_histogram[bucket]++;
+  }
+
+  req->promise.set_value(std::move(req->response));
+}
+
+// ----------------------------------------------------------------------------
+
+size_t HttpClient::write(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  std::string* body = static_cast<std::string*>(userdata);
+  body->append(ptr, size*nmemb);
+  return size*nmemb;
+}
+
+// ----------------------------------------------------------------------------
+
+size_t HttpClient::header(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  auto headers = static_cast<std::map<std::string, std::string>*>(userdata);
+  const std::string line(ptr, size*nmemb);
+
+  // A status line starts a new response (e.g., after a redirect)
+  if (line.compare(0, 5, "HTTP/") == 0) {
+    headers->clear();
+    return size*nmemb;
+  }
+
+  const size_t colon = line.find(':');
+  if (colon == std::string::npos) return size*nmemb;
+
+  std::string name = line.substr(0, colon);
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+  // trim surrounding whitespace (including the trailing CRLF) from the value
+  const size_t first = line.find_first_not_of(" \t", colon + 1);
+  const size_t last = line.find_last_not_of(" \t\r\n");
+  (*headers)[name] = (first == std::string::npos || last < first) ? ""
+                                          : line.substr(first, last - first + 1);
+  return size*nmemb;
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,248 @@
+#include "gzsatellite/jpegwriter.h"
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+namespace gzsatellite {
+
+// Colour is subsampled 2x2 (4:2:0), making MCUs 16x16 pixels. OpenCV only
+// lets us ask for it since 4.5.5; before that it is libjpeg's default.
+// Either way, parseJPEG checks that the strips were encoded like that.
+static const int MCU_SIZE = 16;
+
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || \
+    (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 5)))
+#define HAVE_JPEG_SAMPLING_FACTOR
+#endif
+
+// ----------------------------------------------------------------------------
+
+static int numThreads(unsigned int threads)
+{
+  return std::max(1u, threads > 0 ? threads : std::thread::hardware_concurrency());
+}
+
+// ----------------------------------------------------------------------------
+
+/// Encoder parameters for strips restarting every rst_interval MCUs
+static std::vector<int> encodeParams(int quality, int rst_interval)
+{
+  std::vector<int> params;
+  params.push_back(cv::IMWRITE_JPEG_QUALITY);
+  params.push_back(quality);
+  params.push_back(cv::IMWRITE_JPEG_RST_INTERVAL);
+  params.push_back(rst_interval);
+#ifdef HAVE_JPEG_SAMPLING_FACTOR
+  params.push_back(cv::IMWRITE_JPEG_SAMPLING_FACTOR);
+  params.push_back(cv::IMWRITE_JPEG_SAMPLING_FACTOR_420);
+#endif
+  return params;
+}
+
+// ----------------------------------------------------------------------------
+
+/// Locate the frame header and the entropy-coded scan of a baseline JPEG.
+/// tables receives the segments its scan depends on (frame header, with
+/// the height left out, quantization and Huffman tables, restart interval
+/// and scan header), which must be the same for scans to be joined.
+static bool parseJPEG(const std::vector<uint8_t>& jpg, size_t& sof,
+                      size_t& scan_begin, size_t& scan_end, std::vector<uint8_t>& tables)
+{
+  if (jpg.size() < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8) return false;
+
+  bool restarts = false;
+  sof = scan_begin = 0;
+  tables.clear();
+  size_t pos = 2;
+  while (pos + 4 <= jpg.size()) {
+    if (jpg[pos] != 0xFF) return false;
+
+    const uint8_t marker = jpg[pos+1];
+    const size_t len = (jpg[pos+2] << 8) | jpg[pos+3];
+    if (pos + 2 + len > jpg.size()) return false;
+
+    // Only single-scan baseline/extended sequential frames can be joined
+    if (marker == 0xC0 || marker == 0xC1) sof = pos;
+    else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+      return false;
+
+    if (marker == 0xDD) restarts = true;
+
+    if (marker == 0xC0 || marker == 0xC1 || marker == 0xC4 || marker == 0xDB ||
+        marker == 0xDD || marker == 0xDA) {
+      const size_t at = tables.size();
+      tables.insert(tables.end(), jpg.begin() + pos, jpg.begin() + pos + 2 + len);
+      if (pos == sof && len >= 5) tables[at+5] = tables[at+6] = 0;
+    }
+
+    if (marker == 0xDA) {
+      scan_begin = pos + 2 + len;
+      break;
+    }
+    pos += 2 + len;
+  }
+
+  // Strips are cut at MCU_SIZE rows: the frame must be YCbCr with only
+  // the colour subsampled 2x2
+  if (sof == 0 || (jpg[sof+2] << 8 | jpg[sof+3]) < 17 || jpg[sof+9] != 3 ||
+      jpg[sof+11] != 0x22 || jpg[sof+14] != 0x11 || jpg[sof+17] != 0x11) return false;
+
+  // The scan runs up to the EOI marker at the very end
+  const size_t n = jpg.size();
+  if (!restarts || scan_begin == 0 || n < 2 ||
+      jpg[n-2] != 0xFF || jpg[n-1] != 0xD9) return false;
+
+  scan_end = n - 2;
+  return scan_begin < scan_end;
+}
+
+// ----------------------------------------------------------------------------
+
+bool writeJPEG(const boost::filesystem::path& path, const cv::Mat& bgr, int quality,
+               unsigned int threads)
+{
+  std::vector<int> params;
+  params.push_back(cv::IMWRITE_JPEG_QUALITY);
+  params.push_back(quality);
+
+  // Too small to be worth splitting (see JPEGWriter::encode)
+  const int nthreads = numThreads(threads);
+  if (nthreads < 2 || bgr.rows <= 4*MCU_SIZE || bgr.rows > 0xFFFF || bgr.cols > 0xFFFF)
+    return cv::imwrite(path.string(), bgr, params);
+
+  {
+    JPEGWriter writer(path, bgr.cols, bgr.rows, quality, threads);
+    if (writer.write(bgr)) return writer.finish();
+  }
+
+  return cv::imwrite(path.string(), bgr, params);
+}
+
+// ----------------------------------------------------------------------------
+
+JPEGWriter::JPEGWriter(const boost::filesystem::path& path, int width, int height, int quality,
+                       unsigned int threads)
+  : out_(path.string(), std::ios::binary), width_(width), height_(height),
+    params_(encodeParams(quality, (width + MCU_SIZE - 1)/MCU_SIZE)),   // restart every MCU row
+    threads_(numThreads(threads)), rows_(0), rst_(0), ok_(out_.good() && width <= 0xFFFF && height <= 0xFFFF)
+{
+}
+
+// ----------------------------------------------------------------------------
+
+bool JPEGWriter::streamable(int width, int height)
+{
+  // Try the encoder once on a small image
+  static const bool restarts = []() {
+    const cv::Mat img(4*MCU_SIZE, 4*MCU_SIZE, CV_8UC3, cv::Scalar::all(128));
+    std::vector<uint8_t> jpg, tables;
+    size_t sof, begin, end;
+    return cv::imencode(".jpg", img, jpg, encodeParams(95, 1)) &&
+           parseJPEG(jpg, sof, begin, end, tables);
+  }();
+
+  return restarts && width <= 0xFFFF && height <= 0xFFFF;
+}
+
+// ----------------------------------------------------------------------------
+
+bool JPEGWriter::write(const cv::Mat& rows)
+{
+  if (!ok_) return false;
+
+  cv::Mat all;
+  if (pending_.empty()) all = rows;
+  else cv::vconcat(pending_, rows, all);
+
+  // Whole MCU rows only, except for the very last rows of the image
+  const bool last = (rows_ + all.rows >= height_);
+  const int n = last ? all.rows : (all.rows/MCU_SIZE)*MCU_SIZE;
+  if (n > 0 && !encode(all.rowRange(0, n))) return false;
+
+  pending_ = (n < all.rows) ? all.rowRange(n, all.rows).clone() : cv::Mat();
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool JPEGWriter::finish()
+{
+  if (!ok_ || rows_ != height_ || !pending_.empty()) return false;
+
+  out_.put(static_cast<char>(0xFF));
+  out_.put(static_cast<char>(0xD9));
+  out_.close();
+  return out_.good();
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+bool JPEGWriter::encode(const cv::Mat& rows)
+{
+  // About one strip per thread, each a whole number of MCU rows
+  const int nthreads = threads_;
+  const int mcu_rows = (rows.rows + MCU_SIZE - 1)/MCU_SIZE;
+  const int strip_rows = std::max(4, (mcu_rows + nthreads - 1)/nthreads)*MCU_SIZE;
+  const int nstrips = (rows.rows + strip_rows - 1)/strip_rows;
+
+  std::vector<std::vector<uint8_t>> strips(nstrips);
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int s = next++; s < nstrips; s = next++) {
+      const cv::Mat strip = rows.rowRange(s*strip_rows, std::min(rows.rows, (s+1)*strip_rows));
+      cv::imencode(".jpg", strip, strips[s], params_);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i=1; i<std::min(nthreads, nstrips); i++) threads.emplace_back(worker);
+  worker();
+  for (auto& t : threads) t.join();
+
+  //
+  // Append the strips' scans, under the first strip's headers. Every strip
+  // must have been encoded with the same tables as the first one, or its
+  // scan would decode as garbage.
+  //
+
+  std::vector<uint8_t> out, tables;
+  for (int s=0; s<nstrips; s++) {
+    size_t sof, begin, end;
+    if (!parseJPEG(strips[s], sof, begin, end, tables) ||
+        (!tables_.empty() && tables != tables_)) {
+      ok_ = false;
+      return false;
+    }
+    if (tables_.empty()) tables_ = tables;
+
+    const std::vector<uint8_t>& jpg = strips[s];
+    if (rows_ == 0 && s == 0) {
+      out.assign(jpg.begin(), jpg.begin() + begin);
+      out[sof+5] = (height_ >> 8) & 0xFF;
+      out[sof+6] = height_ & 0xFF;
+    } else {
+      // Restart markers cycle through RST0-RST7 across the whole image
+      out.push_back(0xFF);
+      out.push_back(0xD0 + (rst_++ & 7));
+    }
+
+    for (size_t i=begin; i<end; i++) {
+      out.push_back(jpg[i]);
+      if (jpg[i] == 0xFF && i+1 < end) {
+        const uint8_t m = jpg[++i];
+        out.push_back((m >= 0xD0 && m <= 0xD7) ? 0xD0 + (rst_++ & 7) : m);
+      }
+    }
+  }
+
+  rows_ += rows.rows;
+  out_.write(reinterpret_cast<const char*>(out.data()), out.size());
+  return out_.good();
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -4,6 +4,15 @@ namespace fs = boost::filesystem;
 
 namespace gzsatellite {
 
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(const Clock::time_point& since)
+{
+  return std::chrono::duration<double>(Clock::now() - since).count();
+}
+
+// ----------------------------------------------------------------------------
+
 ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
   geo_params_(params)
 {
@@ -15,6 +24,43 @@ ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
   loader_.reset(new TileLoader(root+"/mapscache", params.tileserver,
                                 params.lat, params.lon, params.zoom,
                                 params.width, params.height));
+  loader_->setConcurrency(params.concurrency);
+  loader_->setRefreshAge(params.refresh_age);
+  loader_->setRateLimit(params.rate_limit);
+  loader_->setRetries(params.max_retries);
+  loader_->setCacheBackend(TileCache::backendFromString(params.cache_backend));
+
+  // Keep tiles and stitched textures within the cache budget
+  if (params.cache_budget_mb > 0) {
+    cache_manager_ = std::make_shared<CacheManager>(root,
+                        static_cast<uint64_t>(params.cache_budget_mb*1024*1024));
+    loader_->setCacheManager(cache_manager_);
+  }
+
+  init(root);
+}
+
+// ----------------------------------------------------------------------------
+
+ModelCreator::ModelCreator(const GeoParams& params, const std::string& root,
+                           std::unique_ptr<TileLoader> loader,
+                           const std::shared_ptr<CacheManager>& cache_manager,
+                           std::unique_ptr<TileLoader> elevation_loader) :
+  loader_(std::move(loader)), geo_params_(params), cache_manager_(cache_manager),
+  elevation_loader_(std::move(elevation_loader))
+{
+  init(root);
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::init(const std::string& root)
+{
+  profiler_ = std::make_shared<Profiler>();
+
+  const std::string& format = geo_params_.texture_format;
+  if (format != "jpg" && format != "png" && format != "webp" && format != "dds")
+    throw std::invalid_argument("Unknown texture format '" + geo_params_.texture_format + "'");
 
   //
   // Setup proper directory structure
@@ -31,11 +77,59 @@ ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
   fs::create_directories(textures_dir_);
 
   //
-  // Use the unique tileloader hash as the world image name
+  // The world image only depends on the tiles it covers, so it is named
+  // after their range (which lets other worlds find and reuse it)
   //
 
-  world_img_path_ = textures_dir_/(loader_->hash()+".jpg");
-  world_scr_path_ = scripts_dir_/(loader_->hash()+".material");
+  world_img_path_ = textures_dir_/(mosaicName()+"."+textureExtension());
+  world_scr_path_ = scripts_dir_/(mosaicName()+".material");
+
+  // Split the world image into chunks, each with its own texture
+  createChunks();
+
+  //
+  // Terrain meshes, one for collisions and one under each chunk
+  //
+
+  if (!geo_params_.elevation_server.empty()) {
+    meshes_dir_ = fs::absolute(root+"/meshes");
+    fs::create_directories(meshes_dir_);
+
+    if (!elevation_loader_) {
+      elevation_loader_.reset(new TileLoader(root+"/mapscache", geo_params_.elevation_server,
+                                             geo_params_.lat, geo_params_.lon,
+                                             geo_params_.elevation_zoom, 0, 0));
+      elevation_loader_->setConcurrency(loader_->concurrency());
+      elevation_loader_->setRefreshAge(loader_->refreshAge());
+      elevation_loader_->setRateLimit(loader_->rateLimit());
+      elevation_loader_->setRetries(loader_->retries());
+      elevation_loader_->setCacheBackend(TileCache::backendFromString(geo_params_.cache_backend));
+
+      // The cache manager must know the elevation cache before it is first
+      // used, or it would open the cache a second time
+      if (cache_manager_) {
+        cache_manager_->attach(elevation_loader_->serviceHash(), elevation_loader_->tileCache());
+        elevation_loader_->setCacheManager(cache_manager_);
+      }
+    }
+
+    // The meshes depend on where the world is (which also sets its
+    // datum) and on the elevation tiles
+    std::ostringstream os;
+    os << loader_->hash() << geo_params_.shift_x << geo_params_.shift_y
+       << elevation_loader_->serviceHash() << geo_params_.elevation_zoom
+       << geo_params_.terrain_error << geo_params_.datum;
+    const std::string name = std::to_string(std::hash<std::string>()(os.str()));
+
+    collision_mesh_path_ = meshes_dir_/(name+".dae");
+    incomplete_path_ = meshes_dir_/(name+".incomplete");
+    if (chunks_.size() == 1) {
+      chunks_[0].mesh_path = collision_mesh_path_;
+    } else {
+      for (size_t i=0; i<chunks_.size(); i++)
+        chunks_[i].mesh_path = meshes_dir_/(name+"_"+std::to_string(i)+".dae");
+    }
+  }
 
 
   /*
@@ -50,6 +144,8 @@ ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
           (generated scripts, one per stitched world)
         textures
           (generated world, stitched from tiles)
+      meshes
+        (terrain meshes, if there is an elevation server)
   */
 }
 
@@ -57,26 +153,87 @@ ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
 
 sdf::SDFPtr ModelCreator::createModel(const std::string& name, unsigned int quality)
 {
+  Profiler::Scope scope(profiler_.get(), "createModel");
+
   // set model properties
   model_name_ = name;
   jpg_quality_ = quality;
 
-  if (!fs::exists(world_img_path_))
+  // When refreshing, revalidate the cached tiles first. The world image only
+  // needs to be stitched again if one of them actually changed.
+  bool stale = needsWorldImage();
+  if (geo_params_.refresh_age >= 0) {
+    downloadTiles();
+    stale |= loader_->loadStats().downloaded > 0;
+  }
+
+  if (stale)
     createWorldImage();
+  else if (geo_params_.refresh_age < 0)
+    loader_->touchTiles();
+
+  // If necessary, create the OGRE scripts associated with this world
+  {
+    Profiler::Scope scope(profiler_.get(), "scripts");
+    for (const auto& chunk : chunks_)
+      if (!fs::exists(chunk.scr_path))
+        createWorldScript(chunk);
+  }
 
-  // Now that the world image is created, we don't need to download any tiles,
-  // but we do need the geographical information associated with each.
-  if (tiles_.size() == 0)
-    loader_->loadTiles(false);
+  // ...and the terrain. Without any elevation tiles, the ground stays flat.
+  if (elevation_loader_) {
+    Profiler::Scope scope(profiler_.get(), "terrain");
+    if (needsTerrain() && loadElevation()) {
+      const cv::Rect& world = chunks_.back().rect;
+      createTerrainMesh(cv::Rect(0, 0, world.x + world.width, world.y + world.height),
+                        collision_mesh_path_);
+      for (const auto& chunk : chunks_)
+        if (chunk.mesh_path != collision_mesh_path_)
+          createTerrainMesh(chunk.rect, chunk.mesh_path);
+      elevation_.release();
+
+      boost::system::error_code ec;
+      if (elevation_complete_)
+        fs::remove(incomplete_path_, ec);
+      else
+        std::ofstream(incomplete_path_.string());
+    }
+
+    if (!fs::exists(collision_mesh_path_)) {
+      gzwarn << "No elevation data; the ground is flat" << std::endl;
+      collision_mesh_path_.clear();
+      for (auto& chunk : chunks_)
+        chunk.mesh_path.clear();
+    }
+  }
 
-  // If necessary, create the OGRE script associated with this world
-  if (!fs::exists(world_scr_path_))
-    createWorldScript();
+  if (loader_->stopped())
+    throw std::runtime_error("Stopped creating '" + name + "'");
+
+  // Make room for this world by evicting whatever was used longest ago.
+  // Its tiles are done with; only its textures stay in use.
+  loader_->releaseTiles();
+  if (elevation_loader_) elevation_loader_->releaseTiles();
+  if (cache_manager_) {
+    for (const auto& chunk : chunks_)
+      cache_manager_->touchTexture(chunk.img_path, chunk.scr_path, !stale);
+    cache_manager_->evict();
+
+    CacheManager::Stats s = cache_manager_->stats();
+    gzmsg << "Cache: " << s.bytes/(1024*1024) << "/" << s.budget/(1024*1024) << " MB, "
+          << s.tile_hits << " tile hits, " << s.tile_misses << " misses, "
+          << s.evictions << " evictions (" << s.evicted_bytes/(1024*1024) << " MB)"
+          << std::endl;
+    if (s.bytes > s.budget)
+      gzwarn << "The tiles of this world alone exceed the cache budget" << std::endl;
+  }
 
   //
   // SDF Creation
   //
 
+  Profiler::Scope sdf_scope(profiler_.get(), "sdf");
+
   // Create a new, empty SDF model with a single link
   sdf::SDFPtr modelSDF(new sdf::SDF);
   sdf::init(modelSDF);
@@ -93,42 +250,202 @@ sdf::SDFPtr ModelCreator::createModel(const std::string& name, unsigned int qual
   double ypos = geo_params_.shift_y*geo_params_.height;
 
   sdf::ElementPtr collisionElem = createCollision(xpos, ypos);
-  sdf::ElementPtr visualElem    = createVisual(xpos, ypos);
-
   base_link->InsertElement(collisionElem);
-  base_link->InsertElement(visualElem);
+
+  // One visual per chunk, all in the same static model
+  for (const auto& chunk : chunks_) {
+    sdf::ElementPtr visualElem = createVisual(xpos, ypos, chunk);
+    base_link->InsertElement(visualElem);
+  }
 
   return modelSDF;
 }
 
 // ----------------------------------------------------------------------------
 
-void ModelCreator::getOriginLatLon(double& lat, double& lon)
+bool ModelCreator::needsWorldImage() const
 {
-  // Convert percentage shift from center to meters from center
-  double xpos = geo_params_.shift_x*geo_params_.width;
-  double ypos = geo_params_.shift_y*geo_params_.height;
+  for (const auto& chunk : chunks_)
+    if (!fs::exists(chunk.img_path)) return true;
+  return false;
+}
 
-  // Size of square the tile in meters
-  double tileSize = loader_->resolution()*loader_->imageSize();
+// ----------------------------------------------------------------------------
+
+bool ModelCreator::needsTerrain() const
+{
+  if (!elevation_loader_) return false;
+
+  // Meshes made while elevation tiles were missing are made again, in
+  // case the tiles can be loaded now
+  bool missing = !fs::exists(collision_mesh_path_) || fs::exists(incomplete_path_);
+  for (const auto& chunk : chunks_)
+    missing |= !fs::exists(chunk.mesh_path);
+  return missing;
+}
 
-  double x = loader_->centerTileX() + (xpos/tileSize);
-  double y = loader_->centerTileY() + (ypos/tileSize);
+// ----------------------------------------------------------------------------
 
-  x += loader_->originOffsetX();
-  y += loader_->originOffsetY();
+void ModelCreator::getOriginLatLon(double& lat, double& lon) const
+{
+  double x, y;
+  originTileCoords(x, y);
 
   loader_->tileCoordsToLatLon(x, y, geo_params_.zoom, lat, lon);
 }
 
+// ----------------------------------------------------------------------------
+
+std::vector<fs::path> ModelCreator::textures() const
+{
+  std::vector<fs::path> textures;
+  for (const auto& chunk : chunks_)
+    textures.push_back(chunk.img_path);
+  return textures;
+}
+
+// ----------------------------------------------------------------------------
+
+GeoConverter ModelCreator::geoConverter() const
+{
+  double x, y;
+  originTileCoords(x, y);
+
+  // The tiles are stretched over the world's extent, as in createVisual()
+  double mpp_x, mpp_y;
+  metersPerPixel(mpp_x, mpp_y);
+  return GeoConverter(x, y, loader_->zoom(), mpp_x*loader_->imageSize(),
+                      mpp_y*loader_->imageSize());
+}
+
+// ----------------------------------------------------------------------------
+
+std::unique_ptr<ModelCreator> ModelCreator::placeholder(unsigned int levels,
+                                                        const std::string& root) const
+{
+  const unsigned int zoom = loader_->zoom() > levels ? loader_->zoom() - levels : 0;
+  const int scale = 1 << (loader_->zoom() - zoom);
+
+  int min_x, max_x, min_y, max_y;
+  loader_->tileRange(min_x, max_x, min_y, max_y);
+  min_x /= scale; max_x /= scale;
+  min_y /= scale; max_y /= scale;
+
+  // The corners of those tiles in this world's frame (y runs north)
+  double x[2] = { static_cast<double>(min_x*scale), static_cast<double>((max_x + 1)*scale) };
+  double y[2] = { static_cast<double>((max_y + 1)*scale), static_cast<double>(min_y*scale) };
+  geoConverter().convert(GeoConverter::Frame::TILE, GeoConverter::Frame::LOCAL, x, y, 2, x, y);
+
+  // As a page of a pager, it is a world whose plane covers exactly its tiles
+  GeoParams geo = geo_params_;
+  geo.zoom = zoom;
+  geo.width = x[1] - x[0];
+  geo.height = y[1] - y[0];
+  geo.shift_x = (x[0] + x[1])/2/geo.width;
+  geo.shift_y = (y[0] + y[1])/2/geo.height;
+  TileLoader::tileCoordsToLatLon((min_x + max_x + 1)/2.0, (min_y + max_y + 1)/2.0,
+                                 zoom, geo.lat, geo.lon);
+
+  return std::unique_ptr<ModelCreator>(new ModelCreator(geo, root,
+                          loader_->forTileRange(min_x, max_x, min_y, max_y, zoom),
+                          cache_manager_));
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::setStopFlag(const std::shared_ptr<std::atomic<bool>>& stop)
+{
+  loader_->setStopFlag(stop);
+  if (elevation_loader_) elevation_loader_->setStopFlag(stop);
+}
+
+// ----------------------------------------------------------------------------
+
+std::unique_ptr<TileLoader> ModelCreator::elevationTiles(const TileLoader& imagery,
+                                                         const TileLoader& elevation,
+                                                         unsigned int zoom)
+{
+  int min_x, max_x, min_y, max_y;
+  imagery.tileRange(min_x, max_x, min_y, max_y);
+
+  // Elevation tiles usually stop at a lower zoom than the imagery; each
+  // one then covers 2^d x 2^d of the imagery's tiles
+  const unsigned int ez = std::min(zoom, imagery.zoom());
+  const int d = imagery.zoom() - ez;
+  return elevation.forTileRange(min_x >> d, max_x >> d, min_y >> d, max_y >> d, ez);
+}
+
+// ----------------------------------------------------------------------------
+
+bool ModelCreator::elevationAt(const TileLoader& elevation, double lat, double lon,
+                               float& height)
+{
+  auto loader = elevation.forArea(lat, lon, elevation.zoom(), 0, 0);
+
+  cv::Mat heights;
+  loader->loadTiles(true, [&heights](const TileLoader::MapTile&, const TileBytes& bytes) {
+    heights = decodeTerrarium(bytes);
+  });
+  if (heights.empty()) return false;
+
+  double x, y;
+  TileLoader::latLonToTileCoords(lat, lon, elevation.zoom(), x, y);
+  height = interpolateHeight(heights, (x - std::floor(x))*heights.cols,
+                             (y - std::floor(y))*heights.rows);
+  return true;
+}
+
 // ----------------------------------------------------------------------------
 // Private Methods
 // ----------------------------------------------------------------------------
 
-void ModelCreator::downloadTiles()
+unsigned int ModelCreator::numThreads() const
+{
+  return std::max(1u, threads_ > 0 ? threads_ : std::thread::hardware_concurrency());
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::originTileCoords(double& x, double& y) const
+{
+  // Convert percentage shift from center to meters from center
+  double xpos = geo_params_.shift_x*geo_params_.width;
+  double ypos = geo_params_.shift_y*geo_params_.height;
+
+  // The world image's pixel (px, py) is drawn at (xpos - width/2 + px*mpp_x,
+  // ypos + height/2 - py*mpp_y) (see createVisual), so world (0,0) is at
+  double mpp_x, mpp_y;
+  metersPerPixel(mpp_x, mpp_y);
+  const double px = (geo_params_.width/2 - xpos)/mpp_x;
+  const double py = (geo_params_.height/2 + ypos)/mpp_y;
+
+  int min_x, max_x, min_y, max_y;
+  loader_->tileRange(min_x, max_x, min_y, max_y);
+  x = min_x + px/loader_->imageSize();
+  y = min_y + py/loader_->imageSize();
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::metersPerPixel(double& mpp_x, double& mpp_y) const
+{
+  // The world image is scaled to the world's extent
+  const cv::Rect& world = chunks_.back().rect;
+  mpp_x = geo_params_.width/(world.x + world.width);
+  mpp_y = geo_params_.height/(world.y + world.height);
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::downloadTiles(const TileLoader::TileCallback& on_tile,
+                                 const TileLoader::TileFilter& wanted)
 {
   // how many tiles are not cached and need to be downloaded?
-  unsigned int num = loader_->numTilesToDownload();
+  unsigned int num;
+  {
+    Profiler::Scope scope(profiler_.get(), "cache lookup");
+    num = loader_->numTilesToDownload(wanted);
+  }
 
   if (num > 0)
   {
@@ -138,77 +455,922 @@ void ModelCreator::downloadTiles()
   }
 
   // Download any necessary tiles
-  tiles_ = loader_->loadTiles(true);
+  {
+    Profiler::Scope scope(profiler_.get(), "load");
+    tiles_ = loader_->loadTiles(true, on_tile, wanted);
+  }
 
-  if (num > 0)
-    gzmsg << "Finished loading tiles" << std::endl;
+  if (num > 0) {
+    const unsigned int dups = loader_->loadStats().duplicates;
+    gzmsg << "Finished loading tiles"
+          << ((dups > 0) ? " (" + std::to_string(dups) + " identical to a cached tile)" : "")
+          << std::endl;
+  }
+
+  const TileLoader::LoadStats& ls = loader_->loadStats();
+  profiler_->add("tiles cached", ls.cached);
+  profiler_->add("tiles downloaded", ls.downloaded);
+  profiler_->add("tiles not modified", ls.not_modified);
+  profiler_->add("tiles failed", ls.failed);
+  profiler_->add("tile retries", ls.retries);
+
+  if (ls.retries > 0 || ls.failed > 0)
+    gzwarn << ls.retries << " tile requests retried, " << ls.failed
+           << " tiles failed for good" << std::endl;
+
+  if (geo_params_.refresh_age >= 0) {
+    gzmsg << "Refreshed tiles: " << ls.downloaded << " updated, "
+          << ls.not_modified << " not modified, " << ls.failed << " failed" << std::endl;
+  }
+
+  // Report how well HTTP connections were reused
+  if (loader_->httpClient()) {
+    HttpClient::Stats s = loader_->httpClient()->stats();
+
+    // The client may be shared, so these are its totals so far
+    profiler_->set("http requests", s.requests);
+    profiler_->set("http bytes", s.bytes);
+    profiler_->set("http new connections", s.handshakes);
+    profiler_->set("http latency mean (ms)", (s.requests > 0) ? 1000*s.latency/s.requests : 0);
+    for (size_t i=0; i<HttpClient::LATENCY_BUCKETS; i++) {
+      // numbered, so that they sort in order
+      const bool last = (i + 1 == HttpClient::LATENCY_BUCKETS);
+      const int bound = HttpClient::latencyBound(last ? i - 1 : i);
+      profiler_->set("http latency " + std::to_string(i) + ": " + (last ? ">= " : "< ")
+                       + std::to_string(bound) + " ms", s.latency_histogram[i]);
+    }
+
+    gzmsg << "HTTP: " << s.requests << " requests, " << s.handshakes
+          << " new connections, " << s.reused << " reused"
+          << " (" << s.http2 << " over HTTP/2, " << s.bytes << " bytes), "
+          << s.delayed << " held back by the rate limit" << std::endl;
+  }
 }
 
 // ----------------------------------------------------------------------------
 
 void ModelCreator::createWorldImage()
 {
-  // Download (or use cached) tiles
-  downloadTiles();
-
-  gzmsg << "Stitching together " << loader_->numTiles() << " tiles...";
+  const std::string format = textureExtension();
+  const cv::Rect& last = chunks_.back().rect;
+  const double megapixels = static_cast<double>(last.x + last.width)*(last.y + last.height)/1e6;
+
+  // No encoder can write a JPEG this large, in memory or not
+  if (format == "jpg") {
+    for (const auto& chunk : chunks_) {
+      if (chunk.rect.width > 0xFFFF || chunk.rect.height > 0xFFFF)
+        throw std::runtime_error("The world image is too large for a JPEG texture (" +
+                                 std::to_string(chunk.rect.width) + " x " +
+                                 std::to_string(chunk.rect.height) + " pixels); set " +
+                                 "chunk_size to at most 65535, or texture_format to dds");
+    }
+  }
 
-  // Stitch the indivisual tiles into one image
-  auto img = stitchTiles();
+  bool stream = geo_params_.stream_stitch;
+  if (stream && format != "jpg" && format != "dds") {
+    gzwarn << "Can't stream " << format << " textures; stitching the world image in memory"
+           << std::endl;
+    stream = false;
+  }
+  if (stream && format == "jpg" && !JPEGWriter::streamable(chunks_[0].rect.width, chunks_[0].rect.height)) {
+    gzwarn << "OpenCV's JPEG encoder can't write restart markers, which streaming needs; "
+           << "stitching the world image in memory" << std::endl;
+    stream = false;
+  }
 
-  // Save the image to file
-  std::vector<int> compression_params;
-  compression_params.push_back(cv::IMWRITE_JPEG_QUALITY);
-  compression_params.push_back(jpg_quality_);
+  // Chunks whose texture is still to be written
+  std::vector<size_t> pending;
+  if (stream) {
+    pending = streamWorldImage();
+    if (!pending.empty())
+      gzwarn << "Failed to stream " << pending.size() << " of " << chunks_.size()
+             << " textures; stitching the world image in memory for them" << std::endl;
+  } else {
+    for (size_t i=0; i<chunks_.size(); i++) pending.push_back(i);
+  }
 
-  cv::imwrite(world_img_path_.string(), img, compression_params);
+  if (!pending.empty()) {
+    // Download (or use cached) tiles and stitch them together as they arrive
+    const double streamed = stitch_stats_.encode;
+    auto img = stitchTiles();
+    if (loader_->stopped())
+      throw std::runtime_error("Stopped while loading tiles");
+
+    // Only lossless textures are reused by other worlds (see reuseMosaic),
+    // and only once their holes are known; until they are written, they
+    // can't be reused
+    const bool lossless = (format == "png" || (format == "webp" && jpg_quality_ > 100));
+    boost::system::error_code ec;
+    fs::remove(holesPath(), ec);
+
+    // Save the image to file(s). JPEG and DDS encoders use every thread for
+    // each chunk; PNG and WebP chunks are encoded concurrently instead.
+    const auto start = Clock::now();
+    const bool per_chunk = (format == "png" || format == "webp");
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto worker = [&]() {
+      for (size_t i = next++; i < pending.size(); i = next++) {
+        Profiler::Scope scope(profiler_.get(), "encode");
+        const Chunk& chunk = chunks_[pending[i]];
+        if (!writeTexture(chunk.img_path, img(chunk.rect))) {
+          gzerr << "Failed to write " << chunk.img_path << std::endl;
+          boost::system::error_code ec;
+          fs::remove(chunk.img_path, ec);
+          ok = false;
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    if (per_chunk) {
+      const size_t n = std::min<size_t>(numThreads(), pending.size());
+      for (size_t i=1; i<n; i++) threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) t.join();
+
+    stitch_stats_.encode = streamed + seconds(start);
+
+    // The world's materials would refer to textures that aren't there
+    if (!ok)
+      throw std::runtime_error("Failed to write the world's textures");
+
+    if (lossless && pending.size() == chunks_.size()) {
+      const fs::path path = holesPath();
+      const fs::path part = path.string() + ".part";
+      {
+        std::ofstream out(part.string());
+        for (const auto& t : holes_) out << t.x << " " << t.y << "\n";
+      }
+      fs::rename(part, path, ec);
+    }
+  }
 
-  gzmsg << "done." << std::endl;
+  const StitchStats& st = stitch_stats_;
+  gzmsg << "Stitched " << st.tiles + st.reused << " tiles (" << st.copied << " repeated, "
+        << st.reused << " reused, " << st.shared << " shared) in " << st.total + st.encode << " s: reuse "
+        << st.reuse << " s, load " << st.load << " s, decode "
+        << st.decode << " s, encode " << st.encode << " s ("
+        << megapixels/std::max(st.encode, 1e-6) << " MP/s as " << format << ")" << std::endl;
+
+  if (st.missing > 0 || st.failed > 0 || st.resized > 0)
+    gzwarn << st.missing << " tiles missing, " << st.failed << " could not be decoded ("
+           << st.upscaled << " of them filled in from a lower zoom level), "
+           << st.resized << " had the wrong size and were scaled" << std::endl;
 }
 
 // ----------------------------------------------------------------------------
 
 cv::Mat ModelCreator::stitchTiles()
 {
+  Profiler::Scope scope(profiler_.get(), "stitch");
+  const auto start = Clock::now();
+  stitch_stats_ = StitchStats();
+
   // find out how many tiles are in the x and y directions
   int cols, rows;
-  int numTiles = loader_->numTiles(&cols, &rows);
+  loader_->numTiles(&cols, &rows);
+
+  int min_x, max_x, min_y, max_y;
+  loader_->tileRange(min_x, max_x, min_y, max_y);
 
   // Create an empty image with the proper dimensions
   int width = cols*loader_->imageSize();
   int height = rows*loader_->imageSize();
   cv::Mat result = cv::Mat::zeros(height, width, CV_8UC3);
+  profiler_->max("mosaic peak bytes", result.total()*result.elemSize());
+
+  // Where each unique tile content was first placed, with its bytes.
+  // Identical tiles are copied from there (once everything is decoded)
+  // instead of being decoded again. The bytes are compared, so that tiles
+  // whose digests merely collide are still decoded.
+  std::unordered_map<uint64_t, std::pair<cv::Rect, TileBytes>> placed;
+  std::vector<std::pair<cv::Rect, cv::Rect>> copies;
+
+  // Tiles shared with a world image stitched before are copied from it,
+  // and only the rest are loaded. A refresh may have changed any tile, so
+  // nothing is reused then; nor while other creators may be writing their
+  // world images.
+  std::vector<char> reused(cols*rows, 0);
+  std::vector<char> good(cols*rows, 0);   // has an image of its own
+  if (tiles_.empty() && geo_params_.refresh_age < 0 && !shared_tiles_) {
+    Profiler::Scope scope(profiler_.get(), "reuse");
+    const auto t0 = Clock::now();
+    stitch_stats_.reused = reuseMosaic(result, reused);
+    stitch_stats_.reuse = seconds(t0);
+  }
+
+  // Tiles travel from the loader to the decoder through a bounded queue, so
+  // downloads stall rather than pile up if decoding falls behind.
+  typedef std::pair<TileLoader::MapTile, TileBytes> Item;
+  BoundedQueue<Item> queue(64);
+
+  // Tiles are decoded on every core, each one straight into its place in
+  // the result. Only the bookkeeping is shared between the decoders.
+  std::mutex mutex;
+  std::vector<TileLoader::MapTile> undecodable;
+  auto decode = [&]() {
+    StitchStats st;
+    Profiler::Batch spans(profiler_.get());
+    Item item(TileLoader::MapTile(0, 0, 0, fs::path()), TileBytes());
+    while (queue.pop(item)) {
+      const TileLoader::MapTile& tile = item.first;
+      const TileBytes& bytes = item.second;
+
+      // calculate image position
+      const int tileCol = tile.x() - min_x;
+      const int tileRow = tile.y() - min_y;
+      if (tileCol < 0 || tileCol >= cols || tileRow < 0 || tileRow >= rows) continue;
+
+      const int startCol = tileCol*loader_->imageSize();
+      const int startRow = tileRow*loader_->imageSize();
+      const cv::Rect roi(startCol, startRow, loader_->imageSize(), loader_->imageSize());
+
+      st.tiles++;
+
+      // The first decoder to see a content decodes it
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = placed.find(bytes.digest);
+        if (it == placed.end()) {
+          placed[bytes.digest] = std::make_pair(roi, bytes);
+        } else {
+          const TileBytes& first = it->second.second;
+          if (first.size == bytes.size && std::memcmp(first.data, bytes.data, bytes.size) == 0) {
+            copies.emplace_back(it->second.first, roi);
+            continue;
+          }
+        }
+      }
+
+      const auto t0 = Clock::now();
+      cv::Mat masked(result, roi);
+      cv::Mat decoded;
+
+      // Another creator may be decoding the same tile already
+      SharedTiles::Claim claim;
+      if (shared_tiles_ && !shared_tiles_->claim(tile.x(), tile.y(), tile.z(), decoded, claim)) {
+        if (decoded.empty()) {
+          st.failed++;
+          std::lock_guard<std::mutex> lock(mutex);
+          undecodable.push_back(tile);
+        } else {
+          decoded.copyTo(masked);
+          good[tileRow*cols + tileCol] = 1;
+          st.shared++;
+        }
+        st.decode += seconds(t0);
+        continue;
+      }
+
+      // Decode the tile straight from the download buffer or the cache's
+      // bytes (no copy for packs) into the result. imdecode only allocates
+      // if the tile turns out not to fit the region, i.e. if it is not
+      // imageSize() pixels square.
+      cv::Mat buf(1, static_cast<int>(bytes.size), CV_8UC1,
+                  const_cast<char*>(bytes.data));
+      decoded = masked;
+      cv::imdecode(buf, cv::IMREAD_COLOR, &decoded);
+
+      if (decoded.empty()) {
+        st.failed++;
+        std::lock_guard<std::mutex> lock(mutex);
+        undecodable.push_back(tile);
+      } else if (decoded.data != masked.data) {
+        cv::resize(decoded, masked, masked.size(), 0, 0, cv::INTER_AREA);
+        st.resized++;
+      }
+      good[tileRow*cols + tileCol] = !decoded.empty();
+
+      claim.put(decoded.empty() ? cv::Mat() : masked);
+
+      st.decode += seconds(t0);
+      spans.record("decode", t0, Clock::now());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stitch_stats_.tiles += st.tiles;
+    stitch_stats_.shared += st.shared;
+    stitch_stats_.failed += st.failed;
+    stitch_stats_.resized += st.resized;
+    stitch_stats_.decode += st.decode;
+  };
+
+  std::vector<std::thread> decoders;
+  const unsigned int ndecoders = numThreads();
+  for (unsigned int i=0; i<ndecoders; i++) decoders.emplace_back(decode);
+
+  auto on_tile = [&](const TileLoader::MapTile& tile, const TileBytes& bytes) {
+    queue.push(Item(tile, bytes));
+  };
+
+  // Tiles already loaded (when refreshing) are read back from the cache;
+  // otherwise each tile is decoded as soon as its download completes.
+  const auto t0 = Clock::now();
+  if (tiles_.empty()) {
+    downloadTiles(on_tile, [&](const TileLoader::MapTile& tile) {
+      return !reused[(tile.y() - min_y)*cols + (tile.x() - min_x)];
+    });
+  } else {
+    for (const auto& tile : tiles_) {
+      TileBytes bytes;
+      if (loader_->readTile(tile, bytes)) on_tile(tile, bytes);
+    }
+  }
+  stitch_stats_.load = seconds(t0);
 
-  // Loop through each sorted tile and place appropriately in image
-  for (int i=0; i<numTiles; i++)
+  queue.close();
+  for (auto& t : decoders) t.join();
+
+  const int size = loader_->imageSize();
+  for (const auto& c : copies) {
+    result(c.first).copyTo(result(c.second));
+    good[(c.second.y/size)*cols + c.second.x/size] = good[(c.first.y/size)*cols + c.first.x/size];
+  }
+  stitch_stats_.copied = copies.size();
+
+  // Remember which tiles are missing or only placeholders, so that a world
+  // reusing this one's image loads them instead
+  holes_.clear();
+  for (int r=0; r<rows; r++)
+    for (int c=0; c<cols; c++)
+      if (!good[r*cols + c] && !reused[r*cols + c]) holes_.push_back(cv::Point(min_x + c, min_y + r));
+
+  // Tiles that failed for good are filled in, by their coordinates, from
+  // a cached tile further up (if there is one) rather than left black
+  std::vector<TileLoader::MapTile> holes = loader_->failedTiles();
+  holes.insert(holes.end(), undecodable.begin(), undecodable.end());
+  for (const auto& tile : holes) {
+    const int tileCol = tile.x() - min_x;
+    const int tileRow = tile.y() - min_y;
+    if (tileCol < 0 || tileCol >= cols || tileRow < 0 || tileRow >= rows) continue;
+
+    cv::Mat roi = result(cv::Rect(tileCol*loader_->imageSize(), tileRow*loader_->imageSize(),
+                                  loader_->imageSize(), loader_->imageSize()));
+    if (fillPlaceholder(roi, tile)) stitch_stats_.upscaled++;
+  }
+  stitch_stats_.missing = cols*rows - stitch_stats_.tiles - stitch_stats_.reused;
+
+  profiler_->add("tiles stitched", stitch_stats_.tiles);
+  profiler_->add("tiles reused", stitch_stats_.reused);
+  profiler_->add("tiles shared", stitch_stats_.shared);
+  profiler_->add("tiles missing", stitch_stats_.missing);
+
+  stitch_stats_.total = seconds(start);
+  return result;
+}
+
+// ----------------------------------------------------------------------------
+
+std::vector<size_t> ModelCreator::streamWorldImage()
+{
+  Profiler::Scope scope(profiler_.get(), "stitch");
+  const auto start = Clock::now();
+  stitch_stats_ = StitchStats();
+
+  int cols, rows;
+  loader_->numTiles(&cols, &rows);
+
+  int min_x, max_x, min_y, max_y;
+  loader_->tileRange(min_x, max_x, min_y, max_y);
+
+  const int size = loader_->imageSize();
+  const int width = cols*size;
+
+  // Tiles only go to the cache while loading; their pixels are read back
+  // one row of tiles at a time
+  if (tiles_.empty()) downloadTiles();
+  stitch_stats_.load = seconds(start);
+
+  std::vector<const TileLoader::MapTile*> grid(cols*rows, nullptr);
+  for (const auto& tile : tiles_) {
+    const int tileCol = tile.x() - min_x;
+    const int tileRow = tile.y() - min_y;
+    if (tileCol >= 0 && tileCol < cols && tileRow >= 0 && tileRow < rows)
+      grid[tileRow*cols + tileCol] = &tile;
+  }
+
+  // Each chunk's texture is opened when the first strip reaches it and
+  // finished with its last row
+  struct Writer
+  {
+    std::unique_ptr<JPEGWriter> jpeg;
+    std::unique_ptr<DDSWriter> dds;
+    bool ok = true;
+  };
+  std::vector<Writer> writers(chunks_.size());
+
+  // The only pixels in memory: one row of tiles
+  cv::Mat strip(size, width, CV_8UC3);
+  profiler_->max("mosaic peak bytes", strip.total()*strip.elemSize());
+
+  std::mutex mutex;
+  for (int r=0; r<rows; r++) {
+    if (loader_->stopped()) {
+      writers.clear();
+      boost::system::error_code ec;
+      for (const auto& chunk : chunks_) fs::remove(chunk.img_path, ec);
+      throw std::runtime_error("Stopped while loading tiles");
+    }
+
+    //
+    // Decode the row's tiles on every core, each into its place in the
+    // strip. Tiles that can't be read or decoded are filled in from a
+    // cached tile further up, if there is one.
+    //
+
+    std::atomic<int> next(0);
+    auto decode = [&]() {
+      StitchStats st;
+      Profiler::Batch spans(profiler_.get());
+      for (int c = next++; c < cols; c = next++) {
+        const auto t0 = Clock::now();
+        cv::Mat masked(strip, cv::Rect(c*size, 0, size, size));
+        cv::Mat decoded;
+
+        TileBytes bytes;
+        const TileLoader::MapTile* tile = grid[r*cols + c];
+        if (tile && loader_->readTile(*tile, bytes)) {
+          st.tiles++;
+          SharedTiles::Claim claim;
+          if (shared_tiles_ &&
+              !shared_tiles_->claim(tile->x(), tile->y(), tile->z(), decoded, claim)) {
+            // decoded by another creator
+            if (decoded.empty()) {
+              st.failed++;
+            } else {
+              decoded.copyTo(masked);
+              st.shared++;
+            }
+          } else {
+            cv::Mat buf(1, static_cast<int>(bytes.size), CV_8UC1,
+                        const_cast<char*>(bytes.data));
+            decoded = masked;
+            cv::imdecode(buf, cv::IMREAD_COLOR, &decoded);
+
+            if (decoded.empty()) {
+              st.failed++;
+            } else if (decoded.data != masked.data) {
+              cv::resize(decoded, masked, masked.size(), 0, 0, cv::INTER_AREA);
+              st.resized++;
+            }
+
+            claim.put(decoded.empty() ? cv::Mat() : masked);
+          }
+        }
+
+        if (decoded.empty()) {
+          masked.setTo(cv::Scalar::all(0));
+          const TileLoader::MapTile hole(min_x + c, min_y + r, loader_->zoom(), fs::path());
+          if (fillPlaceholder(masked, hole)) st.upscaled++;
+        }
+
+        st.decode += seconds(t0);
+        spans.record("decode", t0, Clock::now());
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      stitch_stats_.tiles += st.tiles;
+      stitch_stats_.shared += st.shared;
+      stitch_stats_.failed += st.failed;
+      stitch_stats_.resized += st.resized;
+      stitch_stats_.upscaled += st.upscaled;
+      stitch_stats_.decode += st.decode;
+    };
+
+    std::vector<std::thread> decoders;
+    const int ndecoders = std::min<int>(numThreads(), cols);
+    for (int i=1; i<ndecoders; i++) decoders.emplace_back(decode);
+    decode();
+    for (auto& t : decoders) t.join();
+
+    //
+    // Hand the strip's rows to the chunks they belong to
+    //
+
+    const auto t0 = Clock::now();
+    const cv::Rect band(0, r*size, width, size);
+    for (size_t i=0; i<chunks_.size(); i++) {
+      const Chunk& chunk = chunks_[i];
+      const cv::Rect part = chunk.rect & band;
+      Writer& w = writers[i];
+      if (part.area() == 0 || !w.ok) continue;
+
+      Profiler::Scope scope(profiler_.get(), "encode");
+      if (!w.jpeg && !w.dds) {
+        if (textureExtension() == "jpg")
+          w.jpeg.reset(new JPEGWriter(chunk.img_path, chunk.rect.width, chunk.rect.height,
+                                      jpg_quality_, numThreads()));
+        else
+          w.dds.reset(new DDSWriter(chunk.img_path, chunk.rect.width, chunk.rect.height,
+                                    numThreads()));
+      }
+
+      const cv::Mat part_rows = strip(part - band.tl());
+      w.ok = w.jpeg ? w.jpeg->write(part_rows) : w.dds->write(part_rows);
+
+      const bool done = (part.br().y == chunk.rect.br().y);
+      if (w.ok && done) w.ok = w.jpeg ? w.jpeg->finish() : w.dds->finish();
+
+      if (!w.ok || done) {
+        w.jpeg.reset();
+        w.dds.reset();
+      }
+
+      // A partial texture would pass for a finished one next time
+      if (!w.ok) {
+        boost::system::error_code ec;
+        fs::remove(chunk.img_path, ec);
+      }
+    }
+    stitch_stats_.encode += seconds(t0);
+  }
+
+  std::vector<size_t> failed;
+  for (size_t i=0; i<chunks_.size(); i++)
+    if (!writers[i].ok) failed.push_back(i);
+
+  stitch_stats_.missing = cols*rows - stitch_stats_.tiles;
+
+  profiler_->add("tiles stitched", stitch_stats_.tiles);
+  profiler_->add("tiles shared", stitch_stats_.shared);
+  profiler_->add("tiles missing", stitch_stats_.missing);
+
+  stitch_stats_.total = seconds(start) - stitch_stats_.encode;
+  return failed;
+}
+
+// ----------------------------------------------------------------------------
+
+std::string ModelCreator::mosaicName() const
+{
+  int min_x, max_x, min_y, max_y;
+  loader_->tileRange(min_x, max_x, min_y, max_y);
+
+  return loader_->serviceHash() + "_" + std::to_string(loader_->zoom()) + "_"
+          + std::to_string(min_x) + "_" + std::to_string(min_y) + "_"
+          + std::to_string(max_x) + "_" + std::to_string(max_y);
+}
+
+// ----------------------------------------------------------------------------
+
+unsigned int ModelCreator::reuseMosaic(cv::Mat& result, std::vector<char>& reused)
+{
+  // Only lossless textures are reused, so that their pixels aren't
+  // compressed again by every world that reuses them. (OpenCV can't read
+  // DDS textures back either.)
+  const std::string format = textureExtension();
+  if (format != "png" && format != "webp") return 0;
+
+  int min_x, max_x, min_y, max_y;
+  loader_->tileRange(min_x, max_x, min_y, max_y);
+  const int size = loader_->imageSize();
+
+  //
+  // Find the world images of the same tiles, chunked or not. Their names
+  // are <service>_<zoom>_<min_x>_<min_y>_<max_x>_<max_y>, followed by
+  // _<chunk size>_<row>_<col> for chunks.
+  //
+
+  struct Mosaic
   {
-    cv::Mat tile = cv::imread(tiles_[i].imagePath().string(), cv::IMREAD_COLOR);
+    int min_x, min_y, max_x, max_y, chunk_size;
+    std::vector<std::pair<cv::Rect, fs::path>> chunks;  ///< global pixels
+  };
+  std::map<std::vector<int>, Mosaic> mosaics;
+
+  const std::string prefix = loader_->serviceHash() + "_" + std::to_string(loader_->zoom()) + "_";
+  for (fs::directory_iterator it(textures_dir_), end; it != end; ++it) {
+    const std::string stem = it->path().stem().string();
+    if (it->path().extension() != "."+format || stem.compare(0, prefix.size(), prefix) != 0)
+      continue;
+
+    std::vector<int> v;
+    std::istringstream is(stem.substr(prefix.size()));
+    for (std::string field; std::getline(is, field, '_');) {
+      if (field.empty() || field.find_first_not_of("0123456789") != std::string::npos) break;
+      v.push_back(std::stoi(field));
+    }
+    if (v.size() != 4 && v.size() != 7) continue;
+    if (v.size() == 4) v.insert(v.end(), {0, 0, 0});
+    if (v[2] < v[0] || v[3] < v[1]) continue;
+
+    const std::vector<int> key(v.begin(), v.begin() + 5);
+    Mosaic& m = mosaics[key];
+    m.min_x = v[0]; m.min_y = v[1]; m.max_x = v[2]; m.max_y = v[3];
+    m.chunk_size = v[4];
+
+    const int width = (m.max_x - m.min_x + 1)*size;
+    const int height = (m.max_y - m.min_y + 1)*size;
+    const int cs = m.chunk_size > 0 ? m.chunk_size : std::max(width, height);
+    const cv::Rect rect(v[6]*cs, v[5]*cs, std::min(cs, width - v[6]*cs),
+                                          std::min(cs, height - v[5]*cs));
+    if (rect.width <= 0 || rect.height <= 0) continue;
+    m.chunks.emplace_back(rect + cv::Point(m.min_x*size, m.min_y*size), it->path());
+  }
 
-    // calculate image position
-    const int tileCol = i%cols;
-    const int tileRow = i/cols;
-    const int startCol = tileCol*loader_->imageSize();
-    const int startRow = tileRow*loader_->imageSize();
+  // Use the complete one that overlaps these tiles the most
+  const Mosaic* best = nullptr;
+  int best_area = 0;
+  for (const auto& kv : mosaics) {
+    const Mosaic& m = kv.second;
+    const int width = (m.max_x - m.min_x + 1)*size;
+    const int height = (m.max_y - m.min_y + 1)*size;
+    const int cs = m.chunk_size > 0 ? m.chunk_size : std::max(width, height);
+    const size_t nchunks = static_cast<size_t>((width + cs - 1)/cs)*((height + cs - 1)/cs);
+    if (m.chunks.size() != nchunks) continue;
+
+    // Its holes are only recorded once all of it is written, and only if
+    // it is lossless
+    if (!fs::exists(holesPath(prefix + std::to_string(m.min_x) + "_" + std::to_string(m.min_y) + "_" +
+                              std::to_string(m.max_x) + "_" + std::to_string(m.max_y),
+                              m.chunk_size)))
+      continue;
+
+    const int cols = std::min(max_x, m.max_x) - std::max(min_x, m.min_x) + 1;
+    const int rows = std::min(max_y, m.max_y) - std::max(min_y, m.min_y) + 1;
+    if (cols > 0 && rows > 0 && cols*rows > best_area) {
+      best = &m;
+      best_area = cols*rows;
+    }
+  }
+  if (best == nullptr) return 0;
+
+  //
+  // Copy the overlap from every chunk it touches, in global pixels
+  //
 
-    // Create a region of interest into the result image
-    cv::Mat masked(result, cv::Rect(startCol, startRow,
-                              loader_->imageSize(), loader_->imageSize()));
+  const cv::Point origin(min_x*size, min_y*size);
+  const cv::Rect overlap(cv::Point(std::max(min_x, best->min_x)*size,
+                                   std::max(min_y, best->min_y)*size),
+                         cv::Point((std::min(max_x, best->max_x) + 1)*size,
+                                   (std::min(max_y, best->max_y) + 1)*size));
+
+  for (const auto& chunk : best->chunks) {
+    const cv::Rect part = chunk.first & overlap;
+    if (part.area() == 0) continue;
+
+    const cv::Mat img = cv::imread(chunk.second.string(), cv::IMREAD_COLOR);
+    if (img.cols != chunk.first.width || img.rows != chunk.first.height) {
+      gzwarn << "Could not reuse " << chunk.second << "; loading all tiles" << std::endl;
+      result.setTo(cv::Scalar::all(0));
+      return 0;
+    }
+    img(part - chunk.first.tl()).copyTo(result(part - origin));
+  }
 
-    // Copy this tile into the result
-    tile.copyTo(masked);
+  int cols;
+  loader_->numTiles(&cols);
+  for (int y = overlap.y/size; y < overlap.br().y/size; y++)
+    for (int x = overlap.x/size; x < overlap.br().x/size; x++)
+      reused[(y - min_y)*cols + (x - min_x)] = 1;
+
+  // ...except for the tiles that were missing or only placeholders there,
+  // which are loaded again
+  const std::string name = prefix + std::to_string(best->min_x) + "_" + std::to_string(best->min_y)
+                            + "_" + std::to_string(best->max_x) + "_" + std::to_string(best->max_y);
+  std::ifstream holes(holesPath(name, best->chunk_size).string());
+  int hx, hy;
+  while (holes >> hx >> hy) {
+    const cv::Rect tile(hx*size, hy*size, size, size);
+    if ((tile & overlap).area() == 0 || !reused[(hy - min_y)*cols + (hx - min_x)]) continue;
+
+    reused[(hy - min_y)*cols + (hx - min_x)] = 0;
+    result(tile - origin).setTo(cv::Scalar::all(0));
+    best_area--;
   }
 
-  return result;
+  gzmsg << "Reusing " << best_area << " tiles from the world image "
+        << best->chunks.front().second.stem().string() << std::endl;
+  return best_area;
 }
 
 // ----------------------------------------------------------------------------
 
-void ModelCreator::createWorldScript()
+fs::path ModelCreator::holesPath() const
 {
-  std::ofstream out(world_scr_path_.string());
+  return CacheManager::holesPath(chunks_.front().img_path);
+}
 
-  const std::string image_filename = world_img_path_.filename().string();
-  const std::string image_name = world_img_path_.stem().string();
+// ----------------------------------------------------------------------------
+
+fs::path ModelCreator::holesPath(const std::string& mosaic, int chunk_size) const
+{
+  // The holes of a chunked world image go with its first chunk
+  const std::string suffix = chunk_size > 0 ? "_" + std::to_string(chunk_size) + "_0_0" : "";
+  return CacheManager::holesPath(textures_dir_/(mosaic + suffix + "." + textureExtension()));
+}
+
+// ----------------------------------------------------------------------------
+
+bool ModelCreator::fillPlaceholder(cv::Mat& img, const TileLoader::MapTile& tile) const
+{
+  // Each zoom level up, a tile covers 2x2 tiles of the level below. Going
+  // up more than 4 levels would leave too few pixels to be of any use.
+  const int size = loader_->imageSize();
+  for (int k=1; k<=4 && k<=tile.z(); k++) {
+    TileBytes bytes;
+    if (!loader_->tileCache()->read(tile.x() >> k, tile.y() >> k, tile.z() - k, bytes))
+      continue;
+
+    cv::Mat buf(1, static_cast<int>(bytes.size), CV_8UC1, const_cast<char*>(bytes.data));
+    cv::Mat parent = cv::imdecode(buf, cv::IMREAD_COLOR);
+    if (parent.cols != size || parent.rows != size) continue;
+
+    const int part = size >> k;
+    const cv::Rect rect((tile.x() - ((tile.x() >> k) << k))*part,
+                        (tile.y() - ((tile.y() >> k) << k))*part, part, part);
+    cv::resize(parent(rect), img, img.size(), 0, 0, cv::INTER_LINEAR);
+    return true;
+  }
+
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+
+std::string ModelCreator::textureExtension() const
+{
+  return geo_params_.texture_format;
+}
+
+// ----------------------------------------------------------------------------
+
+bool ModelCreator::writeTexture(const fs::path& path, const cv::Mat& img) const
+{
+  const std::string format = textureExtension();
+  if (format == "jpg") return writeJPEG(path, img, jpg_quality_, numThreads());
+  if (format == "dds") return writeDDS(path, img, numThreads());
+
+  std::vector<int> params;
+  if (format == "webp") {
+    // WebP qualities above 100 are lossless, like JPEG's scale otherwise
+    params.push_back(cv::IMWRITE_WEBP_QUALITY);
+    params.push_back(jpg_quality_);
+  }
+  return cv::imwrite(path.string(), img, params);
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::createChunks()
+{
+  int cols, rows;
+  loader_->numTiles(&cols, &rows);
+
+  const int width = cols*loader_->imageSize();
+  const int height = rows*loader_->imageSize();
+
+  // Without chunking, the whole world image is a single chunk
+  if (geo_params_.chunk_size == 0 ||
+      (width <= geo_params_.chunk_size && height <= geo_params_.chunk_size)) {
+    chunks_.push_back(Chunk{cv::Rect(0, 0, width, height), world_img_path_, world_scr_path_, fs::path()});
+    return;
+  }
+
+  // Chunks are named by their size and position, so that worlds stitched
+  // with different chunk sizes don't share textures
+  const int size = geo_params_.chunk_size;
+  for (int r=0; r*size<height; r++) {
+    for (int c=0; c*size<width; c++) {
+      const std::string name = mosaicName() + "_" + std::to_string(size) + "_"
+                                + std::to_string(r) + "_" + std::to_string(c);
+
+      const cv::Rect rect(c*size, r*size, std::min(size, width - c*size),
+                                          std::min(size, height - r*size));
+      chunks_.push_back(Chunk{rect, textures_dir_/(name+"."+textureExtension()),
+                              scripts_dir_/(name+".material"), fs::path()});
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+bool ModelCreator::loadElevation()
+{
+  int min_x, max_x, min_y, max_y;
+  loader_->tileRange(min_x, max_x, min_y, max_y);
+
+  auto loader = elevationTiles(*loader_, *elevation_loader_, geo_params_.elevation_zoom);
+  const int d = loader_->zoom() - loader->zoom();
+  int ex0, ex1, ey0, ey1;
+  loader->tileRange(ex0, ex1, ey0, ey1);
+
+  const int size = loader_->imageSize();
+  elevation_ = cv::Mat::zeros((ey1 - ey0 + 1)*size, (ex1 - ex0 + 1)*size, CV_32F);
+  cv::Mat known = cv::Mat::zeros(elevation_.size(), CV_8U);
+  elevation_scale_ = 1.0/(1 << d);
+  elevation_offset_ = cv::Point2d(min_x*size*elevation_scale_ - ex0*size,
+                                  min_y*size*elevation_scale_ - ey0*size);
+
+  // Tiles go into separate parts of the heights, so no locking is needed
+  std::atomic<int> placed(0);
+  loader->loadTiles(true, [&](const TileLoader::MapTile& tile, const TileBytes& bytes) {
+    cv::Mat heights;
+    SharedTiles::Claim claim;
+    if (!shared_elevation_ ||
+        shared_elevation_->claim(tile.x(), tile.y(), tile.z(), heights, claim)) {
+      heights = decodeTerrarium(bytes);
+      claim.put(heights);
+    }
+    if (heights.cols != size || heights.rows != size) return;
+
+    const cv::Rect rect((tile.x() - ex0)*size, (tile.y() - ey0)*size, size, size);
+    heights.copyTo(elevation_(rect));
+    known(rect).setTo(1);
+    placed++;
+  });
+
+  const int missing = loader->numTiles() - placed;
+  if (placed == 0) return false;
+
+  // Rather than pits down to sea level, missing tiles continue the ground
+  // around them
+  elevation_complete_ = (missing == 0);
+  if (!elevation_complete_) {
+    fillHeightHoles(elevation_, known);
+    gzwarn << missing << " elevation tiles missing; the ground there is filled in "
+           << "from the tiles around them" << std::endl;
+  }
+
+  // The world origin is at z = 0. Its height comes from the tile there
+  // rather than from the heights around this world, which may not reach
+  // it, unless it is given (e.g. the same for several worlds).
+  double mpp_x, mpp_y;
+  metersPerPixel(mpp_x, mpp_y);
+  const double xpos = geo_params_.shift_x*geo_params_.width;
+  const double ypos = geo_params_.shift_y*geo_params_.height;
+
+  double lat, lon;
+  getOriginLatLon(lat, lon);
+  if (!std::isnan(geo_params_.datum))
+    datum_ = geo_params_.datum;
+  else if (!elevationAt(*elevation_loader_, lat, lon, datum_))
+    datum_ = heightAt((geo_params_.width/2 - xpos)/mpp_x, (geo_params_.height/2 + ypos)/mpp_y);
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+float ModelCreator::heightAt(double px, double py) const
+{
+  return interpolateHeight(elevation_, elevation_offset_.x + px*elevation_scale_,
+                           elevation_offset_.y + py*elevation_scale_);
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::createTerrainMesh(const cv::Rect& rect, const fs::path& path)
+{
+  // About one grid cell per elevation pixel, up to 256 x 256 cells
+  const double samples = std::max(rect.width, rect.height)*elevation_scale_;
+  const int k = std::min(8, std::max(1, static_cast<int>(std::ceil(std::log2(samples)))));
+  const int n = (1 << k) + 1;
+
+  const double step_x = rect.width/(n - 1.0);
+  const double step_y = rect.height/(n - 1.0);
+
+  cv::Mat grid(n, n, CV_32F);
+  for (int r=0; r<n; r++)
+    for (int c=0; c<n; c++)
+      grid.ptr<float>(r)[c] = heightAt(rect.x + c*step_x, rect.y + r*step_y) - datum_;
+
+  std::vector<cv::Point> vertices;
+  TerrainMesh mesh;
+  simplifyHeightGrid(grid, geo_params_.terrain_error, vertices, mesh.triangles);
+
+  // Image pixels to the world's frame, as for the flat visuals
+  double mpp_x, mpp_y;
+  metersPerPixel(mpp_x, mpp_y);
+
+  for (const auto& v : vertices) {
+    const double px = rect.x + v.x*step_x;
+    const double py = rect.y + v.y*step_y;
+    mesh.vertices.push_back(cv::Point3f(-geo_params_.width/2 + px*mpp_x,
+                                         geo_params_.height/2 - py*mpp_y,
+                                         grid.ptr<float>(v.y)[v.x]));
+    mesh.uvs.push_back(cv::Point2f(static_cast<float>(v.x)/(n - 1),
+                                   1 - static_cast<float>(v.y)/(n - 1)));
+  }
+
+  if (!writeCollada(path, mesh))
+    gzerr << "Failed to write " << path << std::endl;
+
+  gzmsg << "Terrain " << path.filename().string() << ": " << mesh.triangles.size()
+        << " triangles (" << 2*(n - 1)*(n - 1) << " unsimplified)" << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::createWorldScript(const Chunk& chunk)
+{
+  std::ofstream out(chunk.scr_path.string());
+
+  const std::string image_filename = chunk.img_path.filename().string();
+  const std::string image_name = chunk.img_path.stem().string();
 
   out << "material " << image_name                          << std::endl;
   out << "{"                                                << std::endl;
@@ -226,7 +1388,10 @@ void ModelCreator::createWorldScript()
   out << "      texture_unit"                               << std::endl;
   out << "      {"                                          << std::endl;
   out << "        texture " << image_filename               << std::endl;
-  out << "        filtering bilinear"                       << std::endl;
+  if (textureExtension() == "dds")
+    out << "        filtering trilinear"                    << std::endl;
+  else
+    out << "        filtering bilinear"                     << std::endl;
   out << "      }"                                          << std::endl;
   out << "    }"                                            << std::endl;
   out << "  }"                                              << std::endl;
@@ -260,22 +1425,30 @@ sdf::ElementPtr ModelCreator::createCollision(double xpos, double ypos)
   // Geometry
   //
 
-  gazebo::msgs::Vector3d *normal = new gazebo::msgs::Vector3d();
-  normal->set_x(0);
-  normal->set_y(0);
-  normal->set_z(1);
-
-  gazebo::msgs::Vector2d *size = new gazebo::msgs::Vector2d();
-  size->set_x(geo_params_.width);
-  size->set_y(geo_params_.height);
-
-  gazebo::msgs::PlaneGeom *plane = new gazebo::msgs::PlaneGeom();
-  plane->set_allocated_normal(normal);
-  plane->set_allocated_size(size);
-
   gazebo::msgs::Geometry *geo = new gazebo::msgs::Geometry();
-  geo->set_type(gazebo::msgs::Geometry_Type_PLANE);
-  geo->set_allocated_plane(plane);
+  if (!collision_mesh_path_.empty()) {
+    gazebo::msgs::MeshGeom *mesh = new gazebo::msgs::MeshGeom();
+    mesh->set_filename("file://" + collision_mesh_path_.string());
+
+    geo->set_type(gazebo::msgs::Geometry_Type_MESH);
+    geo->set_allocated_mesh(mesh);
+  } else {
+    gazebo::msgs::Vector3d *normal = new gazebo::msgs::Vector3d();
+    normal->set_x(0);
+    normal->set_y(0);
+    normal->set_z(1);
+
+    gazebo::msgs::Vector2d *size = new gazebo::msgs::Vector2d();
+    size->set_x(geo_params_.width);
+    size->set_y(geo_params_.height);
+
+    gazebo::msgs::PlaneGeom *plane = new gazebo::msgs::PlaneGeom();
+    plane->set_allocated_normal(normal);
+    plane->set_allocated_size(size);
+
+    geo->set_type(gazebo::msgs::Geometry_Type_PLANE);
+    geo->set_allocated_plane(plane);
+  }
 
   //
   // Use the above pieces to create the collision element
@@ -292,16 +1465,27 @@ sdf::ElementPtr ModelCreator::createCollision(double xpos, double ypos)
 
 // ----------------------------------------------------------------------------
 
-sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos)
+sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos, const Chunk& chunk)
 {
 
   //
   // Pose
   //
 
+  // Scale the chunk's pixels to the world's extent. Image rows grow
+  // southwards, i.e. along -y.
+  double mpp_x, mpp_y;
+  metersPerPixel(mpp_x, mpp_y);
+
+  // Terrain meshes are in the world's frame, planes in their own
   gazebo::msgs::Vector3d *position = new gazebo::msgs::Vector3d();
-  position->set_x(xpos);
-  position->set_y(ypos);
+  if (!chunk.mesh_path.empty()) {
+    position->set_x(xpos);
+    position->set_y(ypos);
+  } else {
+    position->set_x(xpos - geo_params_.width/2 + (chunk.rect.x + chunk.rect.width/2.0)*mpp_x);
+    position->set_y(ypos + geo_params_.height/2 - (chunk.rect.y + chunk.rect.height/2.0)*mpp_y);
+  }
   position->set_z(0);
 
   gazebo::msgs::Quaternion *orientation = new gazebo::msgs::Quaternion();
@@ -315,22 +1499,31 @@ sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos)
   // Geometry
   //
 
-  gazebo::msgs::Vector3d *normal = new gazebo::msgs::Vector3d();
-  normal->set_x(0);
-  normal->set_y(0);
-  normal->set_z(1);
-
-  gazebo::msgs::Vector2d *size = new gazebo::msgs::Vector2d();
-  size->set_x(geo_params_.width);
-  size->set_y(geo_params_.height);
-
-  gazebo::msgs::PlaneGeom *plane = new gazebo::msgs::PlaneGeom();
-  plane->set_allocated_normal(normal);
-  plane->set_allocated_size(size);
-
   gazebo::msgs::Geometry *geo = new gazebo::msgs::Geometry();
-  geo->set_type(gazebo::msgs::Geometry_Type_PLANE);
-  geo->set_allocated_plane(plane);
+  if (!chunk.mesh_path.empty()) {
+    // The texture is draped over the terrain by the mesh's coordinates
+    gazebo::msgs::MeshGeom *mesh = new gazebo::msgs::MeshGeom();
+    mesh->set_filename("file://" + chunk.mesh_path.string());
+
+    geo->set_type(gazebo::msgs::Geometry_Type_MESH);
+    geo->set_allocated_mesh(mesh);
+  } else {
+    gazebo::msgs::Vector3d *normal = new gazebo::msgs::Vector3d();
+    normal->set_x(0);
+    normal->set_y(0);
+    normal->set_z(1);
+
+    gazebo::msgs::Vector2d *size = new gazebo::msgs::Vector2d();
+    size->set_x(chunk.rect.width*mpp_x);
+    size->set_y(chunk.rect.height*mpp_y);
+
+    gazebo::msgs::PlaneGeom *plane = new gazebo::msgs::PlaneGeom();
+    plane->set_allocated_normal(normal);
+    plane->set_allocated_size(size);
+
+    geo->set_type(gazebo::msgs::Geometry_Type_PLANE);
+    geo->set_allocated_plane(plane);
+  }
 
   //
   // Material
@@ -341,7 +1534,7 @@ sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos)
   *uri1 = "file://" + fs::absolute(scripts_dir_).string();
   std::string *uri2 = script->add_uri();
   *uri2 = "file://" + fs::absolute(textures_dir_).string();
-  script->set_name(world_img_path_.stem().string());
+  script->set_name(chunk.img_path.stem().string());
 
   gazebo::msgs::Material *material = new gazebo::msgs::Material();
   material->set_allocated_script(script);
@@ -351,7 +1544,7 @@ sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos)
   //
 
   gazebo::msgs::Visual visual;
-  visual.set_name(world_img_path_.stem().string());
+  visual.set_name(chunk.img_path.stem().string());
   visual.set_allocated_geometry(geo);
   visual.set_allocated_pose(pose);
   visual.set_allocated_material(material);
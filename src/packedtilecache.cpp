@@ -0,0 +1,548 @@
+#include "gzsatellite/packedtilecache.h"
+
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace gzsatellite {
+
+namespace fs = boost::filesystem;
+
+static const char PACK_MAGIC[8] = {'G','Z','T','P','A','C','K','1'};
+static const char INDEX_MAGIC[8] = {'G','Z','T','P','I','D','X','1'};
+
+static const uint32_t INITIAL_CAPACITY = 4096;
+
+// ----------------------------------------------------------------------------
+
+static uint64_t hashTile(int x, int y, int z)
+{
+  // splitmix64 finalizer over the packed coordinates
+  uint64_t h = (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32)
+                ^ static_cast<uint32_t>(y) ^ (static_cast<uint64_t>(z) << 58);
+  h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+// ----------------------------------------------------------------------------
+
+static void writeAll(int fd, const char* data, size_t size)
+{
+  while (size > 0) {
+    const ssize_t n = ::write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error(std::string("Tile pack write failed: ") + std::strerror(errno));
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+PackedTileCache::Mapping::~Mapping()
+{
+  if (data) munmap(data, size);
+}
+
+// ----------------------------------------------------------------------------
+
+PackedTileCache::PackedTileCache(const fs::path& dir)
+  : pack_path_(dir/"tiles.pack"), index_path_(dir/"tiles.idx"),
+    pack_fd_(-1), index_fd_(-1)
+{
+  openPack();
+  recover();
+
+  if (!fs::exists(index_path_)) createIndex(index_path_, INITIAL_CAPACITY);
+
+  mapIndex();
+  scanBlobs();
+}
+
+// ----------------------------------------------------------------------------
+
+PackedTileCache::~PackedTileCache()
+{
+  index_.reset();
+  pack_.reset();
+  ::close(index_fd_);
+  ::close(pack_fd_);
+}
+
+// ----------------------------------------------------------------------------
+
+bool PackedTileCache::contains(int x, int y, int z) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return find(x, y, z) != nullptr;
+}
+
+// ----------------------------------------------------------------------------
+
+bool PackedTileCache::read(int x, int y, int z, TileBytes& bytes) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  const Slot* s = find(x, y, z);
+  if (!s) return false;
+
+  // an index entry past the end of the pack (e.g., after a crash) is a miss
+  auto pack = packMapping(s->data_off + s->data_size);
+  if (!pack) return false;
+
+  bytes.data = pack->data + s->data_off;
+  bytes.size = s->data_size;
+  bytes.owner = pack;
+  bytes.digest = (s->digest != 0) ? s->digest : contentDigest(bytes.data, bytes.size);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool PackedTileCache::write(int x, int y, int z, const std::string& data,
+                            const TileMeta& meta)
+{
+  const std::string m = encodeMeta(meta);
+  const uint64_t digest = contentDigest(data.data(), data.size());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Keep the table at most half full so probe sequences stay short
+  if (!find(x, y, z) && 2*(header()->count + 1) > header()->capacity) grow();
+
+  // Reuse an identical blob if there is one. The bytes are compared, so a
+  // digest collision can never alias two different tiles.
+  bool duplicate = false;
+  uint64_t data_off = 0;
+  auto it = blobs_.find(digest);
+  if (it != blobs_.end() && it->second.size == data.size()) {
+    auto pack = packMapping(it->second.off + it->second.size);
+    if (pack && std::memcmp(pack->data + it->second.off, data.data(), data.size()) == 0) {
+      data_off = it->second.off;
+      duplicate = true;
+    }
+  }
+
+  // Blobs go to the pack before the index points at them
+  if (!duplicate) {
+    data_off = append(data.data(), data.size());
+    blobs_[digest] = Blob{data_off, static_cast<uint32_t>(data.size())};
+  }
+  const uint64_t meta_off = append(m.data(), m.size());
+
+  Slot* s = probe(x, y, z);
+  if (!s->used) header()->count++;
+  s->x = x; s->y = y; s->z = z;
+  s->data_off = data_off;
+  s->data_size = data.size();
+  s->meta_off = meta_off;
+  s->meta_size = m.size();
+  s->digest = digest;
+  s->used = 1;
+
+  return duplicate;
+}
+
+// ----------------------------------------------------------------------------
+
+bool PackedTileCache::readMeta(int x, int y, int z, TileMeta& meta) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  const Slot* s = find(x, y, z);
+  if (!s) return false;
+
+  auto pack = packMapping(s->meta_off + s->meta_size);
+  if (!pack) return false;
+
+  decodeMeta(std::string(pack->data + s->meta_off, s->meta_size), meta);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::writeMeta(int x, int y, int z, const TileMeta& meta)
+{
+  const std::string m = encodeMeta(meta);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Slot* s = const_cast<Slot*>(find(x, y, z));
+  if (!s) return;
+
+  s->meta_off = append(m.data(), m.size());
+  s->meta_size = m.size();
+}
+
+// ----------------------------------------------------------------------------
+
+bool PackedTileCache::remove(int x, int y, int z)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Slot* s = const_cast<Slot*>(find(x, y, z));
+  if (!s) return false;
+
+  // Backward-shift deletion keeps every remaining tile reachable from its
+  // home slot without leaving tombstones behind
+  const uint32_t mask = header()->capacity - 1;
+  Slot* table = slots();
+  uint32_t hole = s - table;
+  table[hole].used = 0;
+
+  for (uint32_t j = (hole + 1) & mask; table[j].used; j = (j + 1) & mask) {
+    const uint32_t home = hashTile(table[j].x, table[j].y, table[j].z) & mask;
+
+    // can the entry at j move back into the hole?
+    const bool stays = (hole <= j) ? (hole < home && home <= j)
+                                   : (hole < home || home <= j);
+    if (stays) continue;
+
+    table[hole] = table[j];
+    table[j].used = 0;
+    hole = j;
+  }
+
+  header()->count--;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+uint64_t PackedTileCache::sizeOf(int x, int y, int z) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  const Slot* s = find(x, y, z);
+  return (s) ? s->data_size : 0;
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::list(const std::function<void(int, int, int)>& fn) const
+{
+  // copy the coordinates out first so fn may call back into the cache
+  std::vector<Slot> used;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (uint32_t i=0; i<header()->capacity; i++)
+      if (slots()[i].used) used.push_back(slots()[i]);
+  }
+
+  for (const auto& s : used) fn(s.x, s.y, s.z);
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::compact()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Count the bytes that are still referenced: every unique data blob and
+  // the validators of every tile
+  uint64_t live = sizeof(PACK_MAGIC);
+  std::unordered_map<uint64_t, uint64_t> moved;  // old -> new data offset
+  for (uint32_t i=0; i<header()->capacity; i++) {
+    const Slot& s = slots()[i];
+    if (!s.used) continue;
+    if (moved.emplace(s.data_off, 0).second) live += s.data_size;
+    live += s.meta_size;
+  }
+
+  struct stat st;
+  fstat(pack_fd_, &st);
+  const uint64_t size = st.st_size;
+  if (size - live <= live) return;
+
+  auto pack = packMapping(size);
+  if (!pack) return;
+
+  // Write the live blobs to a new pack and point a copy of the index at them
+  const fs::path pack_tmp = pack_path_.string() + ".tmp";
+  const fs::path index_next = index_path_.string() + ".next";
+  const fs::path index_tmp = index_path_.string() + ".compact";
+  createIndex(index_next, header()->capacity);
+
+  int fd = ::open(pack_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw std::runtime_error("Could not create tile pack " + pack_tmp.string());
+
+  int ifd = ::open(index_next.c_str(), O_RDWR);
+  auto index = map(ifd, sizeof(Header) + header()->capacity*sizeof(Slot), true);
+  ::close(ifd);
+  Slot* table = reinterpret_cast<Slot*>(index->data + sizeof(Header));
+
+  writeAll(fd, PACK_MAGIC, sizeof(PACK_MAGIC));
+  uint64_t off = sizeof(PACK_MAGIC);
+  for (uint32_t i=0; i<header()->capacity; i++) {
+    Slot s = slots()[i];
+    if (!s.used) continue;
+
+    uint64_t& data_off = moved[s.data_off];
+    if (data_off == 0) {
+      writeAll(fd, pack->data + s.data_off, s.data_size);
+      data_off = off;
+      off += s.data_size;
+    }
+
+    writeAll(fd, pack->data + s.meta_off, s.meta_size);
+    s.meta_off = off;
+    off += s.meta_size;
+
+    s.data_off = data_off;
+    table[i] = s;
+  }
+  reinterpret_cast<Header*>(index->data)->count = header()->count;
+
+  fsync(fd);
+  ::close(fd);
+  msync(index->data, index->size, MS_SYNC);
+  index.reset();
+
+  // Commit: once tiles.idx.compact exists, recover() rolls forward
+  fs::rename(index_next, index_tmp);
+
+  pack_.reset();
+  index_.reset();
+  ::close(pack_fd_);
+  ::close(index_fd_);
+  pack_fd_ = index_fd_ = -1;
+
+  fs::rename(pack_tmp, pack_path_);
+  fs::rename(index_tmp, index_path_);
+
+  openPack();
+  mapIndex();
+  scanBlobs();
+}
+
+// ----------------------------------------------------------------------------
+
+size_t PackedTileCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return header()->count;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+PackedTileCache::Slot* PackedTileCache::probe(int x, int y, int z) const
+{
+  const uint32_t mask = header()->capacity - 1;
+  Slot* table = slots();
+
+  // linear probing; the table is never full (see write)
+  for (uint64_t i = hashTile(x, y, z);; i++) {
+    Slot* s = &table[i & mask];
+    if (!s->used || (s->x == x && s->y == y && s->z == z)) return s;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+const PackedTileCache::Slot* PackedTileCache::find(int x, int y, int z) const
+{
+  const Slot* s = probe(x, y, z);
+  return (s->used) ? s : nullptr;
+}
+
+// ----------------------------------------------------------------------------
+
+std::shared_ptr<PackedTileCache::Mapping> PackedTileCache::packMapping(uint64_t end) const
+{
+  if (pack_ && pack_->size >= end) return pack_;
+
+  // The pack has grown since it was last mapped. Views handed out earlier
+  // keep the old mapping alive through their owner pointer.
+  struct stat st;
+  if (fstat(pack_fd_, &st) != 0 || static_cast<uint64_t>(st.st_size) < end)
+    return nullptr;
+
+  pack_ = map(pack_fd_, st.st_size, false);
+  return pack_;
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::scanBlobs()
+{
+  // Remember every unique blob so identical tiles can share it
+  blobs_.clear();
+  for (uint32_t i=0; i<header()->capacity; i++) {
+    const Slot& s = slots()[i];
+    if (s.used && s.digest != 0) blobs_[s.digest] = Blob{s.data_off, s.data_size};
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::openPack()
+{
+  pack_fd_ = ::open(pack_path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (pack_fd_ < 0)
+    throw std::runtime_error("Could not open tile pack " + pack_path_.string());
+
+  // Only one process may write to a pack at a time
+  if (flock(pack_fd_, LOCK_EX | LOCK_NB) != 0) {
+    ::close(pack_fd_);
+    pack_fd_ = -1;
+    throw std::runtime_error("Tile pack " + pack_path_.string() + " is in use by another process");
+  }
+
+  // A new pack starts with its magic so that offset 0 is never a blob
+  struct stat st;
+  fstat(pack_fd_, &st);
+  if (st.st_size == 0) writeAll(pack_fd_, PACK_MAGIC, sizeof(PACK_MAGIC));
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::recover()
+{
+  const fs::path pack_tmp = pack_path_.string() + ".tmp";
+  const fs::path index_tmp = index_path_.string() + ".compact";
+
+  // An index left behind by compact() means the new pack was complete
+  if (fs::exists(index_tmp)) {
+    if (fs::exists(pack_tmp)) {
+      ::close(pack_fd_);
+      fs::rename(pack_tmp, pack_path_);
+      openPack();
+    }
+    fs::rename(index_tmp, index_path_);
+  }
+
+  // Otherwise a partially written pack is simply discarded
+  boost::system::error_code ec;
+  fs::remove(pack_tmp, ec);
+  fs::remove(index_path_.string() + ".next", ec);
+}
+
+// ----------------------------------------------------------------------------
+
+uint64_t PackedTileCache::append(const char* data, size_t size)
+{
+  // O_APPEND: every write lands at the current end of the file
+  const off_t off = lseek(pack_fd_, 0, SEEK_END);
+  writeAll(pack_fd_, data, size);
+  return off;
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::createIndex(const fs::path& path, uint32_t capacity)
+{
+  // Build the index under a temporary name so a crash never leaves a
+  // partially initialized index behind
+  const fs::path tmp = path.string() + ".tmp";
+
+  int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw std::runtime_error("Could not create tile index " + tmp.string());
+
+  Header h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  h.capacity = capacity;
+
+  // slots are zero-filled (i.e., unused) by ftruncate
+  writeAll(fd, reinterpret_cast<const char*>(&h), sizeof(h));
+  if (ftruncate(fd, sizeof(Header) + capacity*sizeof(Slot)) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Could not size tile index " + tmp.string());
+  }
+  ::close(fd);
+
+  fs::rename(tmp, path);
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::mapIndex()
+{
+  index_.reset();
+  if (index_fd_ >= 0) ::close(index_fd_);
+
+  index_fd_ = ::open(index_path_.c_str(), O_RDWR);
+  if (index_fd_ < 0)
+    throw std::runtime_error("Could not open tile index " + index_path_.string());
+
+  struct stat st;
+  fstat(index_fd_, &st);
+  if (static_cast<size_t>(st.st_size) < sizeof(Header))
+    throw std::runtime_error("Tile index " + index_path_.string() + " is truncated");
+
+  index_ = map(index_fd_, st.st_size, true);
+
+  const Header* h = header();
+  if (std::memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+      || h->capacity == 0 || (h->capacity & (h->capacity - 1)) != 0
+      || sizeof(Header) + h->capacity*sizeof(Slot) > static_cast<size_t>(st.st_size))
+    throw std::runtime_error("Tile index " + index_path_.string() + " is corrupt");
+}
+
+// ----------------------------------------------------------------------------
+
+void PackedTileCache::grow()
+{
+  // Copy the live slots out of the current table...
+  std::vector<Slot> live;
+  live.reserve(header()->count);
+  for (uint32_t i=0; i<header()->capacity; i++)
+    if (slots()[i].used) live.push_back(slots()[i]);
+
+  // ...and rehash them into a table twice the size, next to the current
+  // one. It only replaces the current one once it is complete; until then,
+  // a crash leaves it behind for recover() to discard.
+  const fs::path index_next = index_path_.string() + ".next";
+  const uint32_t capacity = 2*header()->capacity;
+  createIndex(index_next, capacity);
+
+  int fd = ::open(index_next.c_str(), O_RDWR);
+  if (fd < 0) throw std::runtime_error("Could not open tile index " + index_next.string());
+  auto current = index_;
+  index_ = map(fd, sizeof(Header) + capacity*sizeof(Slot), true);
+  ::close(fd);
+
+  for (const auto& s : live) *probe(s.x, s.y, s.z) = s;
+  header()->count = live.size();
+  msync(index_->data, index_->size, MS_SYNC);
+
+  boost::system::error_code ec;
+  fs::rename(index_next, index_path_, ec);
+  if (ec) {
+    index_ = current;
+    throw std::runtime_error("Could not replace tile index " + index_path_.string() +
+                             ": " + ec.message());
+  }
+
+  mapIndex();
+}
+
+// ----------------------------------------------------------------------------
+
+std::shared_ptr<PackedTileCache::Mapping> PackedTileCache::map(int fd, size_t size, bool writable)
+{
+  const int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+  void* data = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    throw std::runtime_error(std::string("Could not map tile cache: ") + std::strerror(errno));
+
+  auto m = std::make_shared<Mapping>();
+  m->data = static_cast<char*>(data);
+  m->size = size;
+  return m;
+}
+
+// ----------------------------------------------------------------------------
+
+}
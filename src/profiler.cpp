@@ -0,0 +1,153 @@
+#include "gzsatellite/profiler.h"
+
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace gzsatellite {
+
+constexpr size_t Profiler::MAX_EVENTS;
+
+// ----------------------------------------------------------------------------
+
+Profiler::Profiler()
+  : epoch_(Clock::now())
+{}
+
+// ----------------------------------------------------------------------------
+
+void Profiler::record(const std::string& stage, Clock::time_point start, Clock::time_point end)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  append(stage, start, end);
+}
+
+// ----------------------------------------------------------------------------
+
+void Profiler::Batch::flush()
+{
+  if (spans_.empty()) return;
+
+  std::lock_guard<std::mutex> lock(profiler_->mutex_);
+  for (const auto& span : spans_)
+    profiler_->append(span.stage, span.start, span.end);
+  spans_.clear();
+}
+
+// ----------------------------------------------------------------------------
+
+void Profiler::add(const std::string& counter, double value)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_[counter] += value;
+}
+
+// ----------------------------------------------------------------------------
+
+void Profiler::set(const std::string& counter, double value)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_[counter] = value;
+}
+
+// ----------------------------------------------------------------------------
+
+void Profiler::max(const std::string& counter, double value)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = counters_.find(counter);
+  if (it == counters_.end()) counters_[counter] = value;
+  else it->second = std::max(it->second, value);
+}
+
+// ----------------------------------------------------------------------------
+
+std::map<std::string, Profiler::Stage> Profiler::stages() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stages_;
+}
+
+// ----------------------------------------------------------------------------
+
+std::map<std::string, double> Profiler::counters() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return counters_;
+}
+
+// ----------------------------------------------------------------------------
+
+double Profiler::elapsed() const
+{
+  return std::chrono::duration<double>(Clock::now() - epoch_).count();
+}
+
+// ----------------------------------------------------------------------------
+
+bool Profiler::writeChromeTrace(const boost::filesystem::path& path) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Written next to the final file and renamed into place, so that a
+  // trace is never seen half-written
+  const boost::filesystem::path tmp = path.string() + ".tmp";
+  {
+    std::ofstream out(tmp.string());
+    out << std::fixed << std::setprecision(1)
+        << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+    for (const auto& t : threads_)
+      out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t.second
+          << ", \"args\": {\"name\": \"thread " << t.second << "\"}},\n";
+
+    for (const auto& e : events_)
+      out << "{\"name\": \"" << e.stage << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+          << ", \"ts\": " << e.start << ", \"dur\": " << e.duration << "},\n";
+
+    // The counters as they are now, at the end of the timeline
+    const double now = std::chrono::duration<double, std::micro>(Clock::now() - epoch_).count();
+    out << "{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": 0, \"ts\": " << now
+        << ", \"args\": {";
+    out.unsetf(std::ios::floatfield);
+    out << std::setprecision(15);
+    for (auto it = counters_.begin(); it != counters_.end(); ++it)
+      out << (it == counters_.begin() ? "" : ", ") << "\"" << it->first << "\": " << it->second;
+    out << "}}\n]}\n";
+
+    if (!out.good()) return false;
+  }
+
+  boost::system::error_code ec;
+  boost::filesystem::rename(tmp, path, ec);
+  return !ec;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void Profiler::append(const std::string& stage, Clock::time_point start, Clock::time_point end)
+{
+  const double seconds = std::chrono::duration<double>(end - start).count();
+
+  Stage& s = stages_[stage];
+  s.calls++;
+  s.seconds += seconds;
+
+  if (events_.size() >= MAX_EVENTS) return;
+
+  // Threads are numbered in the order they are first seen
+  auto it = threads_.find(std::this_thread::get_id());
+  if (it == threads_.end())
+    it = threads_.insert(std::make_pair(std::this_thread::get_id(),
+                                        static_cast<unsigned int>(threads_.size()))).first;
+
+  events_.push_back(Event{stage, it->second,
+                          std::chrono::duration<double, std::micro>(start - epoch_).count(),
+                          seconds*1e6});
+}
+
+// ----------------------------------------------------------------------------
+
+}
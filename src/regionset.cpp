@@ -0,0 +1,248 @@
+#include "gzsatellite/regionset.h"
+
+#include <set>
+#include <tuple>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+
+namespace gzsatellite {
+
+RegionSet::RegionSet(const GeoParams& geo, const std::vector<Region>& regions,
+                     const std::string& root, unsigned int quality)
+  : geo_(geo), regions_(regions), root_(root), quality_(quality),
+    profiler_(std::make_shared<Profiler>())
+{
+
+  //
+  // One loader at the origin, whose cache and connections every region shares
+  //
+
+  loader_.reset(new TileLoader(root+"/mapscache", geo.tileserver,
+                                geo.lat, geo.lon, geo.zoom, 0, 0));
+  loader_->setConcurrency(geo.concurrency);
+  loader_->setRefreshAge(geo.refresh_age);
+  loader_->setRateLimit(geo.rate_limit);
+  loader_->setRetries(geo.max_retries);
+  loader_->setCacheBackend(TileCache::backendFromString(geo.cache_backend));
+  loader_->setHttpClient(std::make_shared<HttpClient>(geo.concurrency));
+
+  // ...and likewise for the elevation tiles, over the same connections
+  if (!geo.elevation_server.empty()) {
+    elevation_loader_.reset(new TileLoader(root+"/mapscache", geo.elevation_server,
+                                           geo.lat, geo.lon, geo.elevation_zoom, 0, 0));
+    elevation_loader_->setConcurrency(geo.concurrency);
+    elevation_loader_->setRefreshAge(geo.refresh_age);
+    elevation_loader_->setRateLimit(geo.rate_limit);
+    elevation_loader_->setRetries(geo.max_retries);
+    elevation_loader_->setCacheBackend(TileCache::backendFromString(geo.cache_backend));
+    elevation_loader_->setHttpClient(loader_->httpClient());
+  }
+
+  if (geo.cache_budget_mb > 0) {
+    cache_manager_ = std::make_shared<CacheManager>(root,
+                        static_cast<uint64_t>(geo.cache_budget_mb*1024*1024));
+    loader_->setCacheManager(cache_manager_);
+
+    // The cache manager must know the elevation cache before it is first
+    // used, or it would open the cache a second time
+    if (elevation_loader_) {
+      cache_manager_->attach(elevation_loader_->serviceHash(), elevation_loader_->tileCache());
+      elevation_loader_->setCacheManager(cache_manager_);
+    }
+  }
+
+  TileLoader::latLonToTileCoords(geo.lat, geo.lon, geo.zoom, origin_x_, origin_y_);
+  tile_size_ = loader_->resolution()*TileLoader::imageSize();
+}
+
+// ----------------------------------------------------------------------------
+
+void RegionSet::setStopFlag(const std::shared_ptr<std::atomic<bool>>& stop)
+{
+  // The regions' loaders are made from these
+  loader_->setStopFlag(stop);
+  if (elevation_loader_) elevation_loader_->setStopFlag(stop);
+}
+
+// ----------------------------------------------------------------------------
+
+std::vector<sdf::SDFPtr> RegionSet::createModels()
+{
+  Profiler::Scope scope(profiler_.get(), "regions");
+
+  std::vector<std::unique_ptr<TileLoader>> loaders;
+  for (const auto& r : regions_)
+    loaders.push_back(loader_->forArea(r.lat, r.lon, r.zoom, r.width, r.height));
+
+  std::vector<std::unique_ptr<TileLoader>> elevation;
+  if (elevation_loader_)
+    for (const auto& loader : loaders)
+      elevation.push_back(ModelCreator::elevationTiles(*loader, *elevation_loader_,
+                                                       geo_.elevation_zoom));
+
+  prefetch(loaders);
+  prefetch(elevation);
+
+  // z = 0 is the height at the world origin in every region, so that the
+  // regions' grounds are at consistent heights
+  float datum;
+  double base = geo_.datum;
+  if (elevation_loader_ && std::isnan(base) &&
+      ModelCreator::elevationAt(*elevation_loader_, geo_.lat, geo_.lon, datum))
+    base = datum;
+
+  //
+  // Each region is a world of its own, placed where its centre is relative
+  // to the world origin
+  //
+
+  const GeoConverter converter = geoConverter();
+  std::vector<std::unique_ptr<ModelCreator>> creators(regions_.size());
+  std::vector<const TileLoader*> stitching, meshing;
+  for (size_t i=0; i<regions_.size(); i++) {
+    const Region& r = regions_[i];
+
+    GeoParams geo = geo_;
+    geo.lat = r.lat;
+    geo.lon = r.lon;
+    geo.zoom = r.zoom;
+    geo.width = r.width;
+    geo.height = r.height;
+    geo.datum = base;
+
+    double x, y;
+    converter.convert(GeoConverter::Frame::LATLON, GeoConverter::Frame::LOCAL,
+                      r.lon, r.lat, x, y);
+    geo.shift_x = x/r.width;
+    geo.shift_y = y/r.height;
+
+    try {
+      std::unique_ptr<TileLoader> heights;
+      if (elevation_loader_)
+        heights = elevation_loader_->forArea(r.lat, r.lon, geo.elevation_zoom, 0, 0);
+
+      // The creator takes the loader, which stays where it is
+      const TileLoader* tiles = loaders[i].get();
+      creators[i].reset(new ModelCreator(geo, root_, std::move(loaders[i]), cache_manager_,
+                                         std::move(heights)));
+      if (creators[i]->needsWorldImage()) stitching.push_back(tiles);
+      if (creators[i]->needsTerrain()) meshing.push_back(elevation[i].get());
+    } catch (const std::exception& e) {
+      gzerr << "Failed to create region '" << r.name << "': " << e.what() << std::endl;
+    }
+  }
+
+  // Tiles in more than one region are decoded by whichever region gets
+  // to them first, and handed to the others. Regions whose textures (or
+  // meshes) are there already decode none of them, and don't count.
+  auto shared = sharedTiles(stitching, "tiles");
+  auto shared_elevation = sharedTiles(meshing, "elevation tiles");
+
+  //
+  // Build the regions on a pool of threads, each decoding and encoding on
+  // its share of the cores
+  //
+
+  const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+  const unsigned int nworkers = std::min<size_t>(cores, regions_.size());
+
+  std::vector<sdf::SDFPtr> models(regions_.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < regions_.size(); i = next++) {
+      if (!creators[i]) continue;
+
+      try {
+        ModelCreator& creator = *creators[i];
+        creator.setProfiler(profiler_);
+        creator.setSharedTiles(shared, shared_elevation);
+        creator.setThreads(cores/nworkers);
+        models[i] = creator.createModel(regions_[i].name, quality_);
+      } catch (const std::exception& e) {
+        gzerr << "Failed to create region '" << regions_[i].name << "': " << e.what() << std::endl;
+      }
+      creators[i].reset();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int i=1; i<nworkers; i++) threads.emplace_back(worker);
+  worker();
+  for (auto& t : threads) t.join();
+  return models;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void RegionSet::prefetch(const std::vector<std::unique_ptr<TileLoader>>& loaders)
+{
+  Profiler::Scope scope(profiler_.get(), "prefetch");
+
+  // Regions are fetched one after the other (each on every connection),
+  // each skipping the tiles of the regions before it, so that no tile is
+  // requested (or revalidated) twice. Only the cache keeps the tiles.
+  std::set<std::tuple<int, int, int>> seen;
+  for (const auto& loader : loaders) {
+    const auto wanted = [&seen](const TileLoader::MapTile& tile) {
+      return seen.count(std::make_tuple(tile.x(), tile.y(), tile.z())) == 0;
+    };
+
+    const unsigned int num = loader->numTilesToDownload(wanted);
+    if (num > 0)
+      gzmsg << "Downloading " << num << " tiles for the regions" << std::endl;
+    if (num > 0 || loader->refreshAge() >= 0)
+      loader->loadTiles(true, TileLoader::TileCallback(), wanted);
+
+    int min_x, max_x, min_y, max_y;
+    loader->tileRange(min_x, max_x, min_y, max_y);
+    for (int y = min_y; y <= max_y; y++)
+      for (int x = min_x; x <= max_x; x++)
+        seen.insert(std::make_tuple(x, y, static_cast<int>(loader->zoom())));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+std::shared_ptr<SharedTiles> RegionSet::sharedTiles(
+                              const std::vector<const TileLoader*>& loaders,
+                              const std::string& what)
+{
+  std::set<std::tuple<int, int, int>> overlap;
+  for (size_t i=0; i<loaders.size(); i++) {
+    for (size_t j=i+1; j<loaders.size(); j++) {
+      if (loaders[i]->zoom() != loaders[j]->zoom()) continue;
+
+      int ax0, ax1, ay0, ay1, bx0, bx1, by0, by1;
+      loaders[i]->tileRange(ax0, ax1, ay0, ay1);
+      loaders[j]->tileRange(bx0, bx1, by0, by1);
+      for (int y = std::max(ay0, by0); y <= std::min(ay1, by1); y++)
+        for (int x = std::max(ax0, bx0); x <= std::min(ax1, bx1); x++)
+          overlap.insert(std::make_tuple(x, y, static_cast<int>(loaders[i]->zoom())));
+    }
+  }
+
+  auto shared = std::make_shared<SharedTiles>();
+  for (const auto& t : overlap) {
+    for (const auto& loader : loaders) {
+      int min_x, max_x, min_y, max_y;
+      loader->tileRange(min_x, max_x, min_y, max_y);
+      if (static_cast<int>(loader->zoom()) == std::get<2>(t) &&
+          std::get<0>(t) >= min_x && std::get<0>(t) <= max_x &&
+          std::get<1>(t) >= min_y && std::get<1>(t) <= max_y)
+        shared->want(std::get<0>(t), std::get<1>(t), std::get<2>(t));
+    }
+  }
+
+  if (!overlap.empty())
+    gzmsg << overlap.size() << " " << what << " are in more than one region" << std::endl;
+
+  return shared;
+}
+
+// ----------------------------------------------------------------------------
+
+}
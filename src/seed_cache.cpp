@@ -0,0 +1,204 @@
+/**
+ * seed_cache: download every tile of a lat/lon bounding box over a range
+ * of zoom levels into the tile cache, so that the simulation never has
+ * to touch the network.
+ *
+ * Usage:
+ *    seed_cache [options] <tileserver> <south> <west> <north> <east> <zoom> [max zoom]
+ *
+ * Options:
+ *    --root <dir>          directory holding mapscache/ (./gzsatellite)
+ *    --backend <name>      cache backend: directory or pack (directory)
+ *    --concurrency <n>     concurrent downloads (8)
+ *    --refresh-age <s>     revalidate tiles cached more than s seconds ago
+ *    --rate-limit <r>      at most r requests per second (no limit)
+ *    --retries <n>         retries of a failed request (3)
+ *
+ * Tiles are fetched in blocks by the same TileLoader the plugin uses, so
+ * they land in the same cache layout. Cached tiles are skipped, which
+ * makes an interrupted run resumable: just run it again. Ctrl-C stops
+ * after the current block.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <csignal>
+
+#include "gzsatellite/tileloader.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+// tiles per side of a block loaded at once
+static const int BLOCK_SIZE = 32;
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void onSignal(int)
+{
+  interrupted = 1;
+}
+
+// ----------------------------------------------------------------------------
+
+static void usage(const char* argv0)
+{
+  std::cerr << "Usage: " << argv0 << " [--root <dir>] [--backend directory|pack]"
+               " [--concurrency <n>] [--refresh-age <s>] [--rate-limit <r>] [--retries <n>]"
+               " <tileserver> <south> <west> <north> <east> <zoom> [max zoom]" << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+/// Range of tiles covering the bounding box at a zoom level
+static void tileRange(double south, double west, double north, double east,
+                      unsigned int zoom, int& min_x, int& max_x, int& min_y, int& max_y)
+{
+  // Web mercator doesn't reach the poles
+  const double limit = 85.0511;
+  north = std::min(north, limit);
+  south = std::max(south, -limit);
+
+  double x0, y0, x1, y1;
+  TileLoader::latLonToTileCoords(north, west, zoom, x0, y0);
+  TileLoader::latLonToTileCoords(south, east, zoom, x1, y1);
+
+  const int last = (1 << zoom) - 1;
+  min_x = std::max(0, static_cast<int>(std::floor(x0)));
+  min_y = std::max(0, static_cast<int>(std::floor(y0)));
+  max_x = std::min(last, static_cast<int>(std::floor(x1)));
+  max_y = std::min(last, static_cast<int>(std::floor(y1)));
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  fs::path root = "./gzsatellite";
+  std::string backend = "directory";
+  unsigned int concurrency = 8;
+  double refresh_age = -1;
+  double rate_limit = 0;
+  unsigned int retries = 3;
+  std::vector<std::string> args;
+
+  for (int i=1; i<argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i+1 < argc;
+    if (arg == "--root" && has_value) root = argv[++i];
+    else if (arg == "--backend" && has_value) backend = argv[++i];
+    else if (arg == "--concurrency" && has_value) concurrency = std::stoi(argv[++i]);
+    else if (arg == "--refresh-age" && has_value) refresh_age = std::stod(argv[++i]);
+    else if (arg == "--rate-limit" && has_value) rate_limit = std::stod(argv[++i]);
+    else if (arg == "--retries" && has_value) retries = std::stoi(argv[++i]);
+    else if (arg.compare(0, 2, "--") == 0) { usage(argv[0]); return 1; }
+    else args.push_back(arg);
+  }
+
+  if (args.size() != 6 && args.size() != 7) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::signal(SIGINT, onSignal);
+  std::signal(SIGTERM, onSignal);
+
+  typedef std::chrono::steady_clock Clock;
+
+  try {
+    const std::string tileserver = args[0];
+    const double south = std::stod(args[1]), west = std::stod(args[2]);
+    const double north = std::stod(args[3]), east = std::stod(args[4]);
+    const unsigned int min_zoom = std::stoi(args[5]);
+    const unsigned int max_zoom = (args.size() == 7) ? std::stoi(args[6]) : min_zoom;
+
+    if (south > north || west > east || min_zoom > max_zoom)
+      throw std::invalid_argument("Empty bounding box or zoom range");
+
+    // A loader at the centre of the box, whose cache and connections are
+    // shared by the loaders of every block
+    TileLoader base((root/"mapscache").string(), tileserver,
+                    (south + north)/2, (west + east)/2, min_zoom, 0, 0);
+    base.setConcurrency(concurrency);
+    base.setRefreshAge(refresh_age);
+    base.setRateLimit(rate_limit);
+    base.setRetries(retries);
+    base.setCacheBackend(TileCache::backendFromString(backend));
+    base.setHttpClient(std::make_shared<HttpClient>(concurrency));
+
+    // Keep the plugin's cache budget accounting up to date, if it has one.
+    // Nothing is evicted here.
+    if (fs::exists(root/"cache.ledger"))
+      base.setCacheManager(std::make_shared<CacheManager>(root, UINT64_MAX));
+
+    // Count the tiles first, for the progress report
+    uint64_t total = 0;
+    for (unsigned int z = min_zoom; z <= max_zoom; z++) {
+      int min_x, max_x, min_y, max_y;
+      tileRange(south, west, north, east, z, min_x, max_x, min_y, max_y);
+      total += static_cast<uint64_t>(max_x - min_x + 1)*(max_y - min_y + 1);
+    }
+
+    std::cout << "Seeding " << total << " tiles (zoom " << min_zoom << "-" << max_zoom
+              << ") into " << base.cachePath() << std::endl;
+
+    const auto start = Clock::now();
+    uint64_t done = 0, downloaded = 0, failed = 0, retried = 0;
+
+    for (unsigned int z = min_zoom; z <= max_zoom && !interrupted; z++) {
+      int min_x, max_x, min_y, max_y;
+      tileRange(south, west, north, east, z, min_x, max_x, min_y, max_y);
+
+      for (int by = min_y; by <= max_y && !interrupted; by += BLOCK_SIZE) {
+        for (int bx = min_x; bx <= max_x && !interrupted; bx += BLOCK_SIZE) {
+          auto loader = base.forTileRange(bx, std::min(bx + BLOCK_SIZE - 1, max_x),
+                                          by, std::min(by + BLOCK_SIZE - 1, max_y), z);
+          loader->loadTiles();
+
+          const TileLoader::LoadStats& s = loader->loadStats();
+          done += loader->numTiles();
+          downloaded += s.downloaded;
+          failed += s.failed;
+          retried += s.retries;
+
+          const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+          const double rate = done/std::max(elapsed, 1e-3);
+          std::cout << "\rzoom " << z << ": " << done << "/" << total << " tiles ("
+                    << std::fixed << std::setprecision(1) << 100.0*done/total << "%), "
+                    << downloaded << " downloaded, " << retried << " retried, "
+                    << failed << " failed, "
+                    << std::setprecision(0) << rate << " tiles/s, "
+                    << (total - done)/rate << " s left   " << std::flush;
+        }
+      }
+    }
+    std::cout << std::endl;
+
+    if (base.httpClient()) {
+      HttpClient::Stats s = base.httpClient()->stats();
+      std::cout << "HTTP: " << s.requests << " requests, " << s.handshakes
+                << " new connections, " << s.reused << " reused, " << s.bytes << " bytes, "
+                << s.delayed << " held back by the rate limit"
+                << std::endl;
+    }
+
+    if (interrupted) {
+      std::cout << "Interrupted; run again to resume" << std::endl;
+      return 1;
+    }
+
+    if (failed > 0) {
+      std::cerr << failed << " tiles could not be downloaded; run again to retry" << std::endl;
+      return 1;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
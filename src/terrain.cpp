@@ -0,0 +1,247 @@
+#include "gzsatellite/terrain.h"
+
+#include <fstream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+#include <deque>
+
+namespace gzsatellite {
+
+// ----------------------------------------------------------------------------
+
+cv::Mat decodeTerrarium(const TileBytes& bytes)
+{
+  cv::Mat buf(1, static_cast<int>(bytes.size), CV_8UC1, const_cast<char*>(bytes.data));
+  cv::Mat bgr = cv::imdecode(buf, cv::IMREAD_COLOR);
+  if (bgr.empty()) return cv::Mat();
+
+  cv::Mat heights(bgr.rows, bgr.cols, CV_32F);
+  for (int r=0; r<bgr.rows; r++) {
+    const uint8_t* p = bgr.ptr<uint8_t>(r);
+    float* h = heights.ptr<float>(r);
+    for (int c=0; c<bgr.cols; c++, p+=3)
+      h[c] = p[2]*256.0f + p[1] + p[0]/256.0f - 32768.0f;
+  }
+
+  return heights;
+}
+
+// ----------------------------------------------------------------------------
+
+bool fillHeightHoles(cv::Mat& heights, const cv::Mat& known)
+{
+  // Grow the known heights outwards, one ring of pixels at a time
+  cv::Mat filled = known.clone();
+  std::deque<cv::Point> front;
+  for (int r=0; r<heights.rows; r++)
+    for (int c=0; c<heights.cols; c++)
+      if (filled.at<uint8_t>(r, c)) front.push_back(cv::Point(c, r));
+  if (front.empty()) return false;
+
+  static const int dc[] = {1, -1, 0, 0}, dr[] = {0, 0, 1, -1};
+  while (!front.empty()) {
+    const cv::Point p = front.front();
+    front.pop_front();
+
+    for (int i=0; i<4; i++) {
+      const cv::Point q(p.x + dc[i], p.y + dr[i]);
+      if (q.x < 0 || q.y < 0 || q.x >= heights.cols || q.y >= heights.rows ||
+          filled.at<uint8_t>(q)) continue;
+
+      heights.at<float>(q) = heights.at<float>(p);
+      filled.at<uint8_t>(q) = 1;
+      front.push_back(q);
+    }
+  }
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+float interpolateHeight(const cv::Mat& heights, double x, double y)
+{
+  // Between pixel centres
+  x -= 0.5;
+  y -= 0.5;
+
+  const int x0 = std::min(std::max(0, static_cast<int>(std::floor(x))), heights.cols - 1);
+  const int y0 = std::min(std::max(0, static_cast<int>(std::floor(y))), heights.rows - 1);
+  const int x1 = std::min(x0 + 1, heights.cols - 1);
+  const int y1 = std::min(y0 + 1, heights.rows - 1);
+  const float fx = std::min(std::max(x - x0, 0.0), 1.0);
+  const float fy = std::min(std::max(y - y0, 0.0), 1.0);
+
+  const float* r0 = heights.ptr<float>(y0);
+  const float* r1 = heights.ptr<float>(y1);
+  return (1 - fy)*((1 - fx)*r0[x0] + fx*r0[x1]) + fy*((1 - fx)*r1[x0] + fx*r1[x1]);
+}
+
+// ----------------------------------------------------------------------------
+
+void simplifyHeightGrid(const cv::Mat& heights, float max_error,
+                        std::vector<cv::Point>& vertices,
+                        std::vector<cv::Vec3i>& triangles)
+{
+  const int n = heights.rows;
+  auto h = [&heights](int c, int r) { return heights.ptr<float>(r)[c]; };
+
+  //
+  // Split nodes until the two triangles across each one (split along the
+  // NW-SE diagonal) are within max_error of every height inside it
+  //
+
+  struct Node { int c, r, size; };
+  std::vector<Node> leaves;
+  std::vector<Node> stack(1, Node{0, 0, n - 1});
+  while (!stack.empty()) {
+    const Node node = stack.back();
+    stack.pop_back();
+
+    const int c0 = node.c, r0 = node.r, s = node.size;
+    const float nw = h(c0, r0), ne = h(c0 + s, r0);
+    const float sw = h(c0, r0 + s), se = h(c0 + s, r0 + s);
+
+    float error = 0;
+    for (int r=0; r<=s && error <= max_error; r++) {
+      for (int c=0; c<=s; c++) {
+        const float u = static_cast<float>(c)/s, v = static_cast<float>(r)/s;
+        const float plane = (u >= v) ? nw + u*(ne - nw) + v*(se - ne)
+                                     : nw + v*(sw - nw) + u*(se - sw);
+        error = std::max(error, std::abs(h(c0 + c, r0 + r) - plane));
+      }
+    }
+
+    if (error <= max_error || s == 1) {
+      leaves.push_back(node);
+      continue;
+    }
+
+    const int half = s/2;
+    stack.push_back(Node{c0, r0, half});
+    stack.push_back(Node{c0 + half, r0, half});
+    stack.push_back(Node{c0, r0 + half, half});
+    stack.push_back(Node{c0 + half, r0 + half, half});
+  }
+
+  // Every leaf corner is a vertex, also of the larger leaves beside it
+  std::vector<char> active(n*n, 0);
+  for (const auto& l : leaves) {
+    active[l.r*n + l.c] = active[l.r*n + l.c + l.size] = 1;
+    active[(l.r + l.size)*n + l.c] = active[(l.r + l.size)*n + l.c + l.size] = 1;
+  }
+
+  std::vector<int> index(n*n, -1);
+  auto vertex = [&](int c, int r) {
+    int& i = index[r*n + c];
+    if (i < 0) {
+      i = vertices.size();
+      vertices.push_back(cv::Point(c, r));
+    }
+    return i;
+  };
+
+  //
+  // Triangulate the leaves
+  //
+
+  std::vector<int> ring;
+  for (const auto& l : leaves) {
+    const int c0 = l.c, r0 = l.r, s = l.size;
+
+    // Vertices around the leaf, clockwise from its NW corner (seen from
+    // above, with rows running south)
+    ring.clear();
+    for (int c=c0; c<c0+s; c++)     if (active[r0*n + c]) ring.push_back(vertex(c, r0));
+    for (int r=r0; r<r0+s; r++)     if (active[r*n + c0+s]) ring.push_back(vertex(c0+s, r));
+    for (int c=c0+s; c>c0; c--)     if (active[(r0+s)*n + c]) ring.push_back(vertex(c, r0+s));
+    for (int r=r0+s; r>r0; r--)     if (active[r*n + c0]) ring.push_back(vertex(c0, r));
+
+    if (ring.size() == 4) {
+      // NW, NE, SE, SW: split along NW-SE, as when it was measured
+      triangles.push_back(cv::Vec3i(ring[0], ring[2], ring[1]));
+      triangles.push_back(cv::Vec3i(ring[0], ring[3], ring[2]));
+    } else {
+      // A fan around the centre reaches the smaller neighbours' corners
+      const int centre = vertex(c0 + s/2, r0 + s/2);
+      for (size_t i=0; i<ring.size(); i++)
+        triangles.push_back(cv::Vec3i(centre, ring[(i+1) % ring.size()], ring[i]));
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+bool writeCollada(const boost::filesystem::path& path, const TerrainMesh& mesh)
+{
+  std::ofstream out(path.string());
+  out << std::setprecision(9);
+
+  out << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+         "<COLLADA xmlns=\"http://www.collada.org/2005/11/COLLADASchema\" version=\"1.4.1\">\n"
+         "  <asset>\n"
+         "    <unit name=\"meter\" meter=\"1\"/>\n"
+         "    <up_axis>Z_UP</up_axis>\n"
+         "  </asset>\n"
+         "  <library_geometries>\n"
+         "    <geometry id=\"terrain\" name=\"terrain\">\n"
+         "      <mesh>\n";
+
+  const size_t nv = mesh.vertices.size();
+  out << "        <source id=\"terrain-positions\">\n"
+         "          <float_array id=\"terrain-positions-array\" count=\"" << 3*nv << "\">";
+  for (const auto& v : mesh.vertices) out << v.x << " " << v.y << " " << v.z << " ";
+  out << "</float_array>\n"
+         "          <technique_common>\n"
+         "            <accessor source=\"#terrain-positions-array\" count=\"" << nv << "\" stride=\"3\">\n"
+         "              <param name=\"X\" type=\"float\"/>\n"
+         "              <param name=\"Y\" type=\"float\"/>\n"
+         "              <param name=\"Z\" type=\"float\"/>\n"
+         "            </accessor>\n"
+         "          </technique_common>\n"
+         "        </source>\n";
+
+  out << "        <source id=\"terrain-uvs\">\n"
+         "          <float_array id=\"terrain-uvs-array\" count=\"" << 2*nv << "\">";
+  for (const auto& uv : mesh.uvs) out << uv.x << " " << uv.y << " ";
+  out << "</float_array>\n"
+         "          <technique_common>\n"
+         "            <accessor source=\"#terrain-uvs-array\" count=\"" << nv << "\" stride=\"2\">\n"
+         "              <param name=\"S\" type=\"float\"/>\n"
+         "              <param name=\"T\" type=\"float\"/>\n"
+         "            </accessor>\n"
+         "          </technique_common>\n"
+         "        </source>\n";
+
+  out << "        <vertices id=\"terrain-vertices\">\n"
+         "          <input semantic=\"POSITION\" source=\"#terrain-positions\"/>\n"
+         "        </vertices>\n"
+         "        <triangles count=\"" << mesh.triangles.size() << "\">\n"
+         "          <input semantic=\"VERTEX\" source=\"#terrain-vertices\" offset=\"0\"/>\n"
+         "          <input semantic=\"TEXCOORD\" source=\"#terrain-uvs\" offset=\"0\" set=\"0\"/>\n"
+         "          <p>";
+  for (const auto& t : mesh.triangles) out << t[0] << " " << t[1] << " " << t[2] << " ";
+  out << "</p>\n"
+         "        </triangles>\n"
+         "      </mesh>\n"
+         "    </geometry>\n"
+         "  </library_geometries>\n"
+         "  <library_visual_scenes>\n"
+         "    <visual_scene id=\"scene\">\n"
+         "      <node id=\"terrain-node\">\n"
+         "        <instance_geometry url=\"#terrain\"/>\n"
+         "      </node>\n"
+         "    </visual_scene>\n"
+         "  </library_visual_scenes>\n"
+         "  <scene>\n"
+         "    <instance_visual_scene url=\"#scene\"/>\n"
+         "  </scene>\n"
+         "</COLLADA>\n";
+
+  return out.good();
+}
+
+// ----------------------------------------------------------------------------
+
+}
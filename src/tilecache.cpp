@@ -0,0 +1,351 @@
+#include "gzsatellite/tilecache.h"
+#include "gzsatellite/packedtilecache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+namespace gzsatellite {
+
+namespace fs = boost::filesystem;
+
+std::shared_ptr<TileCache> TileCache::create(Backend backend, const fs::path& dir)
+{
+  fs::create_directories(dir);
+
+  // One instance per cache in this process: a pack is locked by whoever
+  // opens it, and a directory cache's index must see every write
+  static std::mutex mutex;
+  static std::map<std::pair<Backend, std::string>, std::weak_ptr<TileCache>> open;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::weak_ptr<TileCache>& entry = open[std::make_pair(backend, fs::canonical(dir).string())];
+  std::shared_ptr<TileCache> cache = entry.lock();
+  if (cache) return cache;
+
+  if (backend == Backend::PACK)
+    cache = std::make_shared<PackedTileCache>(dir);
+  else
+    cache = std::make_shared<DirectoryTileCache>(dir);
+
+  entry = cache;
+  return cache;
+}
+
+// ----------------------------------------------------------------------------
+
+TileCache::Backend TileCache::backendFromString(const std::string& name)
+{
+  if (name == "directory") return Backend::DIRECTORY;
+  if (name == "pack") return Backend::PACK;
+
+  throw std::invalid_argument("Unknown tile cache backend '" + name + "'");
+}
+
+// ----------------------------------------------------------------------------
+
+uint64_t TileCache::contentDigest(const char* data, size_t size)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i=0; i<size; i++) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 0x100000001b3ULL;
+  }
+
+  // 0 is reserved for "unknown"
+  return (h != 0) ? h : 1;
+}
+
+// ----------------------------------------------------------------------------
+
+std::string TileCache::encodeMeta(const TileMeta& meta)
+{
+  std::ostringstream os;
+  if (!meta.etag.empty()) os << "etag " << meta.etag << "\n";
+  if (!meta.last_modified.empty()) os << "last_modified " << meta.last_modified << "\n";
+  os << "fetched " << static_cast<long long>(meta.fetched) << "\n";
+  return os.str();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileCache::decodeMeta(const std::string& text, TileMeta& meta)
+{
+  std::istringstream in(text);
+
+  // one "key value" pair per line
+  std::string line;
+  while (std::getline(in, line)) {
+    const size_t sp = line.find(' ');
+    if (sp == std::string::npos) continue;
+
+    const std::string key = line.substr(0, sp);
+    const std::string value = line.substr(sp + 1);
+
+    if (key == "etag") meta.etag = value;
+    else if (key == "last_modified") meta.last_modified = value;
+    else if (key == "fetched") {
+      // Validators may have been cut short (e.g., by a crash); a line that
+      // isn't a number is ignored
+      char* end;
+      const long long t = std::strtoll(value.c_str(), &end, 10);
+      if (end != value.c_str() && *end == '\0') meta.fetched = t;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+// DirectoryTileCache
+// ----------------------------------------------------------------------------
+
+DirectoryTileCache::DirectoryTileCache(const fs::path& dir)
+  : dir_(dir), blobs_dir_(dir/"blobs")
+{
+  fs::create_directories(blobs_dir_);
+}
+
+// ----------------------------------------------------------------------------
+
+// Key of tile [x,y] in the presence index
+static uint64_t indexKey(int x, int y)
+{
+  return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+}
+
+// ----------------------------------------------------------------------------
+
+bool DirectoryTileCache::contains(int x, int y, int z) const
+{
+  loadIndex();
+  {
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    if (index_[z].count(indexKey(x, y))) return true;
+  }
+
+  // Not a final answer: the tile may have been added since the listing
+  boost::system::error_code ec;
+  if (!fs::exists(pathForTile(x, y, z), ec)) return false;
+
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  index_[z].insert(indexKey(x, y));
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool DirectoryTileCache::read(int x, int y, int z, TileBytes& bytes) const
+{
+  std::ifstream in(pathForTile(x, y, z).string(), std::ios::binary | std::ios::ate);
+  if (!in) {
+    // Removed behind our back
+    loadIndex();
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    index_[z].erase(indexKey(x, y));
+    return false;
+  }
+
+  auto buf = std::make_shared<std::vector<char>>(static_cast<size_t>(in.tellg()));
+  in.seekg(0);
+  if (!in.read(buf->data(), buf->size())) return false;
+
+  bytes.data = buf->data();
+  bytes.size = buf->size();
+  bytes.owner = buf;
+  bytes.digest = contentDigest(bytes.data, bytes.size);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool DirectoryTileCache::write(int x, int y, int z, const std::string& data,
+                               const TileMeta& meta)
+{
+  const fs::path path = pathForTile(x, y, z);
+  const fs::path blob = blobPath(contentDigest(data.data(), data.size()));
+
+  // Is this exact content already stored? The bytes are compared, so a
+  // digest collision can never alias two different tiles.
+  bool duplicate = false;
+  std::ifstream in(blob.string(), std::ios::binary | std::ios::ate);
+  if (in && static_cast<size_t>(in.tellg()) == data.size()) {
+    std::string contents(data.size(), '\0');
+    in.seekg(0);
+    duplicate = in.read(&contents[0], contents.size()) && contents == data;
+  }
+  in.close();
+
+  // Write to temporary files first so that a refresh never leaves a
+  // half-written tile. Names are unique since workers may race on a blob.
+  const std::string unique = fs::unique_path(".%%%%-%%%%-%%%%.part").string();
+  if (!duplicate) {
+    const fs::path part = blob.string() + unique;
+    std::fstream imgout(part.string(), std::ios::out | std::ios::binary);
+    imgout.write(data.c_str(), data.size());
+    imgout.close();
+    fs::rename(part, blob);
+  }
+
+  // A tile given new content (e.g., by a refresh) leaves its old blob
+  // behind; note which one it is
+  TileBytes old;
+  const bool replacing = read(x, y, z, old);
+
+  // Point the tile at its blob
+  const fs::path part = path.string() + unique;
+  boost::system::error_code ec;
+  fs::create_hard_link(blob, part, ec);
+  if (ec) fs::copy_file(blob, part);
+  fs::rename(part, path);
+
+  // ...and drop the old blob once no other tile links to it, as remove() does
+  if (replacing) {
+    const fs::path old_blob = blobPath(old.digest);
+    if (old_blob != blob && fs::exists(old_blob, ec) && fs::hard_link_count(old_blob, ec) <= 1)
+      fs::remove(old_blob, ec);
+  }
+
+  writeMeta(x, y, z, meta);
+
+  loadIndex();
+  {
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    index_[z].insert(indexKey(x, y));
+  }
+  return duplicate;
+}
+
+// ----------------------------------------------------------------------------
+
+bool DirectoryTileCache::readMeta(int x, int y, int z, TileMeta& meta) const
+{
+  const fs::path path = pathForTile(x, y, z);
+
+  std::ifstream in(path.string() + ".meta");
+  if (!in) {
+    // Tiles cached before validators were kept fall back to their file time
+    boost::system::error_code ec;
+    meta.fetched = fs::last_write_time(path, ec);
+    return !ec;
+  }
+
+  std::ostringstream text;
+  text << in.rdbuf();
+  decodeMeta(text.str(), meta);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void DirectoryTileCache::writeMeta(int x, int y, int z, const TileMeta& meta)
+{
+  // As for tiles, readers (or another process refreshing the same tile)
+  // only ever see a complete file
+  const fs::path path = pathForTile(x, y, z).string() + ".meta";
+  const fs::path part = path.string() + fs::unique_path(".%%%%-%%%%-%%%%.part").string();
+  {
+    std::ofstream out(part.string());
+    out << encodeMeta(meta);
+  }
+
+  boost::system::error_code ec;
+  fs::rename(part, path, ec);
+  if (ec) fs::remove(part, ec);
+}
+
+// ----------------------------------------------------------------------------
+
+bool DirectoryTileCache::remove(int x, int y, int z)
+{
+  TileBytes bytes;
+  if (!read(x, y, z, bytes)) return false;
+
+  const fs::path path = pathForTile(x, y, z);
+  const fs::path blob = blobPath(bytes.digest);
+
+  boost::system::error_code ec;
+  fs::remove(path, ec);
+  fs::remove(path.string() + ".meta", ec);
+
+  loadIndex();
+  {
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    index_[z].erase(indexKey(x, y));
+  }
+
+  // Drop the blob once no other tile links to it
+  if (fs::exists(blob, ec) && fs::hard_link_count(blob, ec) <= 1)
+    fs::remove(blob, ec);
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+uint64_t DirectoryTileCache::sizeOf(int x, int y, int z) const
+{
+  boost::system::error_code ec;
+  const uintmax_t size = fs::file_size(pathForTile(x, y, z), ec);
+  return (ec) ? 0 : size;
+}
+
+// ----------------------------------------------------------------------------
+
+void DirectoryTileCache::list(const std::function<void(int, int, int)>& fn) const
+{
+  for (fs::directory_iterator it(dir_), end; it != end; ++it) {
+    int x, y, z;
+    if (parseName(it->path().filename().string(), x, y, z)) fn(x, y, z);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+fs::path DirectoryTileCache::pathForTile(int x, int y, int z) const
+{
+  std::ostringstream os;
+  os << "x" << x << "_y" << y << "_z" << z << ".jpg";
+  return dir_ / os.str();
+}
+
+// ----------------------------------------------------------------------------
+
+void DirectoryTileCache::loadIndex() const
+{
+  std::call_once(index_once_, [this]() {
+    // One pass over the directory, however many zoom levels are in it
+    std::map<int, std::unordered_set<uint64_t>> index;
+    boost::system::error_code ec;
+    for (fs::directory_iterator dir(dir_, ec), end; !ec && dir != end; dir.increment(ec)) {
+      int x, y, z;
+      if (parseName(dir->path().filename().string(), x, y, z))
+        index[z].insert(indexKey(x, y));
+    }
+
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    index_.swap(index);
+  });
+}
+
+// ----------------------------------------------------------------------------
+
+fs::path DirectoryTileCache::blobPath(uint64_t digest) const
+{
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.jpg", static_cast<unsigned long long>(digest));
+  return blobs_dir_ / name;
+}
+
+// ----------------------------------------------------------------------------
+
+bool DirectoryTileCache::parseName(const std::string& name, int& x, int& y, int& z)
+{
+  int n = 0;
+  return std::sscanf(name.c_str(), "x%d_y%d_z%d.jpg%n", &x, &y, &z, &n) == 3
+          && n == static_cast<int>(name.size());
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -25,19 +25,67 @@ namespace gzsatellite {
 
 namespace fs = boost::filesystem;
 
-static size_t replaceRegex(const boost::regex &ex, std::string &str,
-                           const std::string &replace)
+// RFC 7231 HTTP-date (e.g., "Sun, 06 Nov 1994 08:49:37 GMT"), independent
+// of the current locale
+static std::string httpDate(std::time_t t)
 {
-  std::string::const_iterator start = str.begin(), end = str.end();
-  boost::match_results<std::string::const_iterator> what;
-  boost::match_flag_type flags = boost::match_default;
-  size_t count = 0;
-  while (boost::regex_search(start, end, what, ex, flags)) {
-    str.replace(what.position(), what.length(), replace);
-    start = what[0].second;
-    count++;
-  }
-  return count;
+  static const char* days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  std::tm tm;
+  gmtime_r(&t, &tm);
+
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+                tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  return buf;
+}
+
+// ----------------------------------------------------------------------------
+
+// Retries back off exponentially from this many seconds...
+static const double BASE_RETRY_DELAY = 0.5;
+
+// ...up to this many, which is also the longest Retry-After worth waiting for
+static const double MAX_RETRY_DELAY = 30;
+
+/// Randomized ("full jitter") exponential backoff before retry n (from 0),
+/// so that many workers failing at once don't all retry at once too
+static double retryDelay(unsigned int n)
+{
+  thread_local std::mt19937 rng(std::random_device{}());
+  const double cap = std::min(MAX_RETRY_DELAY, BASE_RETRY_DELAY*std::pow(2.0, n));
+  return std::uniform_real_distribution<double>(0, cap)(rng);
+}
+
+// ----------------------------------------------------------------------------
+
+/// Sleep for seconds, or until stop is set
+static void sleepUnlessStopped(double seconds, const std::atomic<bool>* stop)
+{
+  const auto until = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(seconds));
+  while (!(stop && *stop) && std::chrono::steady_clock::now() < until)
+    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                                  until - std::chrono::steady_clock::now(),
+                                  std::chrono::milliseconds(100)));
+}
+
+// ----------------------------------------------------------------------------
+
+/// Seconds to wait according to a Retry-After header, which is either a
+/// number of seconds or an HTTP-date
+static double parseRetryAfter(const std::string& value)
+{
+  char* end;
+  const double seconds = std::strtod(value.c_str(), &end);
+  if (end != value.c_str() && *end == '\0') return std::max(0.0, seconds);
+
+  std::tm tm = {};
+  if (strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) == nullptr) return 0;
+  return std::max(0.0, std::difftime(timegm(&tm), std::time(nullptr)));
 }
 
 // ----------------------------------------------------------------------------
@@ -46,7 +94,8 @@ TileLoader::TileLoader(const std::string& cacheRoot, const std::string& service,
                        double latitude, double longitude,
                        unsigned int zoom, double width, double height)
     : latitude_(latitude), longitude_(longitude), zoom_(zoom),
-      width_(width), height_(height), object_uri_(service)
+      width_(width), height_(height), object_uri_(service), url_template_(service),
+      concurrency_(1), refresh_age_(-1), rate_limit_(0), max_retries_(3)
 {
 
   //
@@ -59,63 +108,71 @@ TileLoader::TileLoader(const std::string& cacheRoot, const std::string& service,
 
   // Create the directory structure for the tile images
   cache_path_ = fs::absolute(fs::path(cacheRoot + "/" + service_hash_));
-  fs::create_directories(cache_path_);
-
-
-  //
-  // Calculate center tile coordinates
-  //
-
-  double x, y;
-  latLonToTileCoords(latitude_, longitude_, zoom_, x, y);
-  center_tile_x_ = std::floor(x);
-  center_tile_y_ = std::floor(y);
+  cache_ = TileCache::create(TileCache::Backend::DIRECTORY, cache_path_);
 
-  // fractional component
-  origin_offset_x_ = x - center_tile_x_;
-  origin_offset_y_ = y - center_tile_y_;
-
-  // std::cout << "[DBG] center tile x: " << center_tile_x_ << std::endl;
-  // std::cout << "[DBG] center tile y: " << center_tile_y_ << std::endl;
-
-  // std::cout << "[DBG] origin offset x: " << origin_offset_x_ << std::endl;
-  // std::cout << "[DBG] origin offset y: " << origin_offset_y_ << std::endl;
+  setArea(latitude, longitude, zoom, width, height);
+}
 
-  //
-  // Determine how many tiles around the center tile are needed
-  //
+// ----------------------------------------------------------------------------
 
-  // Based on width/height, how many x block and y blocks?
-  const double width_px = width / resolution();
-  const double height_px = height / resolution();
+TileLoader::~TileLoader()
+{
+  releaseTiles();
+}
 
-  const double width_pct = width_px / imageSize();
-  const double height_pct = height_px / imageSize();
+// ----------------------------------------------------------------------------
 
-  const double x_high_pct = origin_offset_x_ + width_pct/2;
-  const double x_low_pct = origin_offset_x_ - width_pct/2;
-  const double y_high_pct = origin_offset_y_ + height_pct/2;
-  const double y_low_pct = origin_offset_y_ - height_pct/2;
+std::unique_ptr<TileLoader> TileLoader::forArea(double latitude, double longitude,
+                                                unsigned int zoom,
+                                                double width, double height) const
+{
+  std::unique_ptr<TileLoader> loader(new TileLoader(*this));
+  loader->tiles_.clear();
+  loader->failed_tiles_.clear();
+  loader->pinned_.clear();
+  loader->misses_.clear();
+  loader->setArea(latitude, longitude, zoom, width, height);
+  return loader;
+}
 
-  x_tiles_above_ =          std::floor(x_high_pct);
-  x_tiles_below_ = std::abs(std::floor(x_low_pct));
-  y_tiles_above_ =          std::floor(y_high_pct);
-  y_tiles_below_ = std::abs(std::floor(y_low_pct));
+// ----------------------------------------------------------------------------
 
-  // std::cout << std::endl;
-  // std::cout << "Resolution (m/px): " << resolution() << std::endl;
-  // std::cout << "Width, Height (px): " << width_px << ", " << height_px << std::endl;
-  // std::cout << "Width, Height (%): " << width_pct << ", " << height_pct << std::endl;
-  // std::cout << "X: Low, High (%): " << x_low_pct << ", " << x_high_pct << std::endl;
-  // std::cout << "Y: Low, High (%): " << y_low_pct << ", " << y_high_pct << std::endl;
-  // std::cout << "X: Below, Above (tiles): " << x_tiles_below_ << ", " << x_tiles_above_ << std::endl;
-  // std::cout << "Y: Below, Above (tiles): " << y_tiles_below_ << ", " << y_tiles_above_ << std::endl;
-  // std::cout << std::endl;
+std::unique_ptr<TileLoader> TileLoader::forTileRange(int min_x, int max_x,
+                                                     int min_y, int max_y,
+                                                     unsigned int zoom) const
+{
+  std::unique_ptr<TileLoader> loader(new TileLoader(*this));
+  loader->tiles_.clear();
+  loader->failed_tiles_.clear();
+  loader->pinned_.clear();
+  loader->misses_.clear();
+  loader->zoom_ = zoom;
+
+  // Anchor the range at its NW tile
+  loader->center_tile_x_ = min_x;
+  loader->center_tile_y_ = min_y;
+  loader->origin_offset_x_ = 0;
+  loader->origin_offset_y_ = 0;
+  loader->x_tiles_below_ = 0;
+  loader->y_tiles_below_ = 0;
+  loader->x_tiles_above_ = max_x - min_x;
+  loader->y_tiles_above_ = max_y - min_y;
+
+  // Describe the range by its centre and size (which also makes its hash
+  // unique)
+  tileCoordsToLatLon((min_x + max_x + 1)/2.0, (min_y + max_y + 1)/2.0, zoom,
+                     loader->latitude_, loader->longitude_);
+  loader->width_ = (max_x - min_x + 1)*imageSize()*loader->resolution();
+  loader->height_ = (max_y - min_y + 1)*imageSize()*loader->resolution();
+
+  return loader;
 }
 
 // ----------------------------------------------------------------------------
 
-const std::vector<TileLoader::MapTile>& TileLoader::loadTiles(bool download)
+const std::vector<TileLoader::MapTile>& TileLoader::loadTiles(bool download,
+                                                             const TileCallback& on_tile,
+                                                             const TileFilter& wanted)
 {
   // discard previous set of tiles and all pending requests
   abort();
@@ -124,39 +181,182 @@ const std::vector<TileLoader::MapTile>& TileLoader::loadTiles(bool download)
   int min_x, max_x, min_y, max_y;
   tileRange(min_x, max_x, min_y, max_y);
 
-  // initiate blocking requests
-  for (int y = min_y; y <= max_y; y++) {
-    for (int x = min_x; x <= max_x; x++) {
-      // Generate filename
-      const fs::path full_path = cachedPathForTile(x, y, zoom_);
-
-      // Check if tile is already in the cache (or if we shouldn't download)
-      if (fs::exists(full_path) || !download) {
-        tiles_.push_back(MapTile(x, y, zoom_, full_path));
+  // Enumerate the tiles in row-major order, which is the order that
+  // ModelCreator::stitchTiles() expects them to be in.
+  std::vector<MapTile> grid;
+  for (int y = min_y; y <= max_y; y++)
+    for (int x = min_x; x <= max_x; x++)
+      grid.push_back(MapTile(x, y, zoom_, cache_->pathForTile(x, y, zoom_)));
+
+  // Check if tile is already in the cache (or if we shouldn't download).
+  // Cached tiles that are due for a refresh are revalidated instead.
+  // Flags are chars (not bools) so that workers can write them concurrently.
+  std::vector<char> loaded(grid.size(), 1);
+  std::vector<char> cached(grid.size(), 1);
+  std::vector<char> skipped(grid.size(), 0);
+  std::vector<size_t> pending;
+  for (size_t i=0; i<grid.size(); i++) {
+    if (wanted && !wanted(grid[i])) {
+      loaded[i] = cached[i] = 0;
+      skipped[i] = 1;
+      continue;
+    }
 
-      } else {
-        const std::string url = uriForTile(x, y);
+    if (!download) continue;
 
-        // send blocking request
-        auto r = cpr::Get(cpr::Url{url});
+    // Tiles numTilesToDownload() just found missing aren't looked up again
+    cached[i] = !misses_.count(std::make_pair(grid[i].x(), grid[i].y())) &&
+                cache_->contains(grid[i].x(), grid[i].y(), grid[i].z());
+    if (!cached[i] || needsRefresh(grid[i])) {
+      loaded[i] = cached[i];
+      pending.push_back(i);
+    }
+  }
+  misses_.clear();
+
+  // Persistent connections are reused across tiles (and loadTiles calls)
+  if (!pending.empty() && !http_)
+    http_ = std::make_shared<HttpClient>(concurrency_);
+
+  // Allow bursts of one request per worker. The limit is for the whole
+  // tile server, however many hosts ({s}) its tiles are spread across.
+  if (http_ && rate_limit_ > 0)
+    http_->setRateLimit(url_template_.pattern(), rate_limit_, concurrency_);
+
+  // Hand a loaded tile's image to the caller
+  auto deliver = [&](size_t i) {
+    TileBytes bytes;
+    if (on_tile && cache_->read(grid[i].x(), grid[i].y(), grid[i].z(), bytes))
+      on_tile(grid[i], bytes);
+  };
+
+  // Downloaded tiles are written to the cache in the background, so the
+  // workers can hand their bodies straight to the caller and move on.
+  struct Write
+  {
+    size_t i;
+    std::shared_ptr<std::string> body;
+    TileMeta meta;
+  };
+  BoundedQueue<Write> writes(256);
+  std::atomic<unsigned int> duplicates(0), failed(0);
+  std::thread writer([&]() {
+    Write w;
+    while (writes.pop(w)) {
+      try {
+        if (cache_->write(grid[w.i].x(), grid[w.i].y(), grid[w.i].z(), *w.body, w.meta))
+          duplicates++;
+      } catch (const std::exception& e) {
+        std::cerr << "Failed caching tile [" << grid[w.i].x() << "," << grid[w.i].y() << ","
+                  << grid[w.i].z() << "]: " << e.what() << std::endl;
+        loaded[w.i] = cached[w.i];
+        failed++;
+      }
+    }
+  });
+
+  // Each worker pulls the next pending tile until there are none left
+  std::atomic<size_t> next(0);
+  std::atomic<unsigned int> downloaded(0), not_modified(0), retries(0);
+  auto worker = [&]() {
+    for (size_t k = next++; k < pending.size(); k = next++) {
+      // The remaining tiles fail (or keep their stale copies)
+      if (stopped()) {
+        failed++;
+        if (loaded[pending[k]]) deliver(pending[k]);
+        continue;
+      }
 
-        // process the response
-        if (r.status_code == 200) {
-          // Save the response text (which is image data) as a binary
-          std::fstream imgout(full_path.string(), std::ios::out | std::ios::binary);
-          imgout.write(r.text.c_str(), r.text.size());
-          imgout.close();
+      const size_t i = pending[k];
+      auto body = std::make_shared<std::string>();
+      TileMeta meta;
+      unsigned int n = 0;
+      Fetch fetch = Fetch::FAILED;
+      try {
+        fetch = downloadTile(grid[i], cached[i], *body, meta, n);
+      } catch (const std::exception& e) {
+        // e.g., the cache's files could not be updated
+        std::cerr << "Failed loading tile [" << grid[i].x() << "," << grid[i].y() << ","
+                  << grid[i].z() << "]: " << e.what() << std::endl;
+        body->clear();
+      }
+      retries += n;
+      switch (fetch) {
+        case Fetch::DOWNLOADED:   loaded[i] = 1; downloaded++;   break;
+        case Fetch::NOT_MODIFIED: loaded[i] = 1; not_modified++; break;
+        case Fetch::FAILED:       failed++;                      break;
+      }
 
-          // Let everyone know we have an image for this tile
-          tiles_.push_back(MapTile(x, y, zoom_, full_path));
+      // A stale copy is still better than nothing if revalidation failed
+      if (body->empty()) {
+        if (loaded[i]) deliver(i);
+        continue;
+      }
 
-        } else {
-          std::cerr << "Failed loading " << r.url << " with code " << r.status_code << std::endl;
-        }
+      if (on_tile) {
+        TileBytes bytes;
+        bytes.data = body->data();
+        bytes.size = body->size();
+        bytes.digest = TileCache::contentDigest(bytes.data, bytes.size);
+        bytes.owner = body;
+        on_tile(grid[i], bytes);
       }
+
+      writes.push(Write{i, body, meta});
+    }
+  };
+
+  // initiate blocking requests on a bounded pool of workers. With a
+  // callback, even a single worker runs in the background so that cached
+  // tiles are handed out while the others download.
+  const size_t nworkers = std::min<size_t>(concurrency_, pending.size());
+  const bool background = nworkers > 1 || (nworkers == 1 && on_tile);
+  std::vector<std::thread> workers;
+  if (background)
+    for (size_t i=0; i<nworkers; i++) workers.emplace_back(worker);
+
+  for (size_t i=0, k=0; i<grid.size(); i++) {
+    if (k < pending.size() && pending[k] == i) { k++; continue; }
+    if (!skipped[i]) deliver(i);
+  }
+
+  if (!background) worker();
+  for (auto& t : workers) t.join();
+
+  // Every tile is on disk once the writer has drained its queue
+  writes.close();
+  writer.join();
+
+  // Let everyone know which tiles have an image, and which don't even
+  // though they should
+  failed_tiles_.clear();
+  for (size_t i=0; i<grid.size(); i++) {
+    if (loaded[i]) tiles_.push_back(grid[i]);
+    else if (download && !skipped[i]) failed_tiles_.push_back(grid[i]);
+  }
+
+  // Every tile read from the cache (or added to it) counts as used, and
+  // none of them gets evicted until they are released
+  if (cache_manager_) {
+    cache_manager_->attach(service_hash_, cache_);
+    for (size_t i=0; i<grid.size(); i++) {
+      if (!loaded[i]) continue;
+      if (!download && !cache_->contains(grid[i].x(), grid[i].y(), grid[i].z())) continue;
+
+      cache_manager_->touchTile(service_hash_, grid[i].x(), grid[i].y(), grid[i].z(), cached[i]);
+      pinned_.push_back(grid[i]);
     }
   }
 
+  load_stats_ = LoadStats();
+  load_stats_.skipped = std::count(skipped.begin(), skipped.end(), 1);
+  load_stats_.cached = grid.size() - pending.size() - load_stats_.skipped;
+  load_stats_.downloaded = downloaded;
+  load_stats_.not_modified = not_modified;
+  load_stats_.failed = failed;
+  load_stats_.retries = retries;
+  load_stats_.duplicates = duplicates;
+
   return tiles_;
 }
 
@@ -231,20 +431,59 @@ void TileLoader::abort()
 
 // ----------------------------------------------------------------------------
 
-const int TileLoader::numTilesToDownload() const
+void TileLoader::setCacheBackend(TileCache::Backend backend)
+{
+  cache_ = TileCache::create(backend, cache_path_);
+}
+
+// ----------------------------------------------------------------------------
+
+void TileLoader::releaseTiles()
+{
+  if (cache_manager_)
+    for (const auto& tile : pinned_)
+      cache_manager_->unpinTile(service_hash_, tile.x(), tile.y(), tile.z());
+  pinned_.clear();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileLoader::touchTiles() const
+{
+  if (!cache_manager_) return;
+
+  int min_x, max_x, min_y, max_y;
+  tileRange(min_x, max_x, min_y, max_y);
+  for (int y = min_y; y <= max_y; y++)
+    for (int x = min_x; x <= max_x; x++)
+      cache_manager_->refreshTile(service_hash_, x, y, zoom_);
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileLoader::readTile(const MapTile& tile, TileBytes& bytes) const
+{
+  return cache_->read(tile.x(), tile.y(), tile.z(), bytes);
+}
+
+// ----------------------------------------------------------------------------
+
+const int TileLoader::numTilesToDownload(const TileFilter& wanted) const
 {
   // determine what range of tiles we can load
   int min_x, max_x, min_y, max_y;
   tileRange(min_x, max_x, min_y, max_y);
 
-  // Simply count how many tiles don't have an image on file
-  unsigned int n = 0;
+  // Simply count how many (wanted) tiles don't have an image on file,
+  // remembering them for loadTiles()
+  misses_.clear();
   for (int y = min_y; y <= max_y; y++)
     for (int x = min_x; x <= max_x; x++)
-      if (!fs::exists(cachedPathForTile(x, y, zoom_)))
-        n++;
+      if ((!wanted || wanted(MapTile(x, y, zoom_, fs::path()))) &&
+          !cache_->contains(x, y, zoom_))
+        misses_.insert(std::make_pair(x, y));
 
-  return n;
+  return misses_.size();
 }
 
 // ----------------------------------------------------------------------------
@@ -283,34 +522,147 @@ const std::string TileLoader::hash() const
 // Private Methods
 // ----------------------------------------------------------------------------
 
-std::string TileLoader::uriForTile(int x, int y) const
+void TileLoader::setArea(double latitude, double longitude, unsigned int zoom,
+                         double width, double height)
 {
-  std::string object = object_uri_;
-  //  place {x},{y},{z} with appropriate values
-  replaceRegex(boost::regex("\\{x\\}", boost::regex::icase), object,
-               std::to_string(x));
-  replaceRegex(boost::regex("\\{y\\}", boost::regex::icase), object,
-               std::to_string(y));
-  replaceRegex(boost::regex("\\{z\\}", boost::regex::icase), object,
-               std::to_string(zoom_));
-  return object;
+  latitude_ = latitude;
+  longitude_ = longitude;
+  zoom_ = zoom;
+  width_ = width;
+  height_ = height;
+
+  //
+  // Calculate center tile coordinates
+  //
+
+  double x, y;
+  latLonToTileCoords(latitude_, longitude_, zoom_, x, y);
+  center_tile_x_ = std::floor(x);
+  center_tile_y_ = std::floor(y);
+
+  // fractional component
+  origin_offset_x_ = x - center_tile_x_;
+  origin_offset_y_ = y - center_tile_y_;
+
+  // std::cout << "[DBG] center tile x: " << center_tile_x_ << std::endl;
+  // std::cout << "[DBG] center tile y: " << center_tile_y_ << std::endl;
+
+  // std::cout << "[DBG] origin offset x: " << origin_offset_x_ << std::endl;
+  // std::cout << "[DBG] origin offset y: " << origin_offset_y_ << std::endl;
+
+  //
+  // Determine how many tiles around the center tile are needed
+  //
+
+  // Based on width/height, how many x block and y blocks?
+  const double width_px = width / resolution();
+  const double height_px = height / resolution();
+
+  const double width_pct = width_px / imageSize();
+  const double height_pct = height_px / imageSize();
+
+  const double x_high_pct = origin_offset_x_ + width_pct/2;
+  const double x_low_pct = origin_offset_x_ - width_pct/2;
+  const double y_high_pct = origin_offset_y_ + height_pct/2;
+  const double y_low_pct = origin_offset_y_ - height_pct/2;
+
+  x_tiles_above_ =          std::floor(x_high_pct);
+  x_tiles_below_ = std::abs(std::floor(x_low_pct));
+  y_tiles_above_ =          std::floor(y_high_pct);
+  y_tiles_below_ = std::abs(std::floor(y_low_pct));
+
+  // std::cout << std::endl;
+  // std::cout << "Resolution (m/px): " << resolution() << std::endl;
+  // std::cout << "Width, Height (px): " << width_px << ", " << height_px << std::endl;
+  // std::cout << "Width, Height (%): " << width_pct << ", " << height_pct << std::endl;
+  // std::cout << "X: Low, High (%): " << x_low_pct << ", " << x_high_pct << std::endl;
+  // std::cout << "Y: Low, High (%): " << y_low_pct << ", " << y_high_pct << std::endl;
+  // std::cout << "X: Below, Above (tiles): " << x_tiles_below_ << ", " << x_tiles_above_ << std::endl;
+  // std::cout << "Y: Below, Above (tiles): " << y_tiles_below_ << ", " << y_tiles_above_ << std::endl;
+  // std::cout << std::endl;
 }
 
 // ----------------------------------------------------------------------------
 
-std::string TileLoader::cachedNameForTile(int x, int y, int z) const
+TileLoader::Fetch TileLoader::downloadTile(const MapTile& tile, bool revalidate,
+                                           std::string& body, TileMeta& meta,
+                                           unsigned int& retries) const
 {
-  std::ostringstream os;
-  os << "x" << x << "_y" << y << "_z" << z << ".jpg";
-  return os.str();
+  const std::string url = uriForTile(tile.x(), tile.y());
+
+  // When revalidating, only ask for the body if the tile has changed
+  std::vector<std::string> headers;
+  if (revalidate) {
+    cache_->readMeta(tile.x(), tile.y(), tile.z(), meta);
+
+    if (!meta.etag.empty())
+      headers.push_back("If-None-Match: " + meta.etag);
+
+    if (!meta.last_modified.empty())
+      headers.push_back("If-Modified-Since: " + meta.last_modified);
+    else if (meta.etag.empty())
+      headers.push_back("If-Modified-Since: " + httpDate(meta.fetched));
+  }
+
+  // send blocking requests until one succeeds, fails for good or the
+  // retries run out
+  HttpResponse r;
+  for (retries = 0; ; retries++) {
+    r = http_->get(url, headers, stop_.get(), url_template_.pattern());
+
+    // Transfer errors, throttling and server errors may go away
+    const bool transient = r.status_code == 0 || r.status_code == 429 ||
+                           r.status_code >= 500;
+    if (!transient || retries >= max_retries_ || stopped()) break;
+
+    double delay = retryDelay(retries);
+    auto it = r.headers.find("retry-after");
+    if (it != r.headers.end()) {
+      const double after = parseRetryAfter(it->second);
+      if (after > MAX_RETRY_DELAY) break;   // not worth waiting for
+      delay = std::max(delay, after);
+    }
+    sleepUnlessStopped(delay, stop_.get());
+  }
+
+  // keep whatever validators the server sent back
+  auto header = [&r](const std::string& name, std::string& value) {
+    auto it = r.headers.find(name);
+    if (it != r.headers.end()) value = it->second;
+  };
+  header("etag", meta.etag);
+  header("last-modified", meta.last_modified);
+  meta.fetched = std::time(nullptr);
+
+  // process the response
+  if (r.status_code == 304 && revalidate) {
+    cache_->writeMeta(tile.x(), tile.y(), tile.z(), meta);
+    return Fetch::NOT_MODIFIED;
+  }
+
+  if (r.status_code == 200) {
+    // Hand over the response body (which is image data) for caching
+    body.swap(r.body);
+    return Fetch::DOWNLOADED;
+  }
+
+  std::cerr << "Failed loading " << r.url << " with code " << r.status_code;
+  if (!r.error.empty()) std::cerr << " (" << r.error << ")";
+  if (retries > 0) std::cerr << " after " << retries + 1 << " attempts";
+  std::cerr << std::endl;
+  return Fetch::FAILED;
 }
 
 // ----------------------------------------------------------------------------
 
-fs::path TileLoader::cachedPathForTile(int x, int y, int z) const
+bool TileLoader::needsRefresh(const MapTile& tile) const
 {
-  fs::path p = cache_path_ / cachedNameForTile(x, y, z);
-  return p;
+  if (refresh_age_ < 0) return false;
+
+  TileMeta meta;
+  cache_->readMeta(tile.x(), tile.y(), tile.z(), meta);
+
+  return std::difftime(std::time(nullptr), meta.fetched) >= refresh_age_;
 }
 
 // ----------------------------------------------------------------------------
@@ -0,0 +1,322 @@
+#include "gzsatellite/tilepager.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace gzsatellite {
+
+namespace fs = boost::filesystem;
+
+TilePager::TilePager(const GeoParams& geo, const PagingParams& params,
+                     const std::string& root, const std::string& name,
+                     unsigned int quality)
+  : geo_(geo), params_(params), root_(root), name_(name), quality_(quality),
+    profiler_(std::make_shared<Profiler>()),
+    stop_(false), cancel_(std::make_shared<std::atomic<bool>>(false)),
+    x_(0), y_(0), ahead_x_(0), ahead_y_(0), moved_(false)
+{
+  params_.page_tiles = std::max(1, params_.page_tiles);
+
+  // Page meshes would not meet at the seams
+  if (!geo_.elevation_server.empty()) {
+    gzwarn << "Terrain is not supported with paging; the ground is flat" << std::endl;
+    geo_.elevation_server.clear();
+  }
+
+  //
+  // One loader at the origin, whose cache and connections every page shares
+  //
+
+  loader_.reset(new TileLoader(root+"/mapscache", geo.tileserver,
+                                geo.lat, geo.lon, geo.zoom, 0, 0));
+  loader_->setConcurrency(geo.concurrency);
+  loader_->setRefreshAge(geo.refresh_age);
+  loader_->setRateLimit(geo.rate_limit);
+  loader_->setRetries(geo.max_retries);
+  loader_->setCacheBackend(TileCache::backendFromString(geo.cache_backend));
+  loader_->setHttpClient(std::make_shared<HttpClient>(geo.concurrency));
+  loader_->setStopFlag(cancel_);
+
+  if (geo.cache_budget_mb > 0) {
+    cache_manager_ = std::make_shared<CacheManager>(root,
+                        static_cast<uint64_t>(geo.cache_budget_mb*1024*1024));
+    loader_->setCacheManager(cache_manager_);
+  }
+
+  // Pages are laid out in tile coordinates, scaled at the origin's latitude
+  TileLoader::latLonToTileCoords(geo.lat, geo.lon, geo.zoom, origin_x_, origin_y_);
+  tile_size_ = loader_->resolution()*TileLoader::imageSize();
+
+  thread_ = std::thread(&TilePager::run, this);
+}
+
+// ----------------------------------------------------------------------------
+
+TilePager::~TilePager()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  *cancel_ = true;
+  cv_.notify_all();
+
+  // waits for the page being built, if any, to give up
+  thread_.join();
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePager::update(double x, double y, double vx, double vy)
+{
+  const double ahead_x = x + vx*params_.prefetch_time;
+  const double ahead_y = y + vy*params_.prefetch_time;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Nothing changes until the vehicle has moved a bit
+  if (moved_ && std::hypot(x - x_, y - y_) < 1.0
+             && std::hypot(ahead_x - ahead_x_, ahead_y - ahead_y_) < 1.0) return;
+
+  x_ = x;
+  y_ = y;
+  ahead_x_ = ahead_x;
+  ahead_y_ = ahead_y;
+  moved_ = true;
+
+  // Queue pages around where the vehicle is and where it is heading
+  std::vector<Page> wanted;
+  pagesAround(x_, y_, params_.radius, wanted);
+  pagesAround(ahead_x_, ahead_y_, params_.radius, wanted);
+
+  bool queued = false;
+  for (const auto& page : wanted) {
+    if (pages_.count(page)) continue;
+    pages_[page] = State::QUEUED;
+    queued = true;
+  }
+
+  // Drop pages that are well out of range (the margin keeps pages near the
+  // boundary from being loaded and unloaded over and over)
+  const double keep = params_.radius*params_.unload_factor;
+  for (auto it = pages_.begin(); it != pages_.end();) {
+    if (distance(it->first, x_, y_) <= keep ||
+        distance(it->first, ahead_x_, ahead_y_) <= keep) { ++it; continue; }
+
+    if (it->second == State::LOADED) {
+      unload_.push_back(pageName(it->first));
+    } else if (it->second == State::READY) {
+      const Page page = it->first;
+      ready_.erase(std::remove_if(ready_.begin(), ready_.end(),
+                     [&page](const std::pair<Page, sdf::SDFPtr>& r) { return r.first == page; }),
+                   ready_.end());
+    }
+
+    // a page being built is discarded once it is done
+    release(it->first);
+    it = pages_.erase(it);
+  }
+
+  if (queued) cv_.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePager::poll(std::vector<sdf::SDFPtr>& load, std::vector<std::string>& unload)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  for (const auto& r : ready_) {
+    pages_[r.first] = State::LOADED;
+    load.push_back(r.second);
+  }
+  ready_.clear();
+
+  unload.insert(unload.end(), unload_.begin(), unload_.end());
+  unload_.clear();
+}
+
+// ----------------------------------------------------------------------------
+
+size_t TilePager::numLoaded() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::count_if(pages_.begin(), pages_.end(),
+                       [](const std::pair<const Page, State>& p) { return p.second == State::LOADED; });
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void TilePager::run()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    // Build the queued page closest to the vehicle (now or soon)
+    auto next = pages_.end();
+    double best = std::numeric_limits<double>::infinity();
+    for (auto it = pages_.begin(); it != pages_.end(); ++it) {
+      if (it->second != State::QUEUED) continue;
+
+      const double d = std::min(distance(it->first, x_, y_),
+                                distance(it->first, ahead_x_, ahead_y_));
+      if (d < best) { best = d; next = it; }
+    }
+
+    if (stop_) return;
+
+    if (next == pages_.end()) {
+      cv_.wait(lock);
+      continue;
+    }
+
+    const Page page = next->first;
+    next->second = State::BUILDING;
+
+    lock.unlock();
+    sdf::SDFPtr sdf;
+    std::vector<fs::path> textures;
+    try {
+      sdf = buildPage(page, textures);
+    } catch (const std::exception& e) {
+      if (!*cancel_)
+        gzerr << "Failed to build page " << pageName(page) << ": " << e.what() << std::endl;
+    }
+    lock.lock();
+    textures_[page] = textures;
+
+    // The vehicle may have moved on in the meantime
+    auto it = pages_.find(page);
+    if (it == pages_.end() || it->second != State::BUILDING) {
+      release(page);
+      continue;
+    }
+
+    if (sdf) {
+      it->second = State::READY;
+      ready_.emplace_back(page, sdf);
+    } else {
+      // not retried until the page has gone out of range and come back
+      it->second = State::FAILED;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+sdf::SDFPtr TilePager::buildPage(const Page& page, std::vector<fs::path>& textures) const
+{
+  int min_x, max_x, min_y, max_y;
+  pageTiles(page, min_x, max_x, min_y, max_y);
+
+  double x0, x1, y0, y1;
+  pageBounds(page, x0, x1, y0, y1);
+
+  // A page is a world whose plane covers exactly its tiles
+  GeoParams geo = geo_;
+  geo.width = x1 - x0;
+  geo.height = y1 - y0;
+  geo.shift_x = (x0 + x1)/2/geo.width;
+  geo.shift_y = (y0 + y1)/2/geo.height;
+  geo.chunk_size = 0;
+  TileLoader::tileCoordsToLatLon((min_x + max_x + 1)/2.0, (min_y + max_y + 1)/2.0,
+                                 geo.zoom, geo.lat, geo.lon);
+
+  ModelCreator creator(geo, root_, loader_->forTileRange(min_x, max_x, min_y, max_y),
+                       cache_manager_);
+  creator.setProfiler(profiler_);
+  sdf::SDFPtr sdf = creator.createModel(pageName(page), quality_);
+  textures = creator.textures();
+  return sdf;
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePager::release(const Page& page)
+{
+  auto it = textures_.find(page);
+  if (it == textures_.end()) return;
+
+  if (cache_manager_)
+    for (const auto& texture : it->second)
+      cache_manager_->unpinTexture(texture);
+  textures_.erase(it);
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePager::pageTiles(const Page& page, int& min_x, int& max_x,
+                          int& min_y, int& max_y) const
+{
+  const int n = params_.page_tiles;
+  const int last = (1 << static_cast<unsigned int>(geo_.zoom)) - 1;
+
+  min_x = page.first*n;
+  min_y = page.second*n;
+  max_x = std::min(min_x + n - 1, last);
+  max_y = std::min(min_y + n - 1, last);
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePager::pageBounds(const Page& page, double& x0, double& x1,
+                           double& y0, double& y1) const
+{
+  int min_x, max_x, min_y, max_y;
+  pageTiles(page, min_x, max_x, min_y, max_y);
+
+  // Tile y grows southwards, world y northwards
+  x0 = (min_x - origin_x_)*tile_size_;
+  x1 = (max_x + 1 - origin_x_)*tile_size_;
+  y0 = (origin_y_ - (max_y + 1))*tile_size_;
+  y1 = (origin_y_ - min_y)*tile_size_;
+}
+
+// ----------------------------------------------------------------------------
+
+double TilePager::distance(const Page& page, double x, double y) const
+{
+  double x0, x1, y0, y1;
+  pageBounds(page, x0, x1, y0, y1);
+
+  const double dx = std::max(0.0, std::max(x0 - x, x - x1));
+  const double dy = std::max(0.0, std::max(y0 - y, y - y1));
+  return std::hypot(dx, dy);
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePager::pagesAround(double x, double y, double radius,
+                            std::vector<Page>& pages) const
+{
+  const double n = params_.page_tiles;
+  const int last = (1 << static_cast<unsigned int>(geo_.zoom)) - 1;
+
+  // fractional tile coordinates of (x,y) and the radius in tiles
+  const double tx = origin_x_ + x/tile_size_;
+  const double ty = origin_y_ - y/tile_size_;
+  const double r = radius/tile_size_;
+
+  for (int py = std::floor((ty - r)/n); py <= std::floor((ty + r)/n); py++) {
+    for (int px = std::floor((tx - r)/n); px <= std::floor((tx + r)/n); px++) {
+      if (px < 0 || py < 0 || px*n > last || py*n > last) continue;
+
+      const Page page(px, py);
+      if (distance(page, x, y) <= radius) pages.push_back(page);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+std::string TilePager::pageName(const Page& page) const
+{
+  return name_ + "_" + std::to_string(page.first) + "_" + std::to_string(page.second);
+}
+
+// ----------------------------------------------------------------------------
+
+}
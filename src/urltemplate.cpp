@@ -0,0 +1,117 @@
+#include "gzsatellite/urltemplate.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace gzsatellite {
+
+// Subdomains of {s} without a list, as most tile servers use
+static const char* DEFAULT_SUBDOMAINS[] = {"a", "b", "c"};
+
+// ----------------------------------------------------------------------------
+
+static std::string lower(std::string s)
+{
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+// ----------------------------------------------------------------------------
+
+UrlTemplate::UrlTemplate(const std::string& pattern)
+  : pattern_(pattern), reserve_(0)
+{
+  std::string text;
+  size_t i = 0;
+  while (i < pattern.size()) {
+    const size_t close = (pattern[i] == '{') ? pattern.find('}', i) : std::string::npos;
+    if (close == std::string::npos) {
+      text += pattern[i++];
+      continue;
+    }
+
+    const std::string name = pattern.substr(i + 1, close - i - 1);
+    const std::string key = lower(name);
+
+    Field field = Field::TEXT;
+    if (key == "x") field = Field::X;
+    else if (key == "y") field = Field::Y;
+    else if (key == "-y") field = Field::FLIPPED_Y;
+    else if (key == "z") field = Field::Z;
+    else if (key == "q") field = Field::QUADKEY;
+    else if (key == "s" || key.compare(0, 2, "s:") == 0) field = Field::SUBDOMAIN;
+
+    if (field == Field::TEXT) {
+      text += pattern[i++];
+      continue;
+    }
+
+    if (field == Field::SUBDOMAIN) {
+      subdomains_.clear();
+      if (key == "s") {
+        subdomains_.assign(std::begin(DEFAULT_SUBDOMAINS), std::end(DEFAULT_SUBDOMAINS));
+      } else {
+        size_t start = 2;
+        for (size_t comma; (comma = name.find(',', start)) != std::string::npos; start = comma + 1)
+          subdomains_.push_back(name.substr(start, comma - start));
+        subdomains_.push_back(name.substr(start));
+      }
+    }
+
+    if (!text.empty()) {
+      reserve_ += text.size();
+      parts_.push_back(Part{Field::TEXT, text});
+      text.clear();
+    }
+    parts_.push_back(Part{field, std::string()});
+    i = close + 1;
+  }
+
+  if (!text.empty()) {
+    reserve_ += text.size();
+    parts_.push_back(Part{Field::TEXT, text});
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+std::string UrlTemplate::expand(int x, int y, int z) const
+{
+  std::string url;
+  url.reserve(reserve_ + 32);
+
+  for (const auto& part : parts_) {
+    switch (part.field) {
+      case Field::TEXT:
+        url += part.text;
+        break;
+      case Field::X:
+        url += std::to_string(x);
+        break;
+      case Field::Y:
+        url += std::to_string(y);
+        break;
+      case Field::FLIPPED_Y:
+        url += std::to_string((1 << z) - 1 - y);
+        break;
+      case Field::Z:
+        url += std::to_string(z);
+        break;
+      case Field::QUADKEY:
+        // One base-4 digit per zoom level, from the top: 1 is east, 2 south
+        for (int i = z; i > 0; i--)
+          url += static_cast<char>('0' + ((x >> (i - 1)) & 1) + 2*((y >> (i - 1)) & 1));
+        break;
+      case Field::SUBDOMAIN:
+        url += subdomains_[static_cast<unsigned int>(x + y) % subdomains_.size()];
+        break;
+    }
+  }
+
+  return url;
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,194 @@
+/**
+ * BC1 DDS textures: the header and mip chain a DDS reader expects, and
+ * blocks that decode back to (close to) the original pixels.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include "gzsatellite/ddswriter.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+/// Decode one BC1 block into 16 RGB pixels, as a GPU would
+static void decodeBlock(const uint8_t block[8], int px[16][3])
+{
+  const uint16_t c0 = block[0] | (block[1] << 8), c1 = block[2] | (block[3] << 8);
+
+  int palette[4][3];
+  for (int k=0; k<2; k++) {
+    const uint16_t c = k ? c1 : c0;
+    const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    palette[k][0] = (r << 3) | (r >> 2);
+    palette[k][1] = (g << 2) | (g >> 4);
+    palette[k][2] = (b << 3) | (b >> 2);
+  }
+  for (int c=0; c<3; c++) {
+    if (c0 > c1) {
+      palette[2][c] = (2*palette[0][c] + palette[1][c])/3;
+      palette[3][c] = (palette[0][c] + 2*palette[1][c])/3;
+    } else {
+      palette[2][c] = (palette[0][c] + palette[1][c])/2;
+      palette[3][c] = 0;
+    }
+  }
+
+  uint32_t indices;
+  std::memcpy(&indices, block + 4, 4);
+  for (int i=0; i<16; i++)
+    for (int c=0; c<3; c++)
+      px[i][c] = palette[(indices >> (2*i)) & 3][c];
+}
+
+// ----------------------------------------------------------------------------
+
+class DDSWriterTest : public ::testing::Test
+{
+protected:
+  fs::path path_;
+
+  void SetUp() override
+  {
+    path_ = fs::temp_directory_path()/fs::unique_path("gzsatellite-test-%%%%-%%%%.dds");
+  }
+
+  void TearDown() override
+  {
+    boost::system::error_code ec;
+    fs::remove(path_, ec);
+  }
+
+  /// A smooth image with a sharp edge across it
+  static cv::Mat image(int width, int height)
+  {
+    cv::Mat img(height, width, CV_8UC3);
+    for (int y=0; y<height; y++) {
+      for (int x=0; x<width; x++) {
+        uint8_t* p = img.ptr<uint8_t>(y) + 3*x;
+        p[0] = (x*255)/width;
+        p[1] = (y*255)/height;
+        p[2] = (x < width/3) ? 200 : 60;
+      }
+    }
+    return img;
+  }
+
+  std::string contents() const
+  {
+    std::ifstream in(path_.string(), std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+TEST_F(DDSWriterTest, HeaderAndMipChain)
+{
+  // Not a multiple of 4 either way, and not square
+  const int width = 37, height = 21;
+  ASSERT_TRUE(writeDDS(path_, image(width, height)));
+
+  const std::string dds = contents();
+  ASSERT_GE(dds.size(), 128u);
+  EXPECT_EQ("DDS ", dds.substr(0, 4));
+
+  uint32_t header[31];
+  std::memcpy(header, dds.data() + 4, sizeof(header));
+  EXPECT_EQ(124u, header[0]);
+  EXPECT_EQ(static_cast<uint32_t>(height), header[2]);
+  EXPECT_EQ(static_cast<uint32_t>(width), header[3]);
+  EXPECT_EQ(10u*6*8, header[4]);           // blocks of the first level
+  EXPECT_EQ(0x31545844u, header[20]);      // "DXT1"
+
+  // 37x21, 18x10, 9x5, 4x2, 2x1, 1x1
+  size_t bytes = 0;
+  unsigned int levels = 0;
+  for (int w = width, h = height; ; w = std::max(1, w/2), h = std::max(1, h/2)) {
+    bytes += ((w + 3)/4)*((h + 3)/4)*8;
+    levels++;
+    if (w == 1 && h == 1) break;
+  }
+  EXPECT_EQ(6u, levels);
+  EXPECT_EQ(levels, header[6]);
+  EXPECT_EQ(4 + sizeof(header) + bytes, dds.size());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(DDSWriterTest, StreamedRowsMatchTheWholeImage)
+{
+  const cv::Mat img = image(70, 45);
+  ASSERT_TRUE(writeDDS(path_, img));
+  const std::string whole = contents();
+
+  // Batches of rows that don't line up with the blocks
+  {
+    DDSWriter writer(path_, img.cols, img.rows);
+    for (int y=0; y<img.rows; y+=7)
+      ASSERT_TRUE(writer.write(img.rowRange(y, std::min(img.rows, y + 7))));
+    ASSERT_TRUE(writer.finish());
+  }
+  EXPECT_EQ(whole, contents());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(DDSWriterTest, SolidBlockDecodesToItsColour)
+{
+  cv::Mat img(4, 4, CV_8UC3, cv::Scalar(30, 140, 220));  // BGR
+  std::vector<uint8_t> blocks;
+  encodeBC1(img, blocks, 1);
+  ASSERT_EQ(8u, blocks.size());
+
+  // RGB565 keeps the top 5 or 6 bits of each channel
+  int px[16][3];
+  decodeBlock(blocks.data(), px);
+  for (int i=0; i<16; i++) {
+    EXPECT_NEAR(220, px[i][0], 7) << i;
+    EXPECT_NEAR(140, px[i][1], 3) << i;
+    EXPECT_NEAR(30, px[i][2], 7) << i;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(DDSWriterTest, ImageDecodesCloseToTheOriginal)
+{
+  const cv::Mat img = image(64, 48);
+  std::vector<uint8_t> blocks;
+  encodeBC1(img, blocks, 2);
+  ASSERT_EQ(16u*12*8, blocks.size());
+
+  double squared = 0;
+  for (int by=0; by<12; by++) {
+    for (int bx=0; bx<16; bx++) {
+      int px[16][3];
+      decodeBlock(&blocks[(by*16 + bx)*8], px);
+      for (int i=0; i<16; i++) {
+        const uint8_t* p = img.ptr<uint8_t>(by*4 + i/4) + 3*(bx*4 + i%4);
+        for (int c=0; c<3; c++) {
+          const double d = px[i][c] - p[2 - c];
+          squared += d*d;
+        }
+      }
+    }
+  }
+
+  const double psnr = 10*std::log10(255.0*255.0/(squared/(64*48*3)));
+  EXPECT_GT(psnr, 32);
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,124 @@
+/**
+ * The world's frame (GeoConverter's LOCAL) must be where the imagery is
+ * actually drawn, i.e. where ModelCreator puts the world image's pixels.
+ */
+
+#include <cmath>
+#include <vector>
+
+#include "test_helpers.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+class GeoConverterTest : public WorldTest
+{
+protected:
+  void SetUp() override
+  {
+    WorldTest::SetUp();
+
+    // Nothing is loaded: the frame only depends on the tile range
+    geo_.tileserver = "file://" + (root_/"server").string() + "/{z}/{x}/{y}.jpg";
+    geo_.zoom = 19;
+    geo_.width = 100;
+    geo_.height = 80;
+    geo_.shift_x = 0.3;
+    geo_.shift_y = -0.2;
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+TEST_F(GeoConverterTest, TileCornersAreOnTheRenderedPlane)
+{
+  ModelCreator creator(geo_, root_.string());
+  const GeoConverter converter = creator.geoConverter();
+
+  TileLoader loader((root_/"mapscache").string(), geo_.tileserver,
+                    geo_.lat, geo_.lon, geo_.zoom, geo_.width, geo_.height);
+  int min_x, max_x, min_y, max_y;
+  loader.tileRange(min_x, max_x, min_y, max_y);
+
+  // The world image (whole tiles) is stretched over width x height,
+  // centred at the shift
+  const double xpos = geo_.shift_x*geo_.width;
+  const double ypos = geo_.shift_y*geo_.height;
+
+  double x, y;
+  converter.convert(GeoConverter::Frame::TILE, GeoConverter::Frame::LOCAL,
+                    min_x, min_y, x, y);
+  EXPECT_NEAR(xpos - geo_.width/2, x, 1e-6);   // NW corner
+  EXPECT_NEAR(ypos + geo_.height/2, y, 1e-6);
+
+  converter.convert(GeoConverter::Frame::TILE, GeoConverter::Frame::LOCAL,
+                    max_x + 1, max_y + 1, x, y);
+  EXPECT_NEAR(xpos + geo_.width/2, x, 1e-6);   // SE corner
+  EXPECT_NEAR(ypos - geo_.height/2, y, 1e-6);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(GeoConverterTest, OriginIsAtZero)
+{
+  ModelCreator creator(geo_, root_.string());
+  const GeoConverter converter = creator.geoConverter();
+
+  double lat, lon, x, y;
+  creator.getOriginLatLon(lat, lon);
+  converter.convert(GeoConverter::Frame::LATLON, GeoConverter::Frame::LOCAL, lon, lat, x, y);
+  EXPECT_NEAR(0, x, 1e-6);
+  EXPECT_NEAR(0, y, 1e-6);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(GeoConverterTest, LatLonRoundTripsThroughLocal)
+{
+  ModelCreator creator(geo_, root_.string());
+  const GeoConverter converter = creator.geoConverter();
+
+  // Points around the world, converted in place
+  std::vector<double> lon, lat;
+  for (int i=0; i<50; i++) {
+    lon.push_back(geo_.lon + (i - 25)*1e-4);
+    lat.push_back(geo_.lat + (i%7 - 3)*1e-4);
+  }
+  std::vector<double> x = lon, y = lat;
+  converter.convert(GeoConverter::Frame::LATLON, GeoConverter::Frame::LOCAL,
+                    x.data(), y.data(), x.size(), x.data(), y.data());
+  converter.convert(GeoConverter::Frame::LOCAL, GeoConverter::Frame::LATLON,
+                    x.data(), y.data(), x.size(), x.data(), y.data());
+
+  for (size_t i=0; i<lon.size(); i++) {
+    EXPECT_NEAR(lon[i], x[i], 1e-9);
+    EXPECT_NEAR(lat[i], y[i], 1e-9);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(GeoConverterTest, OutOfRangePointsAreNaN)
+{
+  ModelCreator creator(geo_, root_.string());
+  const GeoConverter converter = creator.geoConverter();
+
+  // Beyond the Mercator latitudes, and past the antimeridian
+  const double lon[] = { geo_.lon, geo_.lon, 180.5, -181 };
+  const double lat[] = { 86, -89, geo_.lat, geo_.lat };
+  double x[4], y[4];
+  converter.convert(GeoConverter::Frame::LATLON, GeoConverter::Frame::LOCAL, lon, lat, 4, x, y);
+
+  for (int i=0; i<4; i++) {
+    EXPECT_TRUE(std::isnan(x[i])) << i;
+    EXPECT_TRUE(std::isnan(y[i])) << i;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,39 @@
+/**
+ * Setup shared by the tests that build worlds: a temporary root directory
+ * for the caches and textures (removed afterwards), and a world around a
+ * fixed spot, to be completed by each test.
+ */
+
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include "gzsatellite/modelcreator.h"
+
+namespace gzsatellite {
+
+  class WorldTest : public ::testing::Test
+  {
+  protected:
+    boost::filesystem::path root_;
+    GeoParams geo_;
+
+    void SetUp() override
+    {
+      namespace fs = boost::filesystem;
+      root_ = fs::temp_directory_path()/fs::unique_path("gzsatellite-test-%%%%-%%%%");
+      fs::create_directories(root_);
+
+      geo_.lat = 40.267463;
+      geo_.lon = -111.635655;
+      geo_.shift_x = geo_.shift_y = 0;
+    }
+
+    void TearDown() override
+    {
+      boost::system::error_code ec;
+      boost::filesystem::remove_all(root_, ec);
+    }
+  };
+
+}
@@ -0,0 +1,137 @@
+/**
+ * Multithreaded and streamed JPEGs: strips joined into one image must
+ * decode like the same image encoded in one go.
+ */
+
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include "gzsatellite/jpegwriter.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+class JPEGWriterTest : public ::testing::Test
+{
+protected:
+  fs::path dir_;
+
+  void SetUp() override
+  {
+    dir_ = fs::temp_directory_path()/fs::unique_path("gzsatellite-test-%%%%-%%%%");
+    fs::create_directories(dir_);
+  }
+
+  void TearDown() override
+  {
+    boost::system::error_code ec;
+    fs::remove_all(dir_, ec);
+  }
+
+  /// Gradients with detail, which every strip encodes differently
+  static cv::Mat image(int width, int height)
+  {
+    cv::Mat img(height, width, CV_8UC3);
+    for (int y=0; y<height; y++) {
+      for (int x=0; x<width; x++) {
+        uint8_t* p = img.ptr<uint8_t>(y) + 3*x;
+        p[0] = (x*3 + y) & 0xFF;
+        p[1] = (y*2) & 0xFF;
+        p[2] = ((x/8 + y/8) % 2) ? 180 : 70;
+      }
+    }
+    return img;
+  }
+
+  static std::vector<uint8_t> read(const fs::path& path)
+  {
+    std::ifstream in(path.string(), std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(in),
+                                std::istreambuf_iterator<char>());
+  }
+
+  /// Number of restart markers in a JPEG's scan
+  static int restartMarkers(const std::vector<uint8_t>& jpg)
+  {
+    int n = 0;
+    for (size_t i=0; i+1<jpg.size(); i++)
+      if (jpg[i] == 0xFF && jpg[i+1] >= 0xD0 && jpg[i+1] <= 0xD7) n++;
+    return n;
+  }
+
+  /// Largest difference of any channel of any pixel
+  static int maxDifference(const cv::Mat& a, const cv::Mat& b)
+  {
+    int diff = 0;
+    for (int y=0; y<a.rows; y++) {
+      const uint8_t* pa = a.ptr<uint8_t>(y);
+      const uint8_t* pb = b.ptr<uint8_t>(y);
+      for (int i=0; i<a.cols*3; i++) diff = std::max(diff, std::abs(pa[i] - pb[i]));
+    }
+    return diff;
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+TEST_F(JPEGWriterTest, StripsDecodeLikeOneEncode)
+{
+  // Not a multiple of 16 rows (the MCU height) or columns
+  const int width = 200, height = 333;
+  if (!JPEGWriter::streamable(width, height)) {
+    std::cerr << "OpenCV's encoder can't emit restart markers; nothing to test" << std::endl;
+    return;
+  }
+
+  const cv::Mat img = image(width, height);
+  ASSERT_TRUE(writeJPEG(dir_/"single.jpg", img, 90, 1));
+  ASSERT_TRUE(writeJPEG(dir_/"strips.jpg", img, 90, 4));
+
+  // Joined from several strips, with a restart marker after every MCU row
+  const std::vector<uint8_t> strips = read(dir_/"strips.jpg");
+  EXPECT_EQ((height + 15)/16 - 1, restartMarkers(strips));
+
+  const cv::Mat single = cv::imdecode(read(dir_/"single.jpg"), cv::IMREAD_COLOR);
+  const cv::Mat joined = cv::imdecode(strips, cv::IMREAD_COLOR);
+  ASSERT_EQ(height, joined.rows);
+  ASSERT_EQ(width, joined.cols);
+
+  // The same DCT blocks with the same tables: at most rounding apart
+  EXPECT_LE(maxDifference(single, joined), 2);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(JPEGWriterTest, StreamedRowsDecodeLikeOneEncode)
+{
+  const int width = 120, height = 90;
+  if (!JPEGWriter::streamable(width, height)) return;
+
+  const cv::Mat img = image(width, height);
+  ASSERT_TRUE(writeJPEG(dir_/"single.jpg", img, 90, 1));
+
+  // Batches that don't line up with the MCU rows
+  {
+    JPEGWriter writer(dir_/"streamed.jpg", width, height, 90, 2);
+    for (int y=0; y<height; y+=7)
+      ASSERT_TRUE(writer.write(img.rowRange(y, std::min(height, y + 7))));
+    ASSERT_TRUE(writer.finish());
+  }
+
+  const cv::Mat single = cv::imdecode(read(dir_/"single.jpg"), cv::IMREAD_COLOR);
+  const cv::Mat streamed = cv::imdecode(read(dir_/"streamed.jpg"), cv::IMREAD_COLOR);
+  ASSERT_EQ(height, streamed.rows);
+  ASSERT_EQ(width, streamed.cols);
+  EXPECT_LE(maxDifference(single, streamed), 2);
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,238 @@
+/**
+ * The packed tile cache: growing its index, surviving crashes between its
+ * writes, and compaction, with every tile read back exactly as written.
+ */
+
+#include <map>
+#include <tuple>
+#include <string>
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "gzsatellite/packedtilecache.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+class PackedTileCacheTest : public ::testing::Test
+{
+protected:
+  typedef std::tuple<int, int, int> Key;
+
+  fs::path dir_;
+  std::unique_ptr<PackedTileCache> cache_;
+  std::map<Key, std::string> written_;  ///< what each tile should read back as
+
+  void SetUp() override
+  {
+    dir_ = fs::temp_directory_path()/fs::unique_path("gzsatellite-test-%%%%-%%%%");
+    fs::create_directories(dir_);
+    reopen();
+  }
+
+  void TearDown() override
+  {
+    cache_.reset();
+    boost::system::error_code ec;
+    fs::remove_all(dir_, ec);
+  }
+
+  /// Close the cache (as a process exiting would) and open it again
+  void reopen()
+  {
+    cache_.reset();
+    cache_.reset(new PackedTileCache(dir_));
+  }
+
+  /// Contents of tile [x,y], different for every version. Every tenth
+  /// column has the same contents, to share blobs.
+  static std::string contents(int x, int y, int version)
+  {
+    if (x % 10 == 0) return "shared tile " + std::to_string(version);
+
+    std::string s = "tile " + std::to_string(x) + " " + std::to_string(y) +
+                    " v" + std::to_string(version) + ":";
+    s.resize(s.size() + 50 + (x*7 + y*13) % 300, static_cast<char>('a' + (x + y) % 26));
+    return s;
+  }
+
+  void write(int x, int y, int z, int version)
+  {
+    const std::string data = contents(x, y, version);
+    TileMeta meta;
+    meta.etag = "\"" + std::to_string(version) + "\"";
+    meta.fetched = 1000 + version;
+    cache_->write(x, y, z, data, meta);
+    written_[Key(x, y, z)] = data;
+  }
+
+  void remove(int x, int y, int z)
+  {
+    EXPECT_TRUE(cache_->remove(x, y, z));
+    written_.erase(Key(x, y, z));
+  }
+
+  /// Every tile written (and not removed since) reads back byte for byte
+  void expectAllTiles()
+  {
+    EXPECT_EQ(written_.size(), cache_->size());
+    for (const auto& kv : written_) {
+      int x, y, z;
+      std::tie(x, y, z) = kv.first;
+
+      TileBytes bytes;
+      ASSERT_TRUE(cache_->read(x, y, z, bytes)) << x << "," << y << "," << z;
+      EXPECT_EQ(kv.second, std::string(bytes.data, bytes.size)) << x << "," << y << "," << z;
+      EXPECT_EQ(TileCache::contentDigest(bytes.data, bytes.size), bytes.digest);
+    }
+  }
+
+  uint64_t fileSize(const std::string& name) const { return fs::file_size(dir_/name); }
+};
+
+// ----------------------------------------------------------------------------
+
+TEST_F(PackedTileCacheTest, GrowsPastItsCapacity)
+{
+  const uint64_t initial = fileSize("tiles.idx");
+
+  // Far more tiles than fit in the initial index at most half full
+  for (int x = 0; x < 100; x++)
+    for (int y = 0; y < 50; y++)
+      write(x, y, 17, 0);
+
+  EXPECT_GT(fileSize("tiles.idx"), 2*initial);
+  EXPECT_FALSE(fs::exists(dir_/"tiles.idx.next"));
+  expectAllTiles();
+
+  // ...and still after opening it again
+  reopen();
+  expectAllTiles();
+
+  TileMeta meta;
+  ASSERT_TRUE(cache_->readMeta(42, 17, 17, meta));
+  EXPECT_EQ("\"0\"", meta.etag);
+  EXPECT_EQ(1000, meta.fetched);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(PackedTileCacheTest, RecoversFromInterruptedWrites)
+{
+  for (int x = 0; x < 20; x++)
+    for (int y = 0; y < 20; y++)
+      write(x, y, 18, 0);
+  cache_.reset();
+
+  // A crash between appending a blob to the pack and pointing the index at
+  // it leaves the blob behind, unreferenced. Crashes while growing the
+  // index or compacting leave their new files behind, incomplete.
+  {
+    std::ofstream pack((dir_/"tiles.pack").string(), std::ios::binary | std::ios::app);
+    pack << contents(99, 99, 0);
+  }
+  std::ofstream((dir_/"tiles.idx.next").string()) << "incomplete";
+  std::ofstream((dir_/"tiles.pack.tmp").string()) << "incomplete";
+
+  reopen();
+  EXPECT_FALSE(fs::exists(dir_/"tiles.idx.next"));
+  EXPECT_FALSE(fs::exists(dir_/"tiles.pack.tmp"));
+  EXPECT_FALSE(cache_->contains(99, 99, 18));
+  expectAllTiles();
+
+  // Writes carry on after the garbage
+  write(99, 99, 18, 1);
+  write(3, 4, 18, 1);
+  expectAllTiles();
+
+  reopen();
+  expectAllTiles();
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(PackedTileCacheTest, IndexEntriesPastThePackAreMisses)
+{
+  for (int x = 1; x < 4; x++)
+    write(x, 0, 18, 0);
+  cache_.reset();
+
+  // The index is a shared mapping, and may reach the disk before the
+  // pack's last blobs do: cut the last tile's blobs off
+  const uint64_t size = fileSize("tiles.pack");
+  fs::resize_file(dir_/"tiles.pack", size - contents(3, 0, 0).size() - 20);
+
+  reopen();
+  TileBytes bytes;
+  EXPECT_FALSE(cache_->read(3, 0, 18, bytes));
+  written_.erase(Key(3, 0, 18));
+
+  for (const auto& kv : written_) {
+    ASSERT_TRUE(cache_->read(std::get<0>(kv.first), std::get<1>(kv.first), 18, bytes));
+    EXPECT_EQ(kv.second, std::string(bytes.data, bytes.size));
+  }
+
+  // Writing the tile again repairs it
+  write(3, 0, 18, 1);
+  ASSERT_TRUE(cache_->read(3, 0, 18, bytes));
+  EXPECT_EQ(contents(3, 0, 1), std::string(bytes.data, bytes.size));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(PackedTileCacheTest, CompactionDropsGarbageOnly)
+{
+  for (int x = 0; x < 30; x++)
+    for (int y = 0; y < 30; y++)
+      write(x, y, 19, 0);
+
+  // Below half garbage, the pack is left as it is
+  for (int y = 0; y < 5; y++)
+    write(1, y, 19, 1);
+  const uint64_t before = fileSize("tiles.pack");
+  cache_->compact();
+  EXPECT_EQ(before, fileSize("tiles.pack"));
+
+  // Replace or remove most tiles
+  for (int x = 0; x < 30; x++) {
+    for (int y = 0; y < 30; y++) {
+      if (y < 10) write(x, y, 19, 2);
+      else if (y < 25) remove(x, y, 19);
+    }
+  }
+
+  // Views handed out before compaction stay valid
+  TileBytes view;
+  ASSERT_TRUE(cache_->read(5, 27, 19, view));
+  const std::string viewed = written_[Key(5, 27, 19)];
+
+  const uint64_t garbage = fileSize("tiles.pack");
+  cache_->compact();
+  EXPECT_LT(fileSize("tiles.pack"), garbage/2);
+  EXPECT_FALSE(fs::exists(dir_/"tiles.pack.tmp"));
+  EXPECT_FALSE(fs::exists(dir_/"tiles.idx.compact"));
+  EXPECT_EQ(viewed, std::string(view.data, view.size));
+
+  expectAllTiles();
+  EXPECT_FALSE(cache_->contains(0, 12, 19));
+
+  TileMeta meta;
+  ASSERT_TRUE(cache_->readMeta(7, 3, 19, meta));
+  EXPECT_EQ("\"2\"", meta.etag);
+
+  // The compacted pack is appended to like any other
+  write(100, 100, 19, 3);
+  expectAllTiles();
+
+  reopen();
+  expectAllTiles();
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,163 @@
+/**
+ * Tiles shared between creators: decoded once between them, never waited
+ * on forever, and dropped once every creator that wants them has had them.
+ */
+
+#include <thread>
+#include <future>
+#include <chrono>
+#include <atomic>
+
+#include <gtest/gtest.h>
+
+#include "gzsatellite/sharedtiles.h"
+
+using namespace gzsatellite;
+
+/// The pixels a creator would decode for tile [x,y]
+static cv::Mat decode(int x, int y)
+{
+  return cv::Mat(4, 4, CV_8UC3, cv::Scalar(x, y, 200));
+}
+
+static bool samePixels(const cv::Mat& a, const cv::Mat& b)
+{
+  if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type()) return false;
+  for (int y=0; y<a.rows; y++)
+    for (int i=0; i<a.cols*3; i++)
+      if (a.ptr<uint8_t>(y)[i] != b.ptr<uint8_t>(y)[i]) return false;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(SharedTilesTest, TilesWantedOnceAreNotShared)
+{
+  SharedTiles shared;
+  shared.want(1, 2, 17);
+
+  cv::Mat img;
+  SharedTiles::Claim claim;
+  EXPECT_TRUE(shared.claim(1, 2, 17, img, claim));
+  EXPECT_TRUE(shared.claim(5, 5, 17, img, claim));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(SharedTilesTest, TwoThreadsDecodeOnce)
+{
+  for (int round=0; round<50; round++) {
+    SharedTiles shared;
+    shared.want(3, 4, 17);
+    shared.want(3, 4, 17);
+
+    std::atomic<int> decodes(0);
+    cv::Mat got[2];
+    auto creator = [&](int i) {
+      SharedTiles::Claim claim;
+      if (shared.claim(3, 4, 17, got[i], claim)) {
+        decodes++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        got[i] = decode(3, 4);
+        claim.put(got[i]);
+      }
+    };
+
+    std::thread a(creator, 0), b(creator, 1);
+    a.join();
+    b.join();
+
+    EXPECT_EQ(1, decodes);
+    EXPECT_TRUE(samePixels(decode(3, 4), got[0]));
+    EXPECT_TRUE(samePixels(decode(3, 4), got[1]));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(SharedTilesTest, ClaimDroppedWithoutPutIsAFailedDecode)
+{
+  SharedTiles shared;
+  shared.want(7, 8, 17);
+  shared.want(7, 8, 17);
+
+  std::future<cv::Mat> waiter;
+  {
+    cv::Mat img;
+    SharedTiles::Claim claim;
+    ASSERT_TRUE(shared.claim(7, 8, 17, img, claim));
+
+    // The other creator gets there while the tile is claimed...
+    waiter = std::async(std::launch::async, [&shared]() {
+      cv::Mat img = decode(0, 0);
+      SharedTiles::Claim claim;
+      EXPECT_FALSE(shared.claim(7, 8, 17, img, claim));
+      return img;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    // ...and the claiming one gives up (e.g., it threw)
+  }
+
+  ASSERT_EQ(std::future_status::ready, waiter.wait_for(std::chrono::seconds(5)));
+  EXPECT_TRUE(waiter.get().empty());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(SharedTilesTest, TilesAreDroppedOnceEveryCreatorHasThem)
+{
+  SharedTiles shared;
+  for (int i=0; i<3; i++) shared.want(1, 1, 17);
+  shared.want(2, 2, 17);
+  shared.want(2, 2, 17);
+
+  // Three creators have tile [1,1], the first one decoding it
+  {
+    cv::Mat img;
+    SharedTiles::Claim claim;
+    ASSERT_TRUE(shared.claim(1, 1, 17, img, claim));
+    claim.put(decode(1, 1));
+  }
+  for (int i=0; i<2; i++) {
+    cv::Mat img;
+    SharedTiles::Claim claim;
+    EXPECT_FALSE(shared.claim(1, 1, 17, img, claim));
+    EXPECT_TRUE(samePixels(decode(1, 1), img));
+  }
+
+  // ...so it is gone: a creator that loads it again decodes it itself
+  {
+    cv::Mat img;
+    SharedTiles::Claim claim;
+    EXPECT_TRUE(shared.claim(1, 1, 17, img, claim));
+  }
+
+  // The last creator to have a tile may be the one that decodes it
+  {
+    cv::Mat img;
+    SharedTiles::Claim first, last;
+    ASSERT_TRUE(shared.claim(2, 2, 17, img, first));
+    std::future<bool> waiter = std::async(std::launch::async, [&shared, &last]() {
+      cv::Mat img;
+      return shared.claim(2, 2, 17, img, last);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    first.put(decode(2, 2));
+    ASSERT_EQ(std::future_status::ready, waiter.wait_for(std::chrono::seconds(5)));
+    EXPECT_FALSE(waiter.get());
+  }
+  {
+    cv::Mat img;
+    SharedTiles::Claim claim;
+    EXPECT_TRUE(shared.claim(2, 2, 17, img, claim));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
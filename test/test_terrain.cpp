@@ -0,0 +1,171 @@
+/**
+ * Terrain from Terrarium elevation tiles, served from a local directory of
+ * tiles (a file:// stand-in for the elevation server).
+ */
+
+#include <fstream>
+#include <sstream>
+#include <cmath>
+
+#include "test_helpers.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+class TerrainTest : public WorldTest
+{
+protected:
+  void SetUp() override
+  {
+    WorldTest::SetUp();
+
+    geo_.tileserver = "file://" + (root_/"imagery").string() + "/{z}/{x}/{y}.jpg";
+    geo_.elevation_server = "file://" + (root_/"elevation").string() + "/{z}/{x}/{y}.png";
+    geo_.elevation_zoom = 17;
+    geo_.max_retries = 0;
+    geo_.zoom = 17;
+    geo_.width = 800;
+    geo_.height = 600;
+  }
+
+  /// A tile of the imagery or elevation stand-in
+  static fs::path tilePath(const fs::path& dir, int x, int y, int z, const std::string& ext)
+  {
+    return dir/std::to_string(z)/std::to_string(x)/(std::to_string(y) + ext);
+  }
+
+  /// A Terrarium tile of heights h
+  static cv::Mat terrarium(float h)
+  {
+    const double v = h + 32768.0;
+    const double r = std::floor(v/256), g = std::floor(v - r*256);
+    return cv::Mat(256, 256, CV_8UC3, cv::Scalar(std::round((v - r*256 - g)*256), g, r));
+  }
+
+  /// Serve every tile of the world, imagery and elevation at height h,
+  /// except for the elevation tile (skip_x, skip_y)
+  void serveTiles(float h, int skip_x, int skip_y)
+  {
+    TileLoader loader((root_/"mapscache").string(), geo_.tileserver,
+                      geo_.lat, geo_.lon, geo_.zoom, geo_.width, geo_.height);
+    int min_x, max_x, min_y, max_y;
+    loader.tileRange(min_x, max_x, min_y, max_y);
+
+    const int z = geo_.zoom;
+    const cv::Mat img(256, 256, CV_8UC3, cv::Scalar(40, 120, 60));
+    for (int y = min_y; y <= max_y; y++) {
+      for (int x = min_x; x <= max_x; x++) {
+        const fs::path ip = tilePath(root_/"imagery", x, y, z, ".jpg");
+        fs::create_directories(ip.parent_path());
+        ASSERT_TRUE(cv::imwrite(ip.string(), img));
+
+        if (x == skip_x && y == skip_y) continue;
+        const fs::path ep = tilePath(root_/"elevation", x, y, z, ".png");
+        fs::create_directories(ep.parent_path());
+        ASSERT_TRUE(cv::imwrite(ep.string(), terrarium(h)));
+      }
+    }
+  }
+
+  /// The heights of the vertices of the world's collision mesh
+  std::vector<float> meshHeights()
+  {
+    std::vector<float> z;
+    for (fs::directory_iterator it(root_/"meshes"), end; it != end; ++it) {
+      if (it->path().extension() != ".dae" ||
+          it->path().stem().string().find('_') != std::string::npos) continue;
+
+      std::ifstream in(it->path().string());
+      std::stringstream ss;
+      ss << in.rdbuf();
+      const std::string dae = ss.str();
+      const std::string tag = "id=\"terrain-positions-array\"";
+      const size_t begin = dae.find('>', dae.find(tag)) + 1;
+      std::istringstream values(dae.substr(begin, dae.find('<', begin) - begin));
+
+      float x, y, h;
+      while (values >> x >> y >> h) z.push_back(h);
+    }
+    return z;
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+TEST_F(TerrainTest, DecodesTerrarium)
+{
+  std::vector<uint8_t> png;
+  ASSERT_TRUE(cv::imencode(".png", terrarium(1234.5f), png));
+
+  TileBytes bytes;
+  bytes.data = reinterpret_cast<const char*>(png.data());
+  bytes.size = png.size();
+  const cv::Mat heights = decodeTerrarium(bytes);
+  ASSERT_EQ(heights.rows, 256);
+  ASSERT_EQ(heights.cols, 256);
+  EXPECT_NEAR(heights.at<float>(0, 0), 1234.5f, 1.0f/256);
+  EXPECT_NEAR(heights.at<float>(255, 255), 1234.5f, 1.0f/256);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(TerrainTest, HolesContinueTheGroundAroundThem)
+{
+  cv::Mat heights(8, 8, CV_32F, cv::Scalar(500));
+  cv::Mat known(8, 8, CV_8U, cv::Scalar(1));
+  heights(cv::Rect(2, 2, 4, 4)).setTo(0);
+  known(cv::Rect(2, 2, 4, 4)).setTo(0);
+
+  ASSERT_TRUE(fillHeightHoles(heights, known));
+  for (int r=0; r<heights.rows; r++)
+    for (int c=0; c<heights.cols; c++)
+      EXPECT_EQ(heights.at<float>(r, c), 500);
+
+  EXPECT_FALSE(fillHeightHoles(heights, cv::Mat::zeros(8, 8, CV_8U)));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(TerrainTest, MissingElevationTilesAreNotPits)
+{
+  TileLoader loader((root_/"mapscache").string(), geo_.tileserver,
+                    geo_.lat, geo_.lon, geo_.zoom, geo_.width, geo_.height);
+  int min_x, max_x, min_y, max_y;
+  loader.tileRange(min_x, max_x, min_y, max_y);
+  ASSERT_GT(max_x, min_x);
+
+  // Flat ground at 1500 m, with the NW elevation tile missing: the ground
+  // stays at the datum everywhere, and the mesh is made again once the
+  // tile is there
+  serveTiles(1500, min_x, min_y);
+  {
+    ModelCreator creator(geo_, root_.string());
+    ASSERT_TRUE(creator.createModel("terrain", 90) != nullptr);
+  }
+
+  std::vector<float> z = meshHeights();
+  ASSERT_FALSE(z.empty());
+  for (float h : z) EXPECT_NEAR(h, 0, 0.01);
+
+  const fs::path skipped = tilePath(root_/"elevation", min_x, min_y, geo_.zoom, ".png");
+  fs::create_directories(skipped.parent_path());
+  ASSERT_TRUE(cv::imwrite(skipped.string(), terrarium(1500)));
+
+  bool incomplete = false;
+  for (fs::directory_iterator it(root_/"meshes"), end; it != end; ++it)
+    incomplete |= it->path().extension() == ".incomplete";
+  EXPECT_TRUE(incomplete);
+
+  {
+    ModelCreator creator(geo_, root_.string());
+    ASSERT_TRUE(creator.createModel("terrain", 90) != nullptr);
+  }
+
+  incomplete = false;
+  for (fs::directory_iterator it(root_/"meshes"), end; it != end; ++it)
+    incomplete |= it->path().extension() == ".incomplete";
+  EXPECT_FALSE(incomplete);
+
+  z = meshHeights();
+  for (float h : z) EXPECT_NEAR(h, 0, 0.01);
+}
@@ -0,0 +1,201 @@
+/**
+ * Parallel downloads, from a local stand-in tile server that answers every
+ * request after a fixed latency.
+ */
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <gtest/gtest.h>
+
+#include "gzsatellite/tileloader.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+/// HTTP server on 127.0.0.1 that answers each GET after latency seconds,
+/// with a body naming the requested path. One connection per request.
+class SlowTileServer
+{
+public:
+  explicit SlowTileServer(double latency)
+    : latency_(latency), stop_(false), active_(0), max_active_(0), requests_(0)
+  {
+    fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (fd_ < 0 || ::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(fd_, 64) != 0 ||
+        ::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+      throw std::runtime_error("Can't start the stand-in tile server");
+    port_ = ntohs(addr.sin_port);
+
+    thread_ = std::thread(&SlowTileServer::run, this);
+  }
+
+  ~SlowTileServer()
+  {
+    stop_ = true;
+    thread_.join();
+    for (auto& t : connections_) t.join();
+    ::close(fd_);
+  }
+
+  std::string url() const
+  { return "http://127.0.0.1:" + std::to_string(port_) + "/{z}/{x}/{y}.jpg"; }
+
+  /// Most requests that were being answered at the same time
+  unsigned int maxActive() const { return max_active_; }
+  unsigned int requests() const { return requests_; }
+
+private:
+  int fd_;
+  int port_;
+  double latency_;
+  std::atomic<bool> stop_;
+  std::atomic<unsigned int> active_, max_active_, requests_;
+  std::thread thread_;
+  std::vector<std::thread> connections_;
+
+  void run()
+  {
+    while (!stop_) {
+      pollfd p = {fd_, POLLIN, 0};
+      if (::poll(&p, 1, 50) <= 0) continue;
+
+      const int conn = ::accept(fd_, nullptr, nullptr);
+      if (conn >= 0) connections_.emplace_back(&SlowTileServer::serve, this, conn);
+    }
+  }
+
+  void serve(int conn)
+  {
+    // Read the request head (a GET has no body)
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      const ssize_t n = ::recv(conn, buf, sizeof(buf), 0);
+      if (n <= 0) { ::close(conn); return; }
+      request.append(buf, n);
+    }
+
+    const unsigned int active = ++active_;
+    unsigned int prev = max_active_;
+    while (active > prev && !max_active_.compare_exchange_weak(prev, active)) {}
+    requests_++;
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(latency_));
+
+    const size_t begin = request.find(' ') + 1;
+    const std::string body = "tile " + request.substr(begin, request.find(' ', begin) - begin);
+    const std::string response = "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: image/jpeg\r\n"
+                                 "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                 "Connection: close\r\n\r\n" + body;
+    active_--;
+
+    for (size_t sent = 0; sent < response.size();) {
+      const ssize_t n = ::send(conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) break;
+      sent += n;
+    }
+    ::close(conn);
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+class TileLoaderTest : public ::testing::Test
+{
+protected:
+  fs::path root_;
+
+  void SetUp() override
+  {
+    root_ = fs::temp_directory_path()/fs::unique_path("gzsatellite-test-%%%%-%%%%");
+    fs::create_directories(root_);
+  }
+
+  void TearDown() override
+  {
+    boost::system::error_code ec;
+    fs::remove_all(root_, ec);
+  }
+
+  /// Seconds to download a 4x4 block of tiles (into an empty cache) on
+  /// concurrency connections
+  double download(const std::string& url, unsigned int concurrency,
+                  TileLoader::LoadStats& stats)
+  {
+    const fs::path cache = root_/("cache" + std::to_string(concurrency));
+    TileLoader base(cache.string(), url, 40.267463, -111.635655, 17, 0, 0);
+    auto loader = base.forTileRange(base.centerTileX(), base.centerTileX() + 3,
+                                    base.centerTileY(), base.centerTileY() + 3);
+    loader->setConcurrency(concurrency);
+    loader->setRetries(0);
+
+    const auto start = std::chrono::steady_clock::now();
+    loader->loadTiles();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    stats = loader->loadStats();
+    return elapsed.count();
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+TEST_F(TileLoaderTest, ParallelDownloadsHideLatency)
+{
+  const double latency = 0.2;
+  const unsigned int tiles = 16;
+
+  TileLoader::LoadStats stats;
+  double sequential, parallel;
+  {
+    SlowTileServer server(latency);
+    sequential = download(server.url(), 1, stats);
+    EXPECT_EQ(stats.downloaded, tiles);
+    EXPECT_EQ(server.maxActive(), 1u);
+  }
+  {
+    SlowTileServer server(latency);
+    parallel = download(server.url(), 8, stats);
+    EXPECT_EQ(stats.downloaded, tiles);
+    EXPECT_EQ(server.requests(), tiles);
+    EXPECT_GT(server.maxActive(), 1u);
+  }
+
+  // One round trip after the other, against two rounds of eight
+  EXPECT_GE(sequential, tiles*latency);
+  EXPECT_LT(parallel, sequential/3);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(TileLoaderTest, CachedTilesAreNotRequestedAgain)
+{
+  SlowTileServer server(0.01);
+  TileLoader::LoadStats stats;
+  download(server.url(), 8, stats);
+  EXPECT_EQ(stats.downloaded, 16u);
+
+  download(server.url(), 8, stats);
+  EXPECT_EQ(stats.cached, 16u);
+  EXPECT_EQ(stats.downloaded, 0u);
+  EXPECT_EQ(server.requests(), 16u);
+}
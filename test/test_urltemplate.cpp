@@ -0,0 +1,72 @@
+/**
+ * Expanding tile URL templates: every variable, and the text around them.
+ */
+
+#include <gtest/gtest.h>
+
+#include "gzsatellite/urltemplate.h"
+
+using namespace gzsatellite;
+
+TEST(UrlTemplateTest, ExpandsTileCoordinates)
+{
+  const UrlTemplate t("https://tile.example.com/{z}/{x}/{y}.png?key=abc");
+  EXPECT_EQ("https://tile.example.com/17/24890/49493.png?key=abc", t.expand(24890, 49493, 17));
+
+  // Names are case-insensitive; anything else in braces is kept
+  EXPECT_EQ("http://h/3/5/2/{style}", UrlTemplate("http://h/{Z}/{X}/{Y}/{style}").expand(5, 2, 3));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(UrlTemplateTest, BingQuadkeys)
+{
+  // Examples from the Bing Maps tile system documentation
+  const UrlTemplate t("http://ecn.t0.tiles.virtualearth.net/tiles/a{q}.jpeg?g=1");
+  EXPECT_EQ("http://ecn.t0.tiles.virtualearth.net/tiles/a213.jpeg?g=1", t.expand(3, 5, 3));
+
+  const UrlTemplate q("{q}");
+  EXPECT_EQ("0", q.expand(0, 0, 1));
+  EXPECT_EQ("1", q.expand(1, 0, 1));
+  EXPECT_EQ("2", q.expand(0, 1, 1));
+  EXPECT_EQ("3", q.expand(1, 1, 1));
+  EXPECT_EQ("", q.expand(0, 0, 0));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(UrlTemplateTest, FlippedRowsForTMS)
+{
+  const UrlTemplate t("{z}/{x}/{-y}");
+  EXPECT_EQ("3/5/6", t.expand(5, 1, 3));
+  EXPECT_EQ("3/5/7", t.expand(5, 0, 3));
+  EXPECT_EQ("3/5/0", t.expand(5, 7, 3));
+  EXPECT_EQ("0/0/0", t.expand(0, 0, 0));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(UrlTemplateTest, SubdomainsBySumOfCoordinates)
+{
+  // a, b and c by default, in turn along a row or a column
+  const UrlTemplate abc("https://{s}.tile.example.com/{z}/{x}/{y}.png");
+  EXPECT_EQ("https://a.tile.example.com/4/0/0.png", abc.expand(0, 0, 4));
+  EXPECT_EQ("https://b.tile.example.com/4/1/0.png", abc.expand(1, 0, 4));
+  EXPECT_EQ("https://c.tile.example.com/4/1/1.png", abc.expand(1, 1, 4));
+  EXPECT_EQ("https://a.tile.example.com/4/2/1.png", abc.expand(2, 1, 4));
+
+  // ...or from the given list, the same one for the same tile every time
+  const UrlTemplate list("http://mt{s:0,1,2,3}.example.com/{x}/{y}");
+  EXPECT_EQ("http://mt0.example.com/4/4", list.expand(4, 4, 5));
+  EXPECT_EQ("http://mt1.example.com/4/5", list.expand(4, 5, 5));
+  EXPECT_EQ("http://mt3.example.com/4/7", list.expand(4, 7, 5));
+  EXPECT_EQ(list.expand(4, 7, 5), list.expand(4, 7, 5));
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}